@@ -0,0 +1,195 @@
+/*
+ * band.c -- solvers for tridiagonal and banded linear systems
+ *
+ * Like gemm.c, this file is compiled twice: without DOUBLE it provides
+ * the float versions, with DOUBLE the double versions of the functions.
+ *
+ * (c) 2014 Prof Dr Andreas Mueller, Hochschule Rapperswil
+ */
+#include "band.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef DOUBLE
+#define	F	float
+#define	tridiagonal	stridiagonal
+#define	pcr	spcr
+#define	band_factor	sband_factor
+#define	band_solve	sband_solve
+#else
+#define	F	double
+#define	tridiagonal	dtridiagonal
+#define	pcr	dpcr
+#define	band_factor	dband_factor
+#define	band_solve	dband_solve
+#endif
+
+/**
+ * \brief Thomas algorithm for tridiagonal systems
+ *
+ * This is the Gauss algorithm specialized to tridiagonal matrices: the
+ * forward elimination only has to modify the diagonal (kept in the work
+ * array as the reduced superdiagonal) and the right hand side, the
+ * backward substitution only needs one row each. Total cost is O(n).
+ */
+int	tridiagonal(int n, const F *a, const F *b, const F *c, F *x, F *work) {
+	if (n <= 0) {
+		return 0;
+	}
+	// forward elimination: work[i] = c[i] / pivot
+	F	pivot = b[0];
+	if (pivot == 0) {
+		return -1;
+	}
+	work[0] = c[0] / pivot;
+	x[0] = x[0] / pivot;
+	for (int i = 1; i < n; i++) {
+		pivot = b[i] - a[i] * work[i - 1];
+		if (pivot == 0) {
+			return -1;
+		}
+		work[i] = (i < n - 1) ? c[i] / pivot : 0;
+		x[i] = (x[i] - a[i] * x[i - 1]) / pivot;
+	}
+
+	// backward substitution
+	for (int i = n - 2; i >= 0; i--) {
+		x[i] -= work[i] * x[i + 1];
+	}
+	return 0;
+}
+
+/**
+ * \brief Parallel cyclic reduction for tridiagonal systems
+ *
+ * In each step, every equation i eliminates its coupling to the
+ * equations i - s and i + s by subtracting suitable multiples of them,
+ * and is then coupled to i - 2s and i + 2s instead. After log2(n) steps
+ * all equations are decoupled. All equations of a step are independent,
+ * so each step is a parallel loop. The total work is O(n log n) instead
+ * of O(n), so this only pays off with many threads.
+ */
+int	pcr(int n, const F *a, const F *b, const F *c, F *x, F *work) {
+	if (n <= 0) {
+		return 0;
+	}
+	F	*a0 = work, *b0 = work + n, *c0 = work + 2 * n, *d0 = work + 3 * n;
+	F	*a1 = work + 4 * n, *b1 = work + 5 * n;
+	F	*c1 = work + 6 * n, *d1 = work + 7 * n;
+	memcpy(a0, a, n * sizeof(F));
+	memcpy(b0, b, n * sizeof(F));
+	memcpy(c0, c, n * sizeof(F));
+	memcpy(d0, x, n * sizeof(F));
+	a0[0] = 0;
+	c0[n - 1] = 0;
+	int	bad = 0;
+
+#pragma omp parallel firstprivate(a0, b0, c0, d0, a1, b1, c1, d1)
+	{
+	for (int s = 1; s < n; s *= 2) {
+#pragma omp for reduction(||:bad)
+		for (int i = 0; i < n; i++) {
+			if (((i - s >= 0) && (b0[i - s] == 0))
+				|| ((i + s < n) && (b0[i + s] == 0))) {
+				// zero pivot: the equation is passed on unchanged,
+				// so that the next step reads defined values, the
+				// result is discarded anyway
+				bad = 1;
+				a1[i] = a0[i];
+				b1[i] = b0[i];
+				c1[i] = c0[i];
+				d1[i] = d0[i];
+				continue;
+			}
+			F	ai = 0, bi = b0[i], ci = 0, di = d0[i];
+			if (i - s >= 0) {
+				F	alpha = -a0[i] / b0[i - s];
+				ai = alpha * a0[i - s];
+				bi += alpha * c0[i - s];
+				di += alpha * d0[i - s];
+			}
+			if (i + s < n) {
+				F	gamma = -c0[i] / b0[i + s];
+				ci = gamma * c0[i + s];
+				bi += gamma * a0[i + s];
+				di += gamma * d0[i + s];
+			}
+			a1[i] = ai;
+			b1[i] = bi;
+			c1[i] = ci;
+			d1[i] = di;
+		}
+		// the implicit barrier of the loop makes sure all threads
+		// are done before the buffers are swapped
+		F	*t;
+		t = a0; a0 = a1; a1 = t;
+		t = b0; b0 = b1; b1 = t;
+		t = c0; c0 = c1; c1 = t;
+		t = d0; d0 = d1; d1 = t;
+	}
+#pragma omp for reduction(||:bad)
+	for (int i = 0; i < n; i++) {
+		if (b0[i] == 0) {
+			bad = 1;
+		} else {
+			d0[i] = d0[i] / b0[i];
+		}
+	}
+	// bad is final after the barrier of the loop, x is only changed
+	// if the system could be solved
+	if (!bad) {
+#pragma omp for
+		for (int i = 0; i < n; i++) {
+			x[i] = d0[i];
+		}
+	}
+	}
+	return (bad) ? -1 : 0;
+}
+
+/**
+ * \brief LU decomposition of a band matrix without pivoting
+ *
+ * Without pivoting, the factors L and U have the same band structure as
+ * the matrix, so they can be stored in place. The cost is
+ * O(n kl ku) instead of O(n^3).
+ */
+int	band_factor(int n, int kl, int ku, F *ab) {
+	for (int k = 0; k < n; k++) {
+		F	pivot = BAND(ab, kl, ku, k, k);
+		if (pivot == 0) {
+			return -1;
+		}
+		int	imax = (k + kl < n - 1) ? k + kl : n - 1;
+		int	jmax = (k + ku < n - 1) ? k + ku : n - 1;
+		for (int i = k + 1; i <= imax; i++) {
+			F	l = BAND(ab, kl, ku, i, k) / pivot;
+			BAND(ab, kl, ku, i, k) = l;
+			for (int j = k + 1; j <= jmax; j++) {
+				BAND(ab, kl, ku, i, j) -= l * BAND(ab, kl, ku, k, j);
+			}
+		}
+	}
+	return 0;
+}
+
+/**
+ * \brief Solve a banded system using the LU decomposition from band_factor
+ */
+void	band_solve(int n, int kl, int ku, const F *ab, F *x) {
+	// forward substitution with L (unit diagonal)
+	for (int i = 0; i < n; i++) {
+		int	jmin = (i - kl > 0) ? i - kl : 0;
+		for (int j = jmin; j < i; j++) {
+			x[i] -= BAND(ab, kl, ku, i, j) * x[j];
+		}
+	}
+	// backward substitution with U
+	for (int i = n - 1; i >= 0; i--) {
+		int	jmax = (i + ku < n - 1) ? i + ku : n - 1;
+		for (int j = i + 1; j <= jmax; j++) {
+			x[i] -= BAND(ab, kl, ku, i, j) * x[j];
+		}
+		x[i] /= BAND(ab, kl, ku, i, i);
+	}
+}
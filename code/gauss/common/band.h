@@ -0,0 +1,50 @@
+/*
+ * band.h -- solvers for tridiagonal and banded linear systems
+ *
+ * (c) 2014 Prof Dr Andreas Mueller, Hochschule Rapperswil
+ */
+#ifndef _band_h
+#define _band_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Tridiagonal systems of dimension n: a is the subdiagonal (a[0] is not
+ * used), b the diagonal and c the superdiagonal (c[n-1] is not used).
+ * x contains the right hand side on entry and the solution on return.
+ * The Thomas algorithm needs n values of work space, parallel cyclic
+ * reduction needs 8 n values. The functions return -1 if they
+ * encounter a zero pivot, 0 otherwise.
+ */
+extern int	stridiagonal(int n, const float *a, const float *b,
+			const float *c, float *x, float *work);
+extern int	dtridiagonal(int n, const double *a, const double *b,
+			const double *c, double *x, double *work);
+
+extern int	spcr(int n, const float *a, const float *b, const float *c,
+			float *x, float *work);
+extern int	dpcr(int n, const double *a, const double *b, const double *c,
+			double *x, double *work);
+
+/*
+ * Banded systems with kl subdiagonals and ku superdiagonals. The matrix
+ * is stored row by row in band format, each row has kl + ku + 1 values,
+ * the element A(i,j) is at BAND(ab, kl, ku, i, j). The factor functions
+ * compute the LU decomposition without pivoting in place, the solve
+ * functions then overwrite the right hand side x with the solution.
+ */
+#define	BAND(_ab, _kl, _ku, _i, _j)	_ab[((_j) - (_i) + (_kl)) \
+						+ ((_kl) + (_ku) + 1) * (_i)]
+
+extern int	sband_factor(int n, int kl, int ku, float *ab);
+extern int	dband_factor(int n, int kl, int ku, double *ab);
+extern void	sband_solve(int n, int kl, int ku, const float *ab, float *x);
+extern void	dband_solve(int n, int kl, int ku, const double *ab, double *x);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _band_h */
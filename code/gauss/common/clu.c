@@ -0,0 +1,289 @@
+/*
+ * clu.c -- OpenCL utility functions shared by the OpenCL programs
+ *
+ * Compiling an OpenCL program from source takes hundreds of
+ * milliseconds on some platforms, which dominates short runs. The
+ * binary produced by the OpenCL compiler can be retrieved with
+ * clGetProgramInfo and later be loaded with clCreateProgramWithBinary,
+ * so we keep it in a cache directory. The file name is a hash of
+ * everything that influences the binary: device, driver version,
+ * source code and build flags.
+ *
+ * (c) 2014 Prof Dr Andreas Mueller, Hochschule Rapperswil
+ */
+#include "clu.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+int	clu_debug = 0;
+
+/**
+ * \brief Read a complete file into a malloced buffer
+ */
+static char	*readfile(const char *filename, size_t *length) {
+	// first check that the file exists, but using stat will also give
+	// the file size which can later be used to size a buffer
+	struct stat	sb;
+	if (stat(filename, &sb) < 0) {
+		return NULL;
+	}
+
+	// open the file for reading
+	int	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	// read the file data into a memory buffer, with an additional
+	// terminating null byte so it can also be used as a string
+	char	*data = (char *)malloc(sb.st_size + 1);
+	if ((NULL == data) || (sb.st_size != read(fd, data, sb.st_size))) {
+		free(data);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	data[sb.st_size] = '\0';
+	*length = sb.st_size;
+	return data;
+}
+
+/*
+ * \brief Auxiliary function to read OpenCL code from a file
+ *
+ * This function reads the contents of a file and invokes the
+ * clCreateProgramWithSource to create a program.
+ */
+cl_program	cluCreateProgramWithFile(cl_context context,
+			const char *filename, cl_int *err) {
+	size_t	length[1];
+	char	*source[1];
+	source[0] = readfile(filename, &length[0]);
+	if (NULL == source[0]) {
+		*err = -1;
+		return NULL;
+	}
+
+	// use the clCreateProgramWithSource function to create the program
+	cl_program	program;
+	program = clCreateProgramWithSource(context, 1, (const char **)source,
+		length, err);
+	free(source[0]);
+	return program;
+}
+
+/**
+ * \brief FNV-1a hash, used to build the cache key
+ */
+static uint64_t	hash(uint64_t h, const void *data, size_t length) {
+	const unsigned char	*p = (const unsigned char *)data;
+	for (size_t i = 0; i < length; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/**
+ * \brief Add a device info string to the hash
+ */
+static uint64_t	hash_device_info(uint64_t h, cl_device_id device,
+	cl_device_info param) {
+	char	value[1024];
+	size_t	size = 0;
+	memset(value, 0, sizeof(value));
+	if (CL_SUCCESS == clGetDeviceInfo(device, param, sizeof(value) - 1,
+		value, &size)) {
+		h = hash(h, value, strlen(value) + 1);
+	}
+	return h;
+}
+
+/**
+ * \brief Compute the name of the cache file for a program
+ *
+ * Returns 0 if the cache is disabled or no directory is available.
+ */
+static int	cachefilename(char *name, size_t size, cl_device_id device,
+	const char *source, size_t length, const char *flags) {
+	if (getenv("CLU_NOCACHE")) {
+		return 0;
+	}
+
+	// find and create the cache directory
+	char	dir[1024];
+	const char	*d = getenv("CLU_CACHE");
+	if (d) {
+		snprintf(dir, sizeof(dir), "%s", d);
+	} else {
+		const char	*home = getenv("HOME");
+		if (NULL == home) {
+			return 0;
+		}
+		snprintf(dir, sizeof(dir), "%s/.cache", home);
+		mkdir(dir, 0755);
+		snprintf(dir, sizeof(dir), "%s/.cache/clu", home);
+	}
+	if ((mkdir(dir, 0755) < 0) && (errno != EEXIST)) {
+		fprintf(stderr, "%s:%d: cannot create cache directory %s: %s\n",
+			__FILE__, __LINE__, dir, strerror(errno));
+		return 0;
+	}
+
+	// the key covers everything that influences the binary
+	uint64_t	h = 0xcbf29ce484222325ULL;
+	h = hash_device_info(h, device, CL_DEVICE_VENDOR);
+	h = hash_device_info(h, device, CL_DEVICE_NAME);
+	h = hash_device_info(h, device, CL_DEVICE_VERSION);
+	h = hash_device_info(h, device, CL_DRIVER_VERSION);
+	h = hash(h, flags, strlen(flags) + 1);
+	h = hash(h, source, length);
+	snprintf(name, size, "%s/%016llx.bin", dir, (unsigned long long)h);
+	return 1;
+}
+
+/**
+ * \brief Display the build log of a program
+ */
+static void	display_log(cl_program program, cl_device_id device) {
+	size_t	l = 32 * 1024;
+	char	*log = (char *)malloc(l);
+	cl_int	err = clGetProgramBuildInfo(program, device,
+		CL_PROGRAM_BUILD_LOG, l, log, &l);
+	if (err) {
+		fprintf(stderr, "%s:%d: cannot retrieve log: %d\n",
+			__FILE__, __LINE__, err);
+	} else {
+		fprintf(stderr, "compile log:\n%*s\n", (int)l, log);
+	}
+	free(log);
+}
+
+/**
+ * \brief Try to load a program binary from the cache
+ */
+static cl_program	loadbinary(cl_context context, cl_device_id device,
+	const char *filename, const char *flags) {
+	size_t	length;
+	unsigned char	*binary = (unsigned char *)readfile(filename, &length);
+	if (NULL == binary) {
+		return NULL;
+	}
+	cl_int	status, err;
+	cl_program	program = clCreateProgramWithBinary(context, 1, &device,
+		&length, (const unsigned char **)&binary, &status, &err);
+	free(binary);
+	if ((NULL == program) || (err != CL_SUCCESS)
+		|| (status != CL_SUCCESS)) {
+		if (program) {
+			clReleaseProgram(program);
+		}
+		return NULL;
+	}
+
+	// even a binary program has to be built before kernels can be used
+	if (CL_SUCCESS != clBuildProgram(program, 1, &device, flags,
+		NULL, NULL)) {
+		clReleaseProgram(program);
+		return NULL;
+	}
+	return program;
+}
+
+/**
+ * \brief Write the binary of a built program to the cache
+ *
+ * The binary is written to a temporary file which is then renamed, so
+ * that concurrent runs never see a partially written file.
+ */
+static void	savebinary(cl_program program, const char *filename) {
+	size_t	length = 0;
+	if (CL_SUCCESS != clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES,
+		sizeof(length), &length, NULL) || (length == 0)) {
+		return;
+	}
+	unsigned char	*binary = (unsigned char *)malloc(length);
+	if (CL_SUCCESS != clGetProgramInfo(program, CL_PROGRAM_BINARIES,
+		sizeof(binary), &binary, NULL)) {
+		free(binary);
+		return;
+	}
+	char	tmpname[1200];
+	snprintf(tmpname, sizeof(tmpname), "%s.%d", filename, (int)getpid());
+	FILE	*f = fopen(tmpname, "wb");
+	if (f) {
+		size_t	written = fwrite(binary, 1, length, f);
+		fclose(f);
+		if ((written != length) || (rename(tmpname, filename) < 0)) {
+			unlink(tmpname);
+		} else if (clu_debug) {
+			fprintf(stderr, "%s:%d: %lu bytes of binary saved "
+				"in %s\n", __FILE__, __LINE__,
+				(unsigned long)length, filename);
+		}
+	}
+	free(binary);
+}
+
+/**
+ * \brief Create and build a program, using the binary cache if possible
+ */
+cl_program	cluBuildProgramCached(cl_context context, cl_device_id device,
+			const char *filename, const char *flags, cl_int *err) {
+	size_t	length;
+	char	*source = readfile(filename, &length);
+	if (NULL == source) {
+		fprintf(stderr, "%s:%d: cannot read %s\n", __FILE__, __LINE__,
+			filename);
+		*err = -1;
+		return NULL;
+	}
+
+	// try the cache first
+	char	cachename[1100];
+	int	cached = cachefilename(cachename, sizeof(cachename), device,
+			source, length, flags);
+	cl_program	program = NULL;
+	if (cached) {
+		program = loadbinary(context, device, cachename, flags);
+		if (program) {
+			if (clu_debug) {
+				fprintf(stderr, "%s:%d: program loaded from "
+					"%s\n", __FILE__, __LINE__, cachename);
+			}
+			free(source);
+			*err = CL_SUCCESS;
+			return program;
+		}
+	}
+
+	// build the program from the source
+	const char	*sources[1] = { source };
+	program = clCreateProgramWithSource(context, 1, sources, &length, err);
+	free(source);
+	if (NULL == program) {
+		fprintf(stderr, "%s:%d: cannot create program: %d\n",
+			__FILE__, __LINE__, *err);
+		return NULL;
+	}
+	*err = clBuildProgram(program, 1, &device, flags, NULL, NULL);
+	if (*err) {
+		fprintf(stderr, "%s:%d: cannot compile program: %d\n",
+			__FILE__, __LINE__, *err);
+		display_log(program, device);
+		clReleaseProgram(program);
+		return NULL;
+	}
+
+	// remember the binary for the next run
+	if (cached) {
+		savebinary(program, cachename);
+	}
+	return program;
+}
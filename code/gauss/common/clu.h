@@ -0,0 +1,36 @@
+/*
+ * clu.h -- OpenCL utility functions shared by the OpenCL programs
+ *
+ * (c) 2014 Prof Dr Andreas Mueller, Hochschule Rapperswil
+ */
+#ifndef _clu_h
+#define _clu_h
+
+#include <CL/opencl.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern int	clu_debug;
+
+/* create a program from the source in a file */
+extern cl_program	cluCreateProgramWithFile(cl_context context,
+				const char *filename, cl_int *err);
+
+/*
+ * Create and build a program for a single device. Built binaries are
+ * cached in the directory $CLU_CACHE (default $HOME/.cache/clu), keyed
+ * by device, driver version, source and build flags, so that later runs
+ * can skip the compilation. Setting CLU_NOCACHE disables the cache.
+ * The build log is displayed if compilation fails.
+ */
+extern cl_program	cluBuildProgramCached(cl_context context,
+				cl_device_id device, const char *filename,
+				const char *flags, cl_int *err);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _clu_h */
@@ -0,0 +1,341 @@
+/*
+ * gemm.c -- packed, register blocked, parallel matrix multiplication
+ *
+ * The algorithm follows the usual structure of optimized BLAS libraries:
+ * C is computed in column panels of width NC, the k dimension is cut
+ * into slices of length KC. For each slice, a KC x NC panel of B is
+ * packed into a contiguous buffer, so that it stays in the L3 cache.
+ * Each thread then packs an MC x KC block of A (which fits in the L2
+ * cache) and calls the micro kernel, which computes an MR x NR tile of
+ * C entirely in registers, reading A and B sequentially from the packed
+ * buffers. The micro kernel is written with the intrinsics of the
+ * instruction set the file is compiled for.
+ *
+ * This file is compiled twice: without DOUBLE it provides sgemm,
+ * with DOUBLE it provides dgemm.
+ *
+ * (c) 2014 Prof Dr Andreas Mueller, Hochschule Rapperswil
+ */
+#include "gemm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef DOUBLE
+#define	F	float
+#define	gemm	sgemm
+#define	gemm_isa	sgemm_isa
+#define	gemm_flops_per_cycle	sgemm_flops_per_cycle
+#else
+#define	F	double
+#define	gemm	dgemm
+#define	gemm_isa	dgemm_isa
+#define	gemm_flops_per_cycle	dgemm_flops_per_cycle
+#endif
+
+/*
+ * Instruction set specific definitions for the micro kernel. VW is the
+ * number of F values in a vector register, FLOPS the number of floating
+ * point operations per cycle (two FMA units on AVX2 and AVX-512 cores,
+ * separate add and multiply units on SSE2 cores).
+ */
+#if defined(__AVX512F__)
+#include <immintrin.h>
+#define	ISA	"avx512"
+#ifndef DOUBLE
+#define	VEC	__m512
+#define	VW	16
+#define	VLOAD	_mm512_loadu_ps
+#define	VSTORE	_mm512_storeu_ps
+#define	VBCAST	_mm512_set1_ps
+#define	VFMA	_mm512_fmadd_ps
+#else
+#define	VEC	__m512d
+#define	VW	8
+#define	VLOAD	_mm512_loadu_pd
+#define	VSTORE	_mm512_storeu_pd
+#define	VBCAST	_mm512_set1_pd
+#define	VFMA	_mm512_fmadd_pd
+#endif
+#define	FLOPS	(2 * 2 * VW)
+#elif defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#define	ISA	"avx2"
+#ifndef DOUBLE
+#define	VEC	__m256
+#define	VW	8
+#define	VLOAD	_mm256_loadu_ps
+#define	VSTORE	_mm256_storeu_ps
+#define	VBCAST	_mm256_set1_ps
+#define	VFMA	_mm256_fmadd_ps
+#else
+#define	VEC	__m256d
+#define	VW	4
+#define	VLOAD	_mm256_loadu_pd
+#define	VSTORE	_mm256_storeu_pd
+#define	VBCAST	_mm256_set1_pd
+#define	VFMA	_mm256_fmadd_pd
+#endif
+#define	FLOPS	(2 * 2 * VW)
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define	ISA	"sse2"
+#ifndef DOUBLE
+#define	VEC	__m128
+#define	VW	4
+#define	VLOAD	_mm_loadu_ps
+#define	VSTORE	_mm_storeu_ps
+#define	VBCAST	_mm_set1_ps
+#define	VFMA(a, b, c)	_mm_add_ps(_mm_mul_ps(a, b), c)
+#else
+#define	VEC	__m128d
+#define	VW	2
+#define	VLOAD	_mm_loadu_pd
+#define	VSTORE	_mm_storeu_pd
+#define	VBCAST	_mm_set1_pd
+#define	VFMA(a, b, c)	_mm_add_pd(_mm_mul_pd(a, b), c)
+#endif
+#define	FLOPS	(2 * VW)
+#else
+#define	ISA	"generic"
+#define	VW	1
+#define	FLOPS	2
+#endif
+
+/*
+ * Register and cache blocking parameters. The micro kernel keeps
+ * MR x NR values of C in 2 * MR vector registers, 12 for MR = 6, which
+ * leaves enough registers for the B vectors and the broadcast A value.
+ */
+#ifdef VEC
+#define	MR	6
+#define	NR	(2 * VW)
+#else
+#define	MR	4
+#define	NR	4
+#endif
+#define	KC	256
+#define	MC	(16 * MR)
+#define	NC	(128 * NR)
+
+const char	*gemm_isa() {
+	return ISA;
+}
+
+int	gemm_flops_per_cycle() {
+	return FLOPS;
+}
+
+/**
+ * \brief Micro kernel: C += A B for one MR x NR tile
+ *
+ * a points to kc packed columns of MR values, b to kc packed rows of
+ * NR values.
+ */
+static void	kernel(int kc, const F *a, const F *b, F *c, int ldc) {
+#ifdef VEC
+	VEC	c0[MR], c1[MR];
+	for (int i = 0; i < MR; i++) {
+		c0[i] = VLOAD(c + i * ldc);
+		c1[i] = VLOAD(c + i * ldc + VW);
+	}
+	for (int p = 0; p < kc; p++) {
+		VEC	b0 = VLOAD(b);
+		VEC	b1 = VLOAD(b + VW);
+		for (int i = 0; i < MR; i++) {
+			VEC	ai = VBCAST(a[i]);
+			c0[i] = VFMA(ai, b0, c0[i]);
+			c1[i] = VFMA(ai, b1, c1[i]);
+		}
+		a += MR;
+		b += NR;
+	}
+	for (int i = 0; i < MR; i++) {
+		VSTORE(c + i * ldc, c0[i]);
+		VSTORE(c + i * ldc + VW, c1[i]);
+	}
+#else
+	F	t[MR][NR];
+	for (int i = 0; i < MR; i++) {
+		for (int j = 0; j < NR; j++) {
+			t[i][j] = c[i * ldc + j];
+		}
+	}
+	for (int p = 0; p < kc; p++) {
+		for (int i = 0; i < MR; i++) {
+			for (int j = 0; j < NR; j++) {
+				t[i][j] += a[i] * b[j];
+			}
+		}
+		a += MR;
+		b += NR;
+	}
+	for (int i = 0; i < MR; i++) {
+		for (int j = 0; j < NR; j++) {
+			c[i * ldc + j] = t[i][j];
+		}
+	}
+#endif
+}
+
+/**
+ * \brief Micro kernel for partial tiles at the lower and right border
+ *
+ * The tile is computed in a local buffer, only the mr x nr values
+ * inside the matrix are transferred.
+ */
+static void	edge_kernel(int mr, int nr, int kc, const F *a, const F *b,
+	F *c, int ldc) {
+	F	t[MR * NR];
+	memset(t, 0, sizeof(t));
+	kernel(kc, a, b, t, NR);
+	for (int i = 0; i < mr; i++) {
+		for (int j = 0; j < nr; j++) {
+			c[i * ldc + j] += t[i * NR + j];
+		}
+	}
+}
+
+/**
+ * \brief Pack an mc x kc block of A, multiplied by alpha
+ *
+ * The block is stored as slivers of MR rows, each sliver column by
+ * column, missing rows at the border are filled with zeros.
+ */
+static void	pack_a(int mc, int kc, F alpha, const F *a, int lda, F *pa) {
+	for (int i0 = 0; i0 < mc; i0 += MR) {
+		int	mr = (mc - i0 < MR) ? mc - i0 : MR;
+		for (int p = 0; p < kc; p++) {
+			for (int i = 0; i < mr; i++) {
+				pa[i] = alpha * a[(i0 + i) * lda + p];
+			}
+			for (int i = mr; i < MR; i++) {
+				pa[i] = 0;
+			}
+			pa += MR;
+		}
+	}
+}
+
+/**
+ * \brief Pack the NR column sliver number s of a kc x nc panel of B
+ */
+static void	pack_b(int s, int nc, int kc, const F *b, int ldb, F *pb) {
+	int	j0 = s * NR;
+	int	nr = (nc - j0 < NR) ? nc - j0 : NR;
+	pb += j0 * kc;
+	for (int p = 0; p < kc; p++) {
+		const F	*bp = b + p * ldb + j0;
+		for (int j = 0; j < nr; j++) {
+			pb[j] = bp[j];
+		}
+		for (int j = nr; j < NR; j++) {
+			pb[j] = 0;
+		}
+		pb += NR;
+	}
+}
+
+/**
+ * \brief Compute C = alpha A B + beta C
+ */
+void	gemm(int m, int n, int k, F alpha, const F *a, int lda,
+	const F *b, int ldb, F beta, F *c, int ldc) {
+	if ((m <= 0) || (n <= 0)) {
+		return;
+	}
+
+	// scale C by beta first, so that the kernels only have to add
+#pragma omp parallel for
+	for (int i = 0; i < m; i++) {
+		F	*ci = c + i * ldc;
+		if (beta == 0) {
+			memset(ci, 0, n * sizeof(F));
+		} else if (beta != 1) {
+			for (int j = 0; j < n; j++) {
+				ci[j] *= beta;
+			}
+		}
+	}
+	if ((k <= 0) || (alpha == 0)) {
+		return;
+	}
+
+	// the packed panel of B is shared by all threads
+	F	*pb = (F *)malloc(KC * (NC + NR) * sizeof(F));
+	if (NULL == pb) {
+		fprintf(stderr, "%s:%d: cannot allocate packing buffer\n",
+			__FILE__, __LINE__);
+		exit(EXIT_FAILURE);
+	}
+
+	// one parallel region for all blocks, every thread steps through
+	// the jc and pc loops and allocates its buffer for A only once
+	int	failed = 0;
+#pragma omp parallel
+	{
+	// each thread packs its own blocks of A
+	F	*pa = (F *)malloc(MC * KC * sizeof(F));
+	if (NULL == pa) {
+#pragma omp atomic write
+		failed = 1;
+	}
+	// all threads must see the same value of failed, so that they
+	// all skip the loops and meet at the same barriers
+#pragma omp barrier
+	int	skip;
+#pragma omp atomic read
+	skip = failed;
+	for (int jc = 0; (!skip) && (jc < n); jc += NC) {
+		int	nc = (n - jc < NC) ? n - jc : NC;
+		int	slivers = (nc + NR - 1) / NR;
+		for (int pc = 0; pc < k; pc += KC) {
+			int	kc = (k - pc < KC) ? k - pc : KC;
+			// pack the B panel, each thread some of the slivers,
+			// the barrier at the end of the loop makes sure it
+			// is complete before it is used
+#pragma omp for
+			for (int s = 0; s < slivers; s++) {
+				pack_b(s, nc, kc, b + pc * ldb + jc, ldb, pb);
+			}
+
+			// compute the rows of C of the blocks of A, the
+			// barrier at the end keeps the panel of B until all
+			// threads are done with it
+#pragma omp for schedule(dynamic)
+			for (int ic = 0; ic < m; ic += MC) {
+				int	mc = (m - ic < MC) ? m - ic : MC;
+				pack_a(mc, kc, alpha, a + ic * lda + pc, lda,
+					pa);
+				for (int s = 0; s < slivers; s++) {
+					int	jr = s * NR;
+					int	nr = (nc - jr < NR) ? nc - jr : NR;
+					const F	*pbs = pb + jr * kc;
+					for (int ir = 0; ir < mc; ir += MR) {
+						int	mr = (mc - ir < MR)
+							? mc - ir : MR;
+						F	*cij = c + (ic + ir) * ldc
+							+ jc + jr;
+						const F	*pas = pa + ir * kc;
+						if ((mr == MR) && (nr == NR)) {
+							kernel(kc, pas, pbs,
+								cij, ldc);
+						} else {
+							edge_kernel(mr, nr, kc,
+								pas, pbs,
+								cij, ldc);
+						}
+					}
+				}
+			}
+		}
+	}
+	free(pa);
+	}
+	if (failed) {
+		fprintf(stderr, "%s:%d: cannot allocate packing buffer\n",
+			__FILE__, __LINE__);
+		exit(EXIT_FAILURE);
+	}
+	free(pb);
+}
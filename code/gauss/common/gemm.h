@@ -0,0 +1,38 @@
+/*
+ * gemm.h -- matrix-matrix multiplication
+ *
+ * (c) 2014 Prof Dr Andreas Mueller, Hochschule Rapperswil
+ */
+#ifndef _gemm_h
+#define _gemm_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * C = alpha A B + beta C, where A is m x k, B is k x n and C is m x n.
+ * All matrices are stored row by row as with the M macro, lda, ldb
+ * and ldc are the row lengths, so that blocks of larger matrices
+ * can be used without copying.
+ */
+extern void	sgemm(int m, int n, int k, float alpha,
+			const float *a, int lda, const float *b, int ldb,
+			float beta, float *c, int ldc);
+extern void	dgemm(int m, int n, int k, double alpha,
+			const double *a, int lda, const double *b, int ldb,
+			double beta, double *c, int ldc);
+
+/* instruction set the micro kernel was compiled for */
+extern const char	*sgemm_isa();
+extern const char	*dgemm_isa();
+
+/* floating point operations per cycle and core the kernel can reach */
+extern int	sgemm_flops_per_cycle();
+extern int	dgemm_flops_per_cycle();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _gemm_h */
@@ -0,0 +1,136 @@
+/*
+ * gemmbench.c -- measure the performance of the matrix multiplication
+ *
+ * For each matrix size given on the command line, this program
+ * multiplies two random n x n matrices and reports the GFLOP/s
+ * achieved, and how much of the theoretical peak performance of the
+ * machine this is.
+ *
+ * (c) 2014 Prof Dr Andreas Mueller, Hochschule Rapperswil
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "common.h"
+#include "gemm.h"
+
+/**
+ * \brief Find the clock frequency in GHz from /proc/cpuinfo
+ */
+static double	cpu_ghz() {
+	FILE	*f = fopen("/proc/cpuinfo", "r");
+	if (NULL == f) {
+		return 0;
+	}
+	char	line[1024];
+	double	mhz = 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (0 == strncmp(line, "cpu MHz", 7)) {
+			char	*colon = strchr(line, ':');
+			if (colon) {
+				mhz = atof(colon + 1);
+			}
+			break;
+		}
+	}
+	fclose(f);
+	return mhz / 1000.;
+}
+
+static void	usage(const char *progname) {
+	fprintf(stderr, "usage: %s [ -D ] [ -f ghz ] [ -r repeats ] n ...\n",
+		progname);
+	fprintf(stderr, "measure matrix multiplication performance\n");
+	fprintf(stderr, "options:\n");
+	fprintf(stderr, " -D         use double precision (default float)\n");
+	fprintf(stderr, " -f ghz     clock frequency for the peak performance\n");
+	fprintf(stderr, "            (default from /proc/cpuinfo)\n");
+	fprintf(stderr, " -r repeats number of multiplications per size\n");
+}
+
+int	main(int argc, char *argv[]) {
+	int	dbl = 0;
+	int	repeats = 3;
+	double	ghz = 0;
+	int	c;
+	while (EOF != (c = getopt(argc, argv, "Df:r:?")))
+		switch (c) {
+		case 'D':
+			dbl = 1;
+			break;
+		case 'f':
+			ghz = atof(optarg);
+			break;
+		case 'r':
+			repeats = atoi(optarg);
+			break;
+		case '?':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		}
+	if (ghz <= 0) {
+		ghz = cpu_ghz();
+	}
+	int	threads = 1;
+#ifdef _OPENMP
+	threads = omp_get_max_threads();
+#endif
+
+	// theoretical peak of the machine
+	int	flops = (dbl) ? dgemm_flops_per_cycle()
+				: sgemm_flops_per_cycle();
+	double	peak = threads * ghz * flops;
+	fprintf(stderr, "%s %s kernel, %d threads, %.2f GHz, "
+		"peak %.1f GFLOP/s\n", (dbl) ? "dgemm" : "sgemm",
+		(dbl) ? dgemm_isa() : sgemm_isa(), threads, ghz, peak);
+
+	init_gettime();
+	printf("n,time,gflops,percent\n");
+	for (; optind < argc; optind++) {
+		int	n = atoi(argv[optind]);
+		if (n <= 0) {
+			fprintf(stderr, "not a valid number: %s\n",
+				argv[optind]);
+			continue;
+		}
+
+		// perform the multiplications, keep the best time
+		double	best = -1;
+		if (dbl) {
+			double	*a = random_double_matrix(n, n);
+			double	*b = random_double_matrix(n, n);
+			double	*r = random_double_matrix(n, n);
+			for (int i = 0; i < repeats; i++) {
+				double	start = gettime();
+				dgemm(n, n, n, 1, a, n, b, n, 0, r, n);
+				double	t = gettime() - start;
+				if ((best < 0) || (t < best)) {
+					best = t;
+				}
+			}
+			free(r); free(b); free(a);
+		} else {
+			float	*a = random_float_matrix(n, n);
+			float	*b = random_float_matrix(n, n);
+			float	*r = random_float_matrix(n, n);
+			for (int i = 0; i < repeats; i++) {
+				double	start = gettime();
+				sgemm(n, n, n, 1, a, n, b, n, 0, r, n);
+				double	t = gettime() - start;
+				if ((best < 0) || (t < best)) {
+					best = t;
+				}
+			}
+			free(r); free(b); free(a);
+		}
+		double	gflops = 2. * n * n * (double)n / best / 1e9;
+		printf("%d,%.6f,%.2f,%.1f\n", n, best, gflops,
+			(peak > 0) ? 100 * gflops / peak : 0);
+		fflush(stdout);
+	}
+	return EXIT_SUCCESS;
+}
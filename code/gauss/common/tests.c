@@ -8,6 +8,8 @@
 #include <unistd.h>
 #include <math.h>
 #include "common.h"
+#include "gemm.h"
+#include "band.h"
 
 void	timetest() {
 	init_gettime();
@@ -33,7 +35,83 @@ void	random_matrix_test() {
 	display_float_matrix(stdout, a, 10, 20);
 }
 
+/**
+ * \brief compare dgemm with the naive triple loop on odd sizes
+ */
+void	gemm_test() {
+	int	m = 123, n = 301, k = 257;
+	double	*a = random_double_matrix(m, k);
+	double	*b = random_double_matrix(k, n);
+	double	*c = random_double_matrix(m, n);
+	double	*r = random_double_matrix(m, n);
+	for (int i = 0; i < m; i++) {
+		for (int j = 0; j < n; j++) {
+			double	s = 0;
+			for (int p = 0; p < k; p++) {
+				s += M(a, k, i, p) * M(b, n, p, j);
+			}
+			M(r, n, i, j) = 2 * s + 0.5 * M(c, n, i, j);
+		}
+	}
+	dgemm(m, n, k, 2, a, k, b, n, 0.5, c, n);
+	double	err = 0;
+	for (int i = 0; i < m * n; i++) {
+		if (fabs(c[i] - r[i]) > err) {
+			err = fabs(c[i] - r[i]);
+		}
+	}
+	printf("gemm error: %g %s\n", err, (err < 1e-10) ? "ok" : "FAILED");
+	free(r); free(c); free(b); free(a);
+}
+
+/**
+ * \brief solve the same tridiagonal system with all band solvers
+ */
+void	band_test() {
+	int	n = 1000;
+	double	*a = random_double_matrix(n, 1);
+	double	*b = random_double_matrix(n, 1);
+	double	*c = random_double_matrix(n, 1);
+	double	*x = random_double_matrix(n, 1);
+	double	*ab = (double *)calloc(3 * n, sizeof(double));
+	double	*work = (double *)malloc(8 * n * sizeof(double));
+	double	*x1 = (double *)malloc(n * sizeof(double));
+	double	*x2 = (double *)malloc(n * sizeof(double));
+	double	*x3 = (double *)malloc(n * sizeof(double));
+	for (int i = 0; i < n; i++) {
+		b[i] += 2;
+		BAND(ab, 1, 1, i, i) = b[i];
+		if (i > 0) {
+			BAND(ab, 1, 1, i, i - 1) = a[i];
+		}
+		if (i < n - 1) {
+			BAND(ab, 1, 1, i, i + 1) = c[i];
+		}
+		x1[i] = x2[i] = x3[i] = x[i];
+	}
+	dtridiagonal(n, a, b, c, x1, work);
+	dpcr(n, a, b, c, x2, work);
+	dband_factor(n, 1, 1, ab);
+	dband_solve(n, 1, 1, ab, x3);
+
+	// residual of the Thomas solution, and differences
+	double	err = 0;
+	for (int i = 0; i < n; i++) {
+		double	r = b[i] * x1[i] - x[i];
+		if (i > 0) { r += a[i] * x1[i - 1]; }
+		if (i < n - 1) { r += c[i] * x1[i + 1]; }
+		err = fmax(err, fabs(r));
+		err = fmax(err, fabs(x1[i] - x2[i]));
+		err = fmax(err, fabs(x1[i] - x3[i]));
+	}
+	printf("band error: %g %s\n", err, (err < 1e-10) ? "ok" : "FAILED");
+	free(x3); free(x2); free(x1); free(work); free(ab);
+	free(x); free(c); free(b); free(a);
+}
+
 int	main(int argc, char *argv[]) {
 	random_matrix_test();
+	gemm_test();
+	band_test();
 	return EXIT_SUCCESS;
 }
@@ -10,6 +10,7 @@
 #include <errno.h>
 #include <string.h>
 #include <common.h>
+#include <clu.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <alloca.h>
@@ -18,48 +19,50 @@
 
 int	debug = 0;
 int	vectorlength = 1;
+int	profiling = 0;		// report transfer and kernel times separately
+int	batch = 0;		// number of matrices in double buffered mode
 
-/*
- * \brief Auxiliary function to read OpenCL code from a file
+/**
+ * \brief Get the execution time of a command from its profiling info
  *
- * This function reads the contents of a file and invokes the
- * clCreateProgramWithSource to create a program.
+ * This only works if the command queue was created with the
+ * CL_QUEUE_PROFILING_ENABLE property.
  */
-cl_program	cluCreateProgramWithFile(cl_context context,
-			const char *filename, cl_int *err) {
-	// first check that the file exists, but using stat will also give
-	// the file size which can later be used to size a buffer
-	struct stat	sb;
-	if (stat(filename, &sb) < 0) {
-		*err = -1;
-		return NULL;
-	}
-
-	// open the file for reading
-	int	fd = open(filename, O_RDONLY);
-	if (fd < 0) {
-		*err = -1;
-		return NULL;
-	}
-
-	// read the file data into a memory buffer, allocated on the stack
-	// from the file size info in the stat structure received previously
-	size_t	length[1];
-	length[0] = sb.st_size;
-	char	*source[1];
-	source[0] = alloca(sb.st_size);
-	if (sb.st_size != read(fd, source[0], sb.st_size)) {
-		*err = -1;
-		return NULL;
-	}
-	close(fd);
-
-	// use the clCreateProgramWithSource function to create the program
-	cl_program	program;
-	program = clCreateProgramWithSource(context, 1, (const char **)source,
-		length, err);
-
-	return program;
+static double	event_seconds(cl_event event) {
+	cl_ulong	start = 0, end = 0;
+	clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START,
+		sizeof(start), &start, NULL);
+	clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END,
+		sizeof(end), &end, NULL);
+	return (end - start) * 1e-9;
+}
+
+/**
+ * \brief Compute a suitable work group size for an n x n matrix
+ */
+static size_t	workgroup_size(size_t local, unsigned int n) {
+	size_t	global = n;
+	if (n <= local) {
+		// the matrix size is small als the work group size, so we can 
+		// make each row of the matrix into a work group item
+		global = n;
+	} else {
+		// the matrix size is too large. To evenly distribute the
+		// work, we have to divide the number of rows into chunks of
+		// the same size, so that there are no more chunks than the
+		// workgroup size allows. Thus we check all numbers starting
+		// at the work group size down to 1 whether it divides the
+		// matrix size. This then is a suitable number of chunks
+		global = local + 1;
+		do {
+			global--;
+		} while (n % global);
+	}
+	if (debug) {
+		fprintf(stderr, "%s:%d: global: %ld, max local: %ld\n",
+			__FILE__, __LINE__, global, local);
+	}
+	return global;
 }
 
 /**
@@ -71,6 +74,8 @@ int	gauss_experiment(cl_context context, cl_command_queue commands,
 
 	// initialize the data, with the right size
 	float	*a = NULL, *b = NULL;
+	cl_mem	input = NULL, output = NULL;
+	cl_event	events[3] = { NULL, NULL, NULL };
 	a = random_float_matrix(n, n);
 	if (NULL == a) {
 		fprintf(stderr, "%s:%d: cannot allocate memory: %s\n",
@@ -94,9 +99,6 @@ int	gauss_experiment(cl_context context, cl_command_queue commands,
 	// start time measurement
 	double	start = gettime();
 
-	// allocate the OpenCL memory buffers
-	cl_mem	input = NULL, output = NULL;
-
 	// create input buffer
 	input = clCreateBuffer(context, CL_MEM_READ_ONLY,
 		sizeof(float) * n * n, NULL, NULL);
@@ -123,7 +125,7 @@ int	gauss_experiment(cl_context context, cl_command_queue commands,
 
 	// copy the input data to the queue
 	int	err = clEnqueueWriteBuffer(commands, input, CL_TRUE, 0,
-			sizeof(float) * n * n, a, 0, NULL, NULL);
+			sizeof(float) * n * n, a, 0, NULL, &events[0]);
 	if (err != CL_SUCCESS) {
 		fprintf(stderr, "%s:%d: cannot enqueue the matrix: %d\n",
 			__FILE__, __LINE__, err);
@@ -151,32 +153,12 @@ int	gauss_experiment(cl_context context, cl_command_queue commands,
 	}
 
 	// compute a suitable work group size
-	size_t	global = n;
-	if (n <= local) {
-		// the matrix size is small als the work group size, so we can 
-		// make each row of the matrix into a work group item
-		global = n;
-	} else {
-		// the matrix size is too large. To evenly distribute the
-		// work, we have to divide the number of rows into chunks of
-		// the same size, so that there are no more chunks than the
-		// workgroup size allows. Thus we check all numbers starting
-		// at the work group size down to 1 whether it divides the
-		// matrix size. This then is a suitable number of chunks
-		global = local + 1;
-		do {
-			global--;
-		} while (n % global);
-	}
+	size_t	global = workgroup_size(local, n);
 	local = global;
-	if (debug) {
-		fprintf(stderr, "%s:%d: global: %ld, local: %ld\n",
-			__FILE__, __LINE__, global, local);
-	}
 
 	// enqueue the kernel
 	err = clEnqueueNDRangeKernel(commands, kernel, 1, NULL, &global, &local,
-		0, NULL, NULL);
+		0, NULL, &events[1]);
 	if (err) {
 		fprintf(stderr, "%s:%d: cannot enqueue the kernel: %d\n",
 			__FILE__, __LINE__, err);
@@ -190,7 +172,7 @@ int	gauss_experiment(cl_context context, cl_command_queue commands,
 	// read the result data from the queue. This method waits until the
 	// the kernel has finished
 	err = clEnqueueReadBuffer(commands, output, CL_TRUE, 0,
-		sizeof(float) * n * n, b, 0, NULL, NULL);
+		sizeof(float) * n * n, b, 0, NULL, &events[2]);
 	if (err != CL_SUCCESS) {
 		fprintf(stderr, "%s:%d: cannot read the data: %d\n",
 			__FILE__, __LINE__, err);
@@ -200,7 +182,14 @@ int	gauss_experiment(cl_context context, cl_command_queue commands,
 
 	// measure end time and compute the elapsed time
 	double	end = gettime();
-	printf("%d,%f,%d\n", n, end - start, vectorlength);
+	if (profiling) {
+		// host to device, kernel and device to host times
+		printf("%d,%f,%d,%f,%f,%f\n", n, end - start, vectorlength,
+			event_seconds(events[0]), event_seconds(events[1]),
+			event_seconds(events[2]));
+	} else {
+		printf("%d,%f,%d\n", n, end - start, vectorlength);
+	}
 	fflush(stdout);
 	
 	// display results
@@ -209,6 +198,11 @@ int	gauss_experiment(cl_context context, cl_command_queue commands,
 	}
 
 cleanup:
+	for (int i = 0; i < 3; i++) {
+		if (events[i]) {
+			clReleaseEvent(events[i]);
+		}
+	}
 	if (input) {
 		clReleaseMemObject(input);
 	}
@@ -226,6 +220,151 @@ cleanup:
 	return rc;
 }
 
+/**
+ * \brief Invert a batch of matrices with double buffering
+ *
+ * Two sets of buffers are used alternately, each with its own command
+ * queue. While the kernel inverts the matrix in one set of buffers, the
+ * next matrix can already be uploaded into the other set and the
+ * previous result downloaded, so that the transfers are hidden behind
+ * the computation on devices that can overlap them. All transfers are
+ * non-blocking, the host only waits for a slot when it needs to reuse it.
+ */
+int	gauss_batch(cl_context context, cl_command_queue commands[2],
+		cl_kernel kernel, size_t local, unsigned int n, int count) {
+	int	rc = 0;
+	float	*a[2] = { NULL, NULL }, *b[2] = { NULL, NULL };
+	cl_mem	input[2] = { NULL, NULL }, output[2] = { NULL, NULL };
+	cl_event	events[2][3] = { { NULL, NULL, NULL },
+				     { NULL, NULL, NULL } };
+	int	pending[2] = { 0, 0 };
+	double	h2d = 0, compute = 0, d2h = 0;
+	size_t	size = sizeof(float) * n * n;
+	int	err;
+
+	// host and device buffers for both slots
+	for (int s = 0; s < 2; s++) {
+		a[s] = random_float_matrix(n, n);
+		b[s] = float_unit_matrix(n);
+		if ((NULL == a[s]) || (NULL == b[s])) {
+			fprintf(stderr, "%s:%d: cannot allocate memory: %s\n",
+				__FILE__, __LINE__, strerror(errno));
+			rc = -1;
+			goto cleanup;
+		}
+		input[s] = clCreateBuffer(context, CL_MEM_READ_WRITE, size,
+			NULL, NULL);
+		output[s] = clCreateBuffer(context, CL_MEM_WRITE_ONLY, size,
+			NULL, NULL);
+		if ((!input[s]) || (!output[s])) {
+			fprintf(stderr, "%s:%d: cannot allocate buffers\n",
+				__FILE__, __LINE__);
+			rc = -1;
+			goto cleanup;
+		}
+	}
+	size_t	global = workgroup_size(local, n);
+	local = global;
+
+	double	start = gettime();
+	for (int i = 0; i < count; i++) {
+		int	s = i % 2;
+
+		// wait until the slot is free, i.e. the result of the matrix
+		// that used the slot before has arrived on the host
+		if (pending[s]) {
+			clWaitForEvents(1, &events[s][2]);
+			if (profiling) {
+				h2d += event_seconds(events[s][0]);
+				compute += event_seconds(events[s][1]);
+				d2h += event_seconds(events[s][2]);
+			}
+			for (int j = 0; j < 3; j++) {
+				clReleaseEvent(events[s][j]);
+				events[s][j] = NULL;
+			}
+			pending[s] = 0;
+		}
+
+		// upload, invert and download without blocking. The kernel
+		// arguments are captured when the kernel is enqueued, so the
+		// same kernel object can be used for both slots
+		err = clEnqueueWriteBuffer(commands[s], input[s], CL_FALSE, 0,
+			size, a[s], 0, NULL, &events[s][0]);
+		err |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &input[s]);
+		err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &output[s]);
+		err |= clSetKernelArg(kernel, 2, sizeof(unsigned int), &n);
+		err |= clEnqueueNDRangeKernel(commands[s], kernel, 1, NULL,
+			&global, &local, 1, &events[s][0], &events[s][1]);
+		err |= clEnqueueReadBuffer(commands[s], output[s], CL_FALSE, 0,
+			size, b[s], 1, &events[s][1], &events[s][2]);
+		if (err != CL_SUCCESS) {
+			fprintf(stderr, "%s:%d: cannot enqueue matrix %d: %d\n",
+				__FILE__, __LINE__, i, err);
+			rc = -1;
+			goto cleanup;
+		}
+		pending[s] = 1;
+		clFlush(commands[s]);
+	}
+
+	// collect the last results
+	for (int s = 0; s < 2; s++) {
+		if (pending[s]) {
+			clWaitForEvents(1, &events[s][2]);
+			if (profiling) {
+				h2d += event_seconds(events[s][0]);
+				compute += event_seconds(events[s][1]);
+				d2h += event_seconds(events[s][2]);
+			}
+			for (int j = 0; j < 3; j++) {
+				clReleaseEvent(events[s][j]);
+				events[s][j] = NULL;
+			}
+			pending[s] = 0;
+		}
+	}
+	double	end = gettime();
+
+	// report time per matrix. With profiling, the sum of the device
+	// times divided by the wall clock time shows how much overlap
+	// was achieved
+	if (profiling) {
+		printf("%d,%f,%d,%f,%f,%f,%.2f\n", n, (end - start) / count,
+			vectorlength, h2d / count, compute / count, d2h / count,
+			(h2d + compute + d2h) / (end - start));
+	} else {
+		printf("%d,%f,%d\n", n, (end - start) / count, vectorlength);
+	}
+	fflush(stdout);
+
+cleanup:
+	// an enqueue that failed may have left the events of the commands
+	// enqueued before it, so all events that exist are released, not
+	// only those of pending slots
+	for (int s = 0; s < 2; s++) {
+		clFinish(commands[s]);
+		for (int j = 0; j < 3; j++) {
+			if (events[s][j]) {
+				clReleaseEvent(events[s][j]);
+			}
+		}
+		if (input[s]) {
+			clReleaseMemObject(input[s]);
+		}
+		if (output[s]) {
+			clReleaseMemObject(output[s]);
+		}
+		if (b[s]) {
+			free(b[s]);
+		}
+		if (a[s]) {
+			free(a[s]);
+		}
+	}
+	return rc;
+}
+
 /**
  * \brief Main function
  */
@@ -235,8 +374,11 @@ int	main(int argc, char *argv[]) {
 	int	c;
 	int	platform = 0;	// platform number
 	int	Debug = 0;
-	while (EOF != (c = getopt(argc, argv, "gdp:P:Dv:")))
+	while (EOF != (c = getopt(argc, argv, "B:gdp:P:Dtv:")))
 		switch (c) {
+		case 'B':
+			batch = atoi(optarg);
+			break;
 		case 'd':
 			debug = 1;
 			break;
@@ -252,6 +394,9 @@ int	main(int argc, char *argv[]) {
 		case 'P':
 			platform = atoi(optarg);
 			break;
+		case 't':
+			profiling = 1;
+			break;
 		case 'v':
 			vectorlength = atoi(optarg);
 			break;
@@ -413,34 +558,28 @@ int	main(int argc, char *argv[]) {
 		fprintf(stderr, "%s:%d: got context\n", __FILE__, __LINE__);
 	}
 
-	// create a command queue. Each device needs its own command queue
-	cl_command_queue	commands;
-	commands = clCreateCommandQueue(context, device_id, 0, &err);
-	if (!commands) {
-		fprintf(stderr, "%s:%d: cannot create command queue: %d\n",
-			__FILE__, __LINE__,  err);
-		return EXIT_FAILURE;
+	// create a command queue. Each device needs its own command queue,
+	// the double buffered batch mode uses a second one so that transfers
+	// and kernel executions can overlap. Profiling information is only
+	// collected if the user asked for it.
+	cl_command_queue_properties	properties
+		= (profiling) ? CL_QUEUE_PROFILING_ENABLE : 0;
+	cl_command_queue	commands[2] = { NULL, NULL };
+	for (int q = 0; q < ((batch > 1) ? 2 : 1); q++) {
+		commands[q] = clCreateCommandQueue(context, device_id,
+			properties, &err);
+		if (!commands[q]) {
+			fprintf(stderr, "%s:%d: cannot create command queue: "
+				"%d\n", __FILE__, __LINE__,  err);
+			return EXIT_FAILURE;
+		}
 	}
 	if (debug) {
 		fprintf(stderr, "%s:%d: got command queue\n",
 			__FILE__, __LINE__);
 	}
 
-	// create a program from a source file. There is no OpenCL function
-	// to read a program from a file, so we supply a uitility function
-	// for this purpose.
-	cl_program	program = cluCreateProgramWithFile(context,
-				"gauss.cl", &err);
-	if (!program) {
-		fprintf(stderr, "%s:%d: cannot create program: %d\n",
-			__FILE__, __LINE__, err);
-		return EXIT_FAILURE;
-	}
-	if (debug) {
-		fprintf(stderr, "%s:%d: got program\n", __FILE__, __LINE__);
-	}
-
-	// compile a program. The compiler accepts flags, and we would like
+	// the compiler accepts flags, and we would like
 	// to use them to control some aspects of our implementation, in
 	// particular the use of vector primitives.
 	char	flags[200];
@@ -474,21 +613,13 @@ int	main(int argc, char *argv[]) {
 		break;
 	}
 
-	err = clBuildProgram(program, 1, &device_id, flags, NULL, NULL);
-	if (err) {
-		fprintf(stderr, "%s:%d: cannot compile program: %d\n",
-			__FILE__, __LINE__, err);
-		size_t	l = 32 * 1024;
-		char	*log = (char *)malloc(l);
-		err = clGetProgramBuildInfo(program, device_id,
-			CL_PROGRAM_BUILD_LOG,
-			l, log, &l);
-		if (err) {
-			fprintf(stderr, "%s:%d: cannot retrieve log: %d\n",
-				__FILE__, __LINE__, err);
-			return EXIT_FAILURE;
-		}
-		fprintf(stderr, "compile log:\n%*s\n", (int)l, log);
+	// create and compile the program. The compiled binary is cached,
+	// so only the first run with a given device, source and set of
+	// flags has to pay for the compilation.
+	clu_debug = debug;
+	cl_program	program = cluBuildProgramCached(context, device_id,
+		"gauss.cl", flags, &err);
+	if (!program) {
 		return EXIT_FAILURE;
 	}
 	if (debug) {
@@ -538,7 +669,13 @@ int	main(int argc, char *argv[]) {
 			fprintf(stderr, "%s:%d: %s not a valid problem size, "
 				"skipping\n", __FILE__, __LINE__, argv[optind]);
 		} else {
-			gauss_experiment(context, commands, kernel, local, n);
+			if (batch > 1) {
+				gauss_batch(context, commands, kernel, local,
+					n, batch);
+			} else {
+				gauss_experiment(context, commands[0], kernel,
+					local, n);
+			}
 			optind++;
 		}
 	}
@@ -546,7 +683,10 @@ int	main(int argc, char *argv[]) {
 	// release all the objects
 	clReleaseProgram(program);
 	clReleaseKernel(kernel);
-	clReleaseCommandQueue(commands);
+	clReleaseCommandQueue(commands[0]);
+	if (commands[1]) {
+		clReleaseCommandQueue(commands[1]);
+	}
 	clReleaseContext(context);
 
 	return EXIT_SUCCESS;
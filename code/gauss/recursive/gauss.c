@@ -0,0 +1,367 @@
+/*
+ * gauss.c -- recursive block inversion based on the Schur complement
+ *
+ * The matrix is split into 2x2 blocks
+ *
+ *         [ A11  A12 ]
+ *     A = [          ]
+ *         [ A21  A22 ]
+ *
+ * With X = A11^-1 and the Schur complement S = A22 - A21 X A12 the
+ * inverse is
+ *
+ *            [ X + X A12 S^-1 A21 X    -X A12 S^-1 ]
+ *     A^-1 = [                                     ]
+ *            [ -S^-1 A21 X              S^-1       ]
+ *
+ * The two inversions are done recursively, all remaining work consists
+ * of matrix-matrix multiplications, which have much better data reuse
+ * than the row operations of the Gauss algorithm. Below a threshold
+ * size the recursion uses the Gauss algorithm of the c directory.
+ * Above another threshold, the multiplications can use the Strassen
+ * algorithm.
+ *
+ * (c) 2014 Prof Dr Andreas Mueller, Hochschule Rapperswil
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <common.h>
+#include <gemm.h>
+
+#ifndef DOUBLE
+#define	F	float
+#define	display_matrix	display_float_matrix
+#define	random_matrix	random_float_matrix
+#define	gemm	sgemm
+#else
+#define	F	double
+#define	display_matrix	display_double_matrix
+#define	random_matrix	random_double_matrix
+#define	gemm	dgemm
+#endif
+
+int	debug = 0;
+int	basesize = 64;		// below this size, use the Gauss algorithm
+int	strassen = 0;		// above this size, use Strassen, 0 = never
+int	check = 0;		// compute the residual ||A A^-1 - I||
+static int	depth = 0;	// current recursion depth of invert
+
+/**
+ * \brief Allocate a matrix
+ */
+static F	*allocate_matrix(int n, int m) {
+	F	*a = (F *)calloc(n * m, sizeof(F));
+	if (NULL == a) {
+		fprintf(stderr, "cannot allocate %d x %d array\n", n, m);
+		exit(EXIT_FAILURE);
+	}
+	return a;
+}
+
+/**
+ * \brief Elementwise  C = A + s B  for n x n blocks
+ */
+static void	add_blocks(int n, const F *a, int lda, F s, const F *b, int ldb,
+	F *c, int ldc) {
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < n; j++) {
+			M(c, ldc, i, j) = M(a, lda, i, j) + s * M(b, ldb, i, j);
+		}
+	}
+}
+
+static void	multiply(int m, int k, int n, F alpha, const F *a, int lda,
+	const F *b, int ldb, F beta, F *c, int ldc);
+
+/**
+ * \brief Strassen multiplication  C = A B  for square n x n blocks
+ *
+ * n must be even. The seven products are computed with the multiply
+ * function, so that the recursion continues as long as the blocks are
+ * large enough.
+ */
+static void	multiply_strassen(int n, const F *a, int lda, const F *b,
+	int ldb, F *c, int ldc) {
+	int	h = n / 2;
+	if (debug > 1) {
+		fprintf(stderr, "%s:%d: Strassen product of size %d\n",
+			__FILE__, __LINE__, n);
+	}
+	const F	*a11 = a, *a12 = a + h, *a21 = a + h * lda, *a22 = a21 + h;
+	const F	*b11 = b, *b12 = b + h, *b21 = b + h * ldb, *b22 = b21 + h;
+	F	*c11 = c, *c12 = c + h, *c21 = c + h * ldc, *c22 = c21 + h;
+	F	*s = allocate_matrix(h, h);
+	F	*t = allocate_matrix(h, h);
+	F	*p = allocate_matrix(h, h);
+
+	// M1 = (A11 + A22)(B11 + B22), contributes to C11 and C22
+	add_blocks(h, a11, lda, 1, a22, lda, s, h);
+	add_blocks(h, b11, ldb, 1, b22, ldb, t, h);
+	multiply(h, h, h, 1, s, h, t, h, 0, p, h);
+	add_blocks(h, p, h, 0, p, h, c11, ldc);
+	add_blocks(h, p, h, 0, p, h, c22, ldc);
+
+	// M2 = (A21 + A22) B11, contributes to C21 and -C22
+	add_blocks(h, a21, lda, 1, a22, lda, s, h);
+	multiply(h, h, h, 1, s, h, b11, ldb, 0, p, h);
+	add_blocks(h, p, h, 0, p, h, c21, ldc);
+	add_blocks(h, c22, ldc, -1, p, h, c22, ldc);
+
+	// M3 = A11 (B12 - B22), contributes to C12 and C22
+	add_blocks(h, b12, ldb, -1, b22, ldb, t, h);
+	multiply(h, h, h, 1, a11, lda, t, h, 0, p, h);
+	add_blocks(h, p, h, 0, p, h, c12, ldc);
+	add_blocks(h, c22, ldc, 1, p, h, c22, ldc);
+
+	// M4 = A22 (B21 - B11), contributes to C11 and C21
+	add_blocks(h, b21, ldb, -1, b11, ldb, t, h);
+	multiply(h, h, h, 1, a22, lda, t, h, 0, p, h);
+	add_blocks(h, c11, ldc, 1, p, h, c11, ldc);
+	add_blocks(h, c21, ldc, 1, p, h, c21, ldc);
+
+	// M5 = (A11 + A12) B22, contributes to -C11 and C12
+	add_blocks(h, a11, lda, 1, a12, lda, s, h);
+	multiply(h, h, h, 1, s, h, b22, ldb, 0, p, h);
+	add_blocks(h, c11, ldc, -1, p, h, c11, ldc);
+	add_blocks(h, c12, ldc, 1, p, h, c12, ldc);
+
+	// M6 = (A21 - A11)(B11 + B12), contributes to C22
+	add_blocks(h, a21, lda, -1, a11, lda, s, h);
+	add_blocks(h, b11, ldb, 1, b12, ldb, t, h);
+	multiply(h, h, h, 1, s, h, t, h, 0, p, h);
+	add_blocks(h, c22, ldc, 1, p, h, c22, ldc);
+
+	// M7 = (A12 - A22)(B21 + B22), contributes to C11
+	add_blocks(h, a12, lda, -1, a22, lda, s, h);
+	add_blocks(h, b21, ldb, 1, b22, ldb, t, h);
+	multiply(h, h, h, 1, s, h, t, h, 0, p, h);
+	add_blocks(h, c11, ldc, 1, p, h, c11, ldc);
+
+	free(p);
+	free(t);
+	free(s);
+}
+
+/**
+ * \brief Matrix multiplication  C = alpha A B + beta C
+ *
+ * Square products of even size above the strassen threshold are
+ * computed with the Strassen algorithm, everything else uses the
+ * blocked matrix multiplication from the common directory.
+ */
+static void	multiply(int m, int k, int n, F alpha, const F *a, int lda,
+	const F *b, int ldb, F beta, F *c, int ldc) {
+	if ((strassen <= 0) || (m != k) || (k != n) || (n % 2)
+		|| (n < strassen)) {
+		gemm(m, n, k, alpha, a, lda, b, ldb, beta, c, ldc);
+		return;
+	}
+	if ((alpha == 1) && (beta == 0)) {
+		multiply_strassen(n, a, lda, b, ldb, c, ldc);
+		return;
+	}
+	F	*p = allocate_matrix(n, n);
+	multiply_strassen(n, a, lda, b, ldb, p, n);
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < n; j++) {
+			M(c, ldc, i, j) = alpha * M(p, n, i, j)
+				+ beta * M(c, ldc, i, j);
+		}
+	}
+	free(p);
+}
+
+/**
+ * \brief Invert a small block with the Gauss algorithm
+ *
+ * This is the algorithm of the c directory (forward elimination followed
+ * by backward substitution on the matrix extended by the unit matrix).
+ * The inverse of the n x n block a is written to the block ainv.
+ */
+static void	gauss_block(int n, const F *a, int lda, F *ainv, int ldainv) {
+	F	*e = allocate_matrix(n, 2 * n);
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < n; j++) {
+			M(e, 2 * n, i, j) = M(a, lda, i, j);
+			M(e, 2 * n, i, j + n) = (i == j) ? 1 : 0;
+		}
+	}
+	for (int i = 0; i < n; i++) {
+		F	pivot = M(e, 2 * n, i, i);
+		for (int j = i + 1; j < 2 * n; j++) {
+			M(e, 2 * n, i, j) /= pivot;
+		}
+		for (int k = i + 1; k < n; k++) {
+			F	b = M(e, 2 * n, k, i);
+			for (int j = i + 1; j < 2 * n; j++) {
+				M(e, 2 * n, k, j) -= b * M(e, 2 * n, i, j);
+			}
+		}
+	}
+	for (int i = n - 1; i >= 0; i--) {
+		for (int k = i - 1; k >= 0; k--) {
+			F	b = M(e, 2 * n, k, i);
+			for (int j = n; j < 2 * n; j++) {
+				M(e, 2 * n, k, j) -= b * M(e, 2 * n, i, j);
+			}
+		}
+	}
+	for (int i = 0; i < n; i++) {
+		memcpy(&M(ainv, ldainv, i, 0), &M(e, 2 * n, i, n),
+			n * sizeof(F));
+	}
+	free(e);
+}
+
+/**
+ * \brief Recursive block inversion
+ *
+ * Computes the inverse of the n x n block a into the block ainv. The
+ * block a is not modified.
+ */
+static void	invert(int n, const F *a, int lda, F *ainv, int ldainv) {
+	if (n <= basesize) {
+		if (debug) {
+			fprintf(stderr, "%s:%d: depth %d: Gauss on %d x %d "
+				"block\n", __FILE__, __LINE__, depth, n, n);
+		}
+		gauss_block(n, a, lda, ainv, ldainv);
+		return;
+	}
+	int	n1 = n / 2;
+	int	n2 = n - n1;
+	if (debug) {
+		fprintf(stderr, "%s:%d: depth %d: splitting %d = %d + %d\n",
+			__FILE__, __LINE__, depth, n, n1, n2);
+	}
+	depth++;
+	const F	*a11 = a, *a12 = a + n1, *a21 = a + n1 * lda, *a22 = a21 + n1;
+	F	*x11 = ainv, *x12 = ainv + n1;
+	F	*x21 = ainv + n1 * ldainv, *x22 = x21 + n1;
+
+	// X = A11^-1, kept in the upper left block of the result
+	invert(n1, a11, lda, x11, ldainv);
+
+	// C = A21 X (n2 x n1), B = X A12 (n1 x n2)
+	F	*c = allocate_matrix(n2, n1);
+	F	*b = allocate_matrix(n1, n2);
+	multiply(n2, n1, n1, 1, a21, lda, x11, ldainv, 0, c, n1);
+	multiply(n1, n1, n2, 1, x11, ldainv, a12, lda, 0, b, n2);
+
+	// Schur complement S = A22 - A21 X A12 = A22 - C A12
+	F	*s = allocate_matrix(n2, n2);
+	for (int i = 0; i < n2; i++) {
+		memcpy(&M(s, n2, i, 0), &M(a22, lda, i, 0), n2 * sizeof(F));
+	}
+	multiply(n2, n1, n2, -1, c, n1, a12, lda, 1, s, n2);
+
+	// S^-1 is the lower right block of the result
+	invert(n2, s, n2, x22, ldainv);
+	free(s);
+
+	// upper right block: -B S^-1, lower left block: -S^-1 C
+	multiply(n1, n2, n2, -1, b, n2, x22, ldainv, 0, x12, ldainv);
+	multiply(n2, n2, n1, -1, x22, ldainv, c, n1, 0, x21, ldainv);
+
+	// upper left block: X + B S^-1 C = X - X12 C
+	multiply(n1, n2, n1, -1, x12, ldainv, c, n1, 1, x11, ldainv);
+
+	free(b);
+	free(c);
+	depth--;
+}
+
+/**
+ * \brief Compute the maximum norm of A A^-1 - I
+ */
+static double	residual(int n, const F *a, const F *ainv) {
+	F	*r = allocate_matrix(n, n);
+	gemm(n, n, n, 1, a, n, ainv, n, 0, r, n);
+	double	result = 0;
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < n; j++) {
+			double	d = fabs(M(r, n, i, j) - ((i == j) ? 1 : 0));
+			if (d > result) {
+				result = d;
+			}
+		}
+	}
+	free(r);
+	return result;
+}
+
+void	experiment(int n) {
+	/* create a system to solve, made diagonally dominant because the
+	   algorithm does not pivot */
+	F	*a = random_matrix(n, n);
+	for (int i = 0; i < n; i++) {
+		M(a, n, i, i) += n;
+	}
+	F	*ainv = allocate_matrix(n, n);
+
+	/* display the matrix */
+	if (n <= 10) {
+		display_matrix(stdout, a, n, n);
+	}
+
+	/* perform the recursive inversion */
+	double	start = gettime();
+	invert(n, a, n, ainv, n);
+	double	end = gettime();
+	if (check) {
+		printf("%d,%.6f,%g\n", n, end - start, residual(n, a, ainv));
+	} else {
+		printf("%d,%.6f\n", n, end - start);
+	}
+	fflush(stdout);
+
+	/* display the inverse */
+	if (n <= 10) {
+		display_matrix(stdout, ainv, n, n);
+	}
+
+	free(ainv);
+	free(a);
+}
+
+int	main(int argc, char *argv[]) {
+	init_gettime();
+	int	n = 10;
+	int	c;
+	while (EOF != (c = getopt(argc, argv, "b:cdp:s:")))
+		switch (c) {
+		case 'b':
+			basesize = atoi(optarg);
+			break;
+		case 'c':
+			check = 1;
+			break;
+		case 'd':
+			debug++;
+			break;
+		case 'p':
+			matrix_precision = atoi(optarg);
+			break;
+		case 's':
+			strassen = atoi(optarg);
+			break;
+		}
+	if (basesize < 1) {
+		basesize = 1;
+	}
+
+	while (optind < argc) {
+		n = atoi(argv[optind]);
+		if (n <= 0) {
+			fprintf(stderr, "not a valid number: %s\n", argv[optind]);
+		} else {
+			experiment(n);
+		}
+		optind++;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,212 @@
+/*
+ * balance.c -- move the patch boundaries according to the rank speeds
+ *
+ * All ranks wait for the slowest one at every halo exchange, so if some
+ * ranks compute more slowly, e.g. because they share a node with other
+ * jobs, their patches should be smaller. The speed of each rank is
+ * measured as points computed per second of busy time. The halo exchange
+ * needs the Cartesian layout of the patches, so the boundaries between
+ * columns of patches and between rows of patches are moved, each by a
+ * recursive bisection of the image weighted by the total speed of the
+ * columns or rows of patches on either side. The values of u are then
+ * migrated with a single MPI_Alltoallw, where each rank only exchanges
+ * data with the ranks whose old patches overlap its new one, usually
+ * its neighbors.
+ *
+ * (c) 2014 Prof Dr Andreas Mueller, Hochschule Rapperswil
+ */
+#include "balance.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern int	debug;
+
+#define	BALANCE_TOLERANCE	0.05	// acceptable excess of the slowest rank
+
+/**
+ * \brief Split [x0, x1) among the parts lo..hi-1 according to weights
+ *
+ * The cut between the two halves divides the interval in proportion to
+ * the sum of the weights on either side. Every part keeps at least
+ * minsize points, the halo cannot be wider than a patch. cuts[p] is the
+ * start of part p.
+ */
+static void	bisect(const double *weights, int lo, int hi, int x0, int x1,
+	int minsize, int *cuts) {
+	if (hi - lo < 2) {
+		return;
+	}
+	int	mid = (lo + hi) / 2;
+	double	left = 0, total = 0;
+	for (int p = lo; p < hi; p++) {
+		if (p < mid) {
+			left += weights[p];
+		}
+		total += weights[p];
+	}
+	int	cut = x0 + (int)((x1 - x0) * left / total + 0.5);
+	if (cut < x0 + (mid - lo) * minsize) {
+		cut = x0 + (mid - lo) * minsize;
+	}
+	if (cut > x1 - (hi - mid) * minsize) {
+		cut = x1 - (hi - mid) * minsize;
+	}
+	cuts[mid] = cut;
+	bisect(weights, lo, mid, x0, cut, minsize, cuts);
+	bisect(weights, mid, hi, cut, x1, minsize, cuts);
+}
+
+/**
+ * \brief Subarray of the interior of an array with the layout of u
+ *
+ * The rectangle [x0, x1) x [y0, y1) is given in image coordinates, range
+ * is the patch of the array. An empty rectangle gives a count of 0.
+ */
+static int	overlaptype(const udata_t *u, const int *range, int x0, int x1,
+	int y0, int y1, MPI_Datatype *type) {
+	if ((x1 <= x0) || (y1 <= y0)) {
+		*type = MPI_DOUBLE;
+		return 0;
+	}
+	int	sizes[2] = { u->height + 2 * u->halo, u->stride };
+	int	subsizes[2] = { y1 - y0, x1 - x0 };
+	int	starts[2] = { y0 - range[2] + u->halo, x0 - range[0] + u->halo };
+	MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C,
+		MPI_DOUBLE, type);
+	MPI_Type_commit(type);
+	return 1;
+}
+
+static int	max(int a, int b) { return (a > b) ? a : b; }
+static int	min(int a, int b) { return (a < b) ? a : b; }
+
+/**
+ * \brief Move u from the old patches to the new ones
+ *
+ * Both old and new contain the ranges of all ranks. u keeps the old
+ * arrays until the data has been received into the new ones.
+ */
+static void	migrate(udata_t *u, const int *oldranges) {
+	int	num_procs = u->nx * u->ny;
+	udata_t	old = *u;
+	const int	*oldrange = &oldranges[4 * u->rank];
+	const int	*range = &u->ranges[4 * u->rank];
+	old.width = oldrange[1] - oldrange[0];
+	old.height = oldrange[3] - oldrange[2];
+	u->width = range[1] - range[0];
+	u->height = range[3] - range[2];
+	allocate_u(u);
+
+	int	*counts = (int *)malloc(4 * num_procs * sizeof(int));
+	int	*sendcounts = counts, *recvcounts = counts + num_procs;
+	int	*displs = counts + 2 * num_procs;
+	MPI_Datatype	*types = (MPI_Datatype *)malloc(2 * num_procs
+				* sizeof(MPI_Datatype));
+	MPI_Datatype	*sendtypes = types, *recvtypes = types + num_procs;
+	for (int q = 0; q < num_procs; q++) {
+		// what this rank had of the new patch of q
+		const int	*r = &u->ranges[4 * q];
+		sendcounts[q] = overlaptype(&old, oldrange,
+			max(oldrange[0], r[0]), min(oldrange[1], r[1]),
+			max(oldrange[2], r[2]), min(oldrange[3], r[3]),
+			&sendtypes[q]);
+		// what q had of the new patch of this rank
+		r = &oldranges[4 * q];
+		recvcounts[q] = overlaptype(u, range,
+			max(range[0], r[0]), min(range[1], r[1]),
+			max(range[2], r[2]), min(range[3], r[3]),
+			&recvtypes[q]);
+		displs[q] = 0;
+	}
+	MPI_Alltoallw(old.u, sendcounts, displs, sendtypes,
+		u->u, recvcounts, displs, recvtypes, u->comm);
+	for (int q = 0; q < 2 * num_procs; q++) {
+		if (types[q] != MPI_DOUBLE) {
+			MPI_Type_free(&types[q]);
+		}
+	}
+	free(types);
+	free(counts);
+
+	// the old arrays, requests and column type are no longer needed
+	free_u(&old);
+}
+
+/**
+ * \brief Rebalance the patches if the slowest rank is too slow
+ *
+ * Returns 1 if the patches were changed, 0 otherwise.
+ */
+int	rebalance(udata_t *u, double busy) {
+	int	num_procs = u->nx * u->ny;
+	double	*busytimes = (double *)malloc(num_procs * sizeof(double));
+	MPI_Allgather(&busy, 1, MPI_DOUBLE, busytimes, 1, MPI_DOUBLE,
+		u->comm);
+
+	// speeds of the ranks, and the imbalance of the busy times
+	double	*speed = (double *)malloc(num_procs * sizeof(double));
+	double	maxbusy = 0, sumbusy = 0;
+	for (int r = 0; r < num_procs; r++) {
+		const int	*range = &u->ranges[4 * r];
+		double	points = (double)(range[1] - range[0])
+				* (range[3] - range[2]);
+		speed[r] = (busytimes[r] > 0) ? points / busytimes[r] : 0;
+		if (busytimes[r] > maxbusy) {
+			maxbusy = busytimes[r];
+		}
+		sumbusy += busytimes[r];
+	}
+	free(busytimes);
+	if ((maxbusy <= 0) || (maxbusy * num_procs
+		<= (1 + BALANCE_TOLERANCE) * sumbusy)) {
+		free(speed);
+		return 0;
+	}
+
+	// total speed of the columns and rows of patches
+	double	*columns = (double *)calloc(u->nx + u->ny, sizeof(double));
+	double	*rows = columns + u->nx;
+	for (int r = 0; r < num_procs; r++) {
+		columns[r % u->nx] += speed[r];
+		rows[r / u->nx] += speed[r];
+	}
+	free(speed);
+
+	// the image is the union of all patches
+	int	width = u->ranges[4 * (num_procs - 1) + 1];
+	int	height = u->ranges[4 * (num_procs - 1) + 3];
+	int	*xcuts = (int *)malloc((u->nx + u->ny + 2) * sizeof(int));
+	int	*ycuts = xcuts + u->nx + 1;
+	xcuts[0] = 0; xcuts[u->nx] = width;
+	ycuts[0] = 0; ycuts[u->ny] = height;
+	bisect(columns, 0, u->nx, 0, width, u->halo, xcuts);
+	bisect(rows, 0, u->ny, 0, height, u->halo, ycuts);
+	free(columns);
+
+	int	*oldranges = (int *)malloc(4 * num_procs * sizeof(int));
+	memcpy(oldranges, u->ranges, 4 * num_procs * sizeof(int));
+	int	changed = 0;
+	for (int r = 0; r < num_procs; r++) {
+		int	rx = r % u->nx;
+		int	ry = r / u->nx;
+		int	*range = &u->ranges[4 * r];
+		range[0] = xcuts[rx];
+		range[1] = xcuts[rx + 1];
+		range[2] = ycuts[ry];
+		range[3] = ycuts[ry + 1];
+		changed |= memcmp(range, &oldranges[4 * r], 4 * sizeof(int));
+	}
+	free(xcuts);
+	if (changed) {
+		if (debug) {
+			const int	*range = &u->ranges[4 * u->rank];
+			fprintf(stderr, "%s:%d[%d]: new patch [%d,%d) x "
+				"[%d,%d)\n", __FILE__, __LINE__, u->rank,
+				range[0], range[1], range[2], range[3]);
+		}
+		migrate(u, oldranges);
+	}
+	free(oldranges);
+	return changed != 0;
+}
@@ -0,0 +1,21 @@
+/*
+ * balance.h -- move the patch boundaries according to the rank speeds
+ *
+ * (c) 2014 Prof Dr Andreas Mueller, Hochschule Rapperswil
+ */
+#ifndef _balance_h
+#define _balance_h
+
+#include "domain.h"
+
+/*
+ * Compute new patch boundaries from the time busy this rank spent
+ * computing since the last call, and migrate u to the new patches if
+ * the ranks are out of balance. The patches keep their Cartesian
+ * layout, so the neighbors do not change. u is reallocated, so all
+ * other arrays with the layout of u must be reallocated by the caller
+ * when this returns nonzero. This is a collective operation.
+ */
+extern int	rebalance(udata_t *u, double busy);
+
+#endif /* _balance_h */
@@ -1,161 +1,351 @@
 /*
  * boundary.c -- functions related to boundary data interchange
  *
+ * The halo exchange uses persistent requests: the sends and receives
+ * for an array are set up once with MPI_Send_init/MPI_Recv_init, and
+ * each exchange only has to start them and wait for them. The left and
+ * right columns are described by a vector datatype, so no copying to
+ * and from buffers is needed. All halo messages use the same tag, MPI
+ * guarantees that messages between two ranks are received in the order
+ * they were sent, and all ranks exchange the same arrays in the same
+ * order. Alternatively, the exchange can be done with a neighborhood
+ * collective on the Cartesian communicator of the patches, which
+ * leaves the scheduling of the messages to the MPI library. If all
+ * ranks are on the same node, the u array and the spare array can be
+ * placed in a shared memory window, and the halo of these arrays is
+ * copied directly from the neighbors between two fences, without any
+ * messages.
+ *
  * (c) 2014 Prof Dr Andreas Mueller, Hochschule Rapperswil
  */
 #include "boundary.h"
 #include <mpi.h>
 #include <stdio.h>
+#include <string.h>
 
 extern int	debug;
 
 /**
- * \brief Send the boundary data 
+ * \brief Set up the persistent requests for the halo of v
  *
- * This function is used to send the boundary data to other ranks.
+ * With a halo of one cell, the corners are not needed, and only the
+ * patch part of the top and bottom rows is exchanged. With a wider
+ * halo, the rows include the halo columns, which must already contain
+ * the values received from the left and right neighbors, so that the
+ * corners of the halo are filled with the values of the diagonal
+ * neighbors.
  */
-static void	send_boundary(double *data, int size, int partnerrank, int tag,
-	MPI_Request *request) {
+static void	init_halo(udata_t *u, double *v, halo_t *h) {
 	if (debug) {
-		fprintf(stderr, "%s:%d: send %d values to %d\n",
-			__FILE__, __LINE__,  size, partnerrank);
+		fprintf(stderr, "%s:%d[%d]: persistent requests for %p\n",
+			__FILE__, __LINE__, u->rank, v);
 	}
-	int	ierr = MPI_Isend(data, size, MPI_DOUBLE, partnerrank, tag,
-		MPI_COMM_WORLD, request);
-	if (ierr) {
-		fprintf(stderr, "cannot send to %d: %d\n", ierr, partnerrank);
-		return;
+	int	w = u->halo;
+	h->v = v;
+
+	int	*n = u->neighbors;
+
+	// columns: receives first, then sends
+	h->ncolumns = 0;
+	if (n[LEFT] != MPI_PROC_NULL) {
+		MPI_Recv_init(v + UINDEX(u, 1, 1 - w), 1, u->column,
+			n[LEFT], HALO_TAG, u->comm,
+			&h->columns[h->ncolumns++]);
+	}
+	if (n[RIGHT] != MPI_PROC_NULL) {
+		MPI_Recv_init(v + UINDEX(u, 1, u->width + 1), 1, u->column,
+			n[RIGHT], HALO_TAG, u->comm,
+			&h->columns[h->ncolumns++]);
+	}
+	if (n[LEFT] != MPI_PROC_NULL) {
+		MPI_Send_init(v + UINDEX(u, 1, 1), 1, u->column,
+			n[LEFT], HALO_TAG, u->comm,
+			&h->columns[h->ncolumns++]);
+	}
+	if (n[RIGHT] != MPI_PROC_NULL) {
+		MPI_Send_init(v + UINDEX(u, 1, u->width - w + 1), 1,
+			u->column, n[RIGHT], HALO_TAG, u->comm,
+			&h->columns[h->ncolumns++]);
+	}
+
+	// rows are contiguous
+	int	j0 = (w == 1) ? 1 : 1 - w;
+	int	size = (w == 1) ? u->width : w * u->stride;
+	h->nrows = 0;
+	if (n[TOP] != MPI_PROC_NULL) {
+		MPI_Recv_init(v + UINDEX(u, 1 - w, j0), size, MPI_DOUBLE,
+			n[TOP], HALO_TAG, u->comm, &h->rows[h->nrows++]);
+	}
+	if (n[BOTTOM] != MPI_PROC_NULL) {
+		MPI_Recv_init(v + UINDEX(u, u->height + 1, j0), size,
+			MPI_DOUBLE, n[BOTTOM], HALO_TAG, u->comm,
+			&h->rows[h->nrows++]);
+	}
+	if (n[TOP] != MPI_PROC_NULL) {
+		MPI_Send_init(v + UINDEX(u, 1, j0), size, MPI_DOUBLE,
+			n[TOP], HALO_TAG, u->comm, &h->rows[h->nrows++]);
+	}
+	if (n[BOTTOM] != MPI_PROC_NULL) {
+		MPI_Send_init(v + UINDEX(u, u->height - w + 1, j0), size,
+			MPI_DOUBLE, n[BOTTOM], HALO_TAG, u->comm,
+			&h->rows[h->nrows++]);
 	}
 }
 
 /**
- * \brief Send all the boundary data to other processes
+ * \brief Send buffer argument of the neighborhood collectives for v
  *
- * This function copies the data to the send buffer and call the send_boundary
- * function for each boundary.
+ * MPI does not allow the receive buffer argument to alias the send
+ * buffer argument, even if the datatypes select disjoint regions. So
+ * the halo is received relative to v, and the boundary points are sent
+ * relative to the first row of the patch (with its halo columns), which
+ * is the lowest address that is sent.
  */
-static void	send_boundaries(udata_t *u, int tag) {
-	if (debug) {
-		fprintf(stderr, "%s:%d[%d]: sending boundaries\n",
-			__FILE__, __LINE__, u->rank);
-	}
-	// left
-	if (u->rh > 0) {
-		for (int i = 0; i < u->height; i++) {
-			u->send_left[i] = u->u[i * u->width];
-		}
-		// exchange with left neighbor
-		send_boundary(u->send_left, u->height, u->rank - 1, tag,
-			&u->left_request);
+static double	*send_base(const udata_t *u, double *v) {
+	return v + UINDEX(u, 1, 1 - u->halo);
+}
+
+/**
+ * \brief Set up the arguments of a neighborhood collective exchange
+ *
+ * The rows (phase 0) and the columns (phase 1) are described by
+ * displacements relative to send_base and to the array, so the same
+ * arguments can be used for all arrays. With a halo of one cell, both
+ * are exchanged in the same call (phase -1). The neighbors at the
+ * boundary of the domain are MPI_PROC_NULL, the collective ignores them.
+ */
+static void	init_collective(udata_t *u, int phase) {
+	collective_t	*c = &u->nb;
+	int	w = u->halo;
+	int	j0 = (w == 1) ? 1 : 1 - w;
+	int	rows = (phase != 1);
+	int	columns = (phase != 0);
+	int	size = (w == 1) ? u->width : w * u->stride;
+	c->counts[TOP] = c->counts[BOTTOM] = (rows) ? size : 0;
+	c->counts[LEFT] = c->counts[RIGHT] = (columns) ? 1 : 0;
+	c->types[TOP] = c->types[BOTTOM] = MPI_DOUBLE;
+	c->types[LEFT] = c->types[RIGHT] = u->column;
+	MPI_Aint	d = sizeof(double);
+	MPI_Aint	s0 = UINDEX(u, 1, 1 - w);	// offset of send_base
+	c->sdispls[TOP] = d * (UINDEX(u, 1, j0) - s0);
+	c->rdispls[TOP] = d * UINDEX(u, 1 - w, j0);
+	c->sdispls[BOTTOM] = d * (UINDEX(u, u->height - w + 1, j0) - s0);
+	c->rdispls[BOTTOM] = d * UINDEX(u, u->height + 1, j0);
+	c->sdispls[LEFT] = d * (UINDEX(u, 1, 1) - s0);
+	c->rdispls[LEFT] = d * UINDEX(u, 1, 1 - w);
+	c->sdispls[RIGHT] = d * (UINDEX(u, 1, u->width - w + 1) - s0);
+	c->rdispls[RIGHT] = d * UINDEX(u, 1, u->width + 1);
+}
+
+/**
+ * \brief Halo exchange with a neighborhood collective
+ *
+ * The send and receive regions of v are disjoint, the patch boundary
+ * is sent and the halo is received, but the buffer arguments must still
+ * differ, see send_base.
+ */
+static void	exchange_collective(udata_t *u, double *v) {
+	collective_t	*c = &u->nb;
+	int	phases = (u->halo == 1) ? 1 : 2;
+	for (int p = 0; p < phases; p++) {
+		// columns first for a wider halo, rows need the corners
+		init_collective(u, (phases == 1) ? -1 : 1 - p);
+		MPI_Neighbor_alltoallw(send_base(u, v), c->counts,
+			c->sdispls, c->types, v, c->counts, c->rdispls,
+			c->types, u->comm);
 	}
+}
+
+/**
+ * \brief Whether v is one of the arrays in the shared memory window
+ */
+static int	in_window(const udata_t *u, const double *v) {
+	return (u->shm.window != MPI_WIN_NULL)
+		&& ((v == u->shm.own) || (v == u->shm.own + u->length));
+}
 
-	// right
-	if (u->rh < u->nx - 1) {
-		for (int i = 0; i < u->height; i++) {
-			u->send_right[i] = u->u[i * u->width + u->width - 1];
+/**
+ * \brief Copy the halo of v from the arrays of the neighbors
+ *
+ * The array of a neighbor is at the same position in its segment as v
+ * in this one. The first fence makes sure that the neighbors have
+ * finished writing their boundary points, the last one that they do
+ * not change them before they have been copied. Only the halo of v is
+ * written, only the boundary points of the neighbors are read, so the
+ * copies need no further synchronization. A halo wider than one cell
+ * needs the corners, so the columns are copied first, and the rows,
+ * which include the halo columns of the neighbors, after another fence.
+ */
+static void	exchange_shared(udata_t *u, double *v) {
+	shared_t	*s = &u->shm;
+	int	slot = (v == s->own) ? 0 : 1;
+	int	w = u->halo;
+	MPI_Win_fence(0, s->window);
+
+	// columns, the left and right neighbors have the same height
+	for (int d = LEFT; d <= RIGHT; d++) {
+		if (NULL == s->base[d]) {
+			continue;
 		}
-		// exchange with right neighbor
-		send_boundary(u->send_right, u->height, u->rank + 1, tag,
-			&u->right_request);
+		int	stride = s->width[d] + 2 * w;
+		const double	*n = s->base[d]
+				+ slot * stride * (s->height[d] + 2 * w);
+		int	from = (d == LEFT) ? s->width[d] - w + 1 : 1;
+		int	to = (d == LEFT) ? 1 - w : u->width + 1;
+		for (int i = 1; i <= u->height; i++) {
+			memcpy(v + UINDEX(u, i, to),
+				n + (from + w - 1) + (i + w - 1) * stride,
+				w * sizeof(double));
+		}
+	}
+	if (w > 1) {
+		MPI_Win_fence(0, s->window);
 	}
 
-	// top
-	if (u->rv > 0) {
-		for (int j = 0; j < u->width; j++) {
-			u->send_top[j] = u->u[j];
+	// rows, the top and bottom neighbors have the same stride
+	int	j0 = (w == 1) ? 1 : 1 - w;
+	int	size = (w == 1) ? u->width : w * u->stride;
+	for (int d = TOP; d <= BOTTOM; d++) {
+		if (NULL == s->base[d]) {
+			continue;
 		}
-		// exchange with top neighbor
-		send_boundary(u->send_top, u->width, u->rank - u->nx, tag,
-			&u->top_request);
+		const double	*n = s->base[d]
+				+ slot * u->stride * (s->height[d] + 2 * w);
+		int	from = (d == TOP) ? s->height[d] - w + 1 : 1;
+		int	to = (d == TOP) ? 1 - w : u->height + 1;
+		memcpy(v + UINDEX(u, to, j0),
+			n + (j0 + w - 1) + (from + w - 1) * u->stride,
+			size * sizeof(double));
 	}
+	MPI_Win_fence(0, s->window);
+}
 
-	// bottom
-	if (u->rv < u->ny - 1) {
-		for (int j = 0; j < u->width; j++) {
-			u->send_bottom[j] = u->u[j + u->width * (u->height - 1)];
+/**
+ * \brief Find the persistent requests for an array, create them if needed
+ *
+ * If all entries are in use, the least recently created one is
+ * replaced.
+ */
+static halo_t	*get_halo(udata_t *u, double *v) {
+	for (int a = 0; a < HALO_ARRAYS; a++) {
+		if (u->halos[a].v == v) {
+			return &u->halos[a];
 		}
-		// exchange with bottom neighbor
-		send_boundary(u->send_bottom, u->width, u->rank + u->nx, tag,
-			&u->bottom_request);
 	}
-	if (debug) {
-		fprintf(stderr, "%s:%d[%d]: boundaries sent\n",
-			__FILE__, __LINE__, u->rank);
+	halo_t	*h = &u->halos[u->nexthalo];
+	u->nexthalo = (u->nexthalo + 1) % HALO_ARRAYS;
+	if (h->v) {
+		free_halo(h);
 	}
+	init_halo(u, v, h);
+	return h;
 }
 
 /**
- * \brief Receive boundary data from other processes
+ * \brief Start the exchange of the halo of v, without waiting for it
  *
- * This function receives boundary data into the boundary arrays
+ * All receives and sends are started, so that the caller can compute
+ * the points that do not depend on the halo while the messages are in
+ * flight. Neither the halo nor the boundary points of the patch may be
+ * modified before exchange_finish has been called. The corners of a
+ * wider halo need the columns of the neighbors first, so for a halo
+ * wider than one cell, the complete exchange is done here, and so is
+ * the copy from the shared memory window, which takes no time to
+ * overlap.
  */
-static void	recv_boundary(double *data, int size, int partnerrank,
-		int tag) {
-	if (debug) {
-		fprintf(stderr, "%s:%d: receive %d values from %d\n",
-			__FILE__, __LINE__, size, partnerrank);
-	}
-	int	ierr;
-	MPI_Status	status;
-	ierr = MPI_Recv(data, size, MPI_DOUBLE, partnerrank, tag,
-		MPI_COMM_WORLD, &status);
-	if (ierr) {
-		fprintf(stderr, "%s:%d: could not receive data: %d\n",
-			__FILE__, __LINE__, ierr);
+void	exchange_start(udata_t *u, double *v) {
+	if ((u->halo > 1) || (in_window(u, v))) {
+		exchange_array(u, v);
+		return;
 	}
-	if (debug) {
-		fprintf(stderr, "%s:%d: %d values from %d received\n",
-			__FILE__, __LINE__, size, partnerrank);
+	if (u->collective) {
+		init_collective(u, -1);
+		collective_t	*c = &u->nb;
+		MPI_Ineighbor_alltoallw(send_base(u, v), c->counts,
+			c->sdispls, c->types, v, c->counts, c->rdispls,
+			c->types, u->comm, &c->request);
+		return;
 	}
+	halo_t	*h = get_halo(u, v);
+	MPI_Startall(h->ncolumns, h->columns);
+	MPI_Startall(h->nrows, h->rows);
 }
 
 /**
- * \brief Receive all the boundary data
+ * \brief Check whether a started exchange is complete
+ *
+ * Calling this now and then while computing also gives the MPI library
+ * a chance to make progress with the transfers.
  */
-static void	recv_boundaries(udata_t *u, int tag) {
-	if (debug) {
-		fprintf(stderr, "%s:%d[%d]: start boundary exchange\n",
-			__FILE__, __LINE__, u->rank);
+int	exchange_test(udata_t *u, double *v) {
+	if ((u->halo > 1) || (in_window(u, v))) {
+		return 1;
 	}
-	// left
-	if (u->rh > 0) {
-		// exchange with left neighbor
-		recv_boundary(u->left, u->height, u->rank - 1, tag);
+	int	flag = 0;
+	if (u->collective) {
+		MPI_Test(&u->nb.request, &flag, MPI_STATUS_IGNORE);
+		return flag;
 	}
-
-	// right
-	if (u->rh < u->nx - 1) {
-		// exchange with right neighbor
-		recv_boundary(u->right, u->height, u->rank + 1, tag);
+	halo_t	*h = get_halo(u, v);
+	MPI_Testall(h->ncolumns, h->columns, &flag, MPI_STATUSES_IGNORE);
+	if (!flag) {
+		return 0;
 	}
+	MPI_Testall(h->nrows, h->rows, &flag, MPI_STATUSES_IGNORE);
+	return flag;
+}
 
-	// top
-	if (u->rv > 0) {
-		// exchange with top neighbor
-		recv_boundary(u->top, u->width, u->rank - u->nx, tag);
+/**
+ * \brief Complete an exchange started with exchange_start
+ */
+void	exchange_finish(udata_t *u, double *v) {
+	if ((u->halo > 1) || (in_window(u, v))) {
+		return;
 	}
-
-	// bottom
-	if (u->rv < u->ny - 1) {
-		recv_boundary(u->bottom, u->width, u->rank + u->nx, tag);
-
+	if (u->collective) {
+		MPI_Wait(&u->nb.request, MPI_STATUS_IGNORE);
+		return;
 	}
+	halo_t	*h = get_halo(u, v);
+	MPI_Waitall(h->ncolumns, h->columns, MPI_STATUSES_IGNORE);
+	MPI_Waitall(h->nrows, h->rows, MPI_STATUSES_IGNORE);
 	if (debug) {
-		fprintf(stderr, "%s:%d[%d]: boundary exchange complete\n",
+		fprintf(stderr, "%s:%d[%d]: split exchange complete\n",
 			__FILE__, __LINE__, u->rank);
 	}
 }
 
 /**
- * \brief Synchronize boundary data with all other processes
+ * \brief Synchronize the halo of an array with all other processes
+ *
+ * v is an array with the same layout as u->u, e.g. a residual or a
+ * search direction, that needs the values of the neighbors in its halo.
  */
-void	exchange_boundaries(udata_t *u, int tag) {
+void	exchange_array(udata_t *u, double *v) {
 	if (debug) {
 		fprintf(stderr, "%s:%d[%d]: start boundary exchange\n",
 			__FILE__, __LINE__, u->rank);
 	}
-	send_boundaries(u, tag);
-	recv_boundaries(u, tag);
+	if (in_window(u, v)) {
+		exchange_shared(u, v);
+		return;
+	}
+	if (u->collective) {
+		exchange_collective(u, v);
+		return;
+	}
+	halo_t	*h = get_halo(u, v);
+
+	// with a halo of one cell, all four directions can be exchanged at
+	// the same time. Wider halos need the corners, so the rows can only
+	// be sent when the columns have arrived.
+	MPI_Startall(h->ncolumns, h->columns);
+	if (u->halo > 1) {
+		MPI_Waitall(h->ncolumns, h->columns, MPI_STATUSES_IGNORE);
+	}
+	MPI_Startall(h->nrows, h->rows);
+	MPI_Waitall(h->ncolumns, h->columns, MPI_STATUSES_IGNORE);
+	MPI_Waitall(h->nrows, h->rows, MPI_STATUSES_IGNORE);
 
 	if (debug) {
 		fprintf(stderr, "%s:%d[%d]: boundary exchange complete\n",
@@ -163,3 +353,9 @@ void	exchange_boundaries(udata_t *u, int tag) {
 	}
 }
 
+/**
+ * \brief Synchronize boundary data with all other processes
+ */
+void	exchange_boundaries(udata_t *u) {
+	exchange_array(u, u->u);
+}
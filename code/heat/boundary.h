@@ -8,6 +8,12 @@
 
 #include "domain.h"
 
-extern void	exchange_boundaries(udata_t *u, int tag);
+extern void	exchange_boundaries(udata_t *u);
+extern void	exchange_array(udata_t *u, double *v);
+
+// split exchange, to overlap communication with computation
+extern void	exchange_start(udata_t *u, double *v);
+extern int	exchange_test(udata_t *u, double *v);
+extern void	exchange_finish(udata_t *u, double *v);
 
 #endif /* _boundary_h */
@@ -0,0 +1,397 @@
+/*
+ * cg.c -- conjugate gradient solver for the implicit time step
+ *
+ * The system A u = -b with A = 1/ht - laplacian is symmetric and
+ * positive definite, so it can be solved with conjugate gradients. The
+ * matrix is never formed, the product with a vector is the five point
+ * stencil, for which only the halo of the vector has to be exchanged.
+ * The scalar products need a global reduction, which is a point where
+ * all processes synchronize. The classic algorithm has two of them per
+ * iteration (three with a preconditioner if the residual norm is
+ * needed, we merge that one with the second).
+ *
+ * The pipelined variant (Ghysels and Vanroose, 2014) rearranges the
+ * recurrences so that all three scalar products of an iteration are
+ * computed in a single reduction, and that reduction is started with
+ * MPI_Iallreduce before the preconditioner and the matrix vector
+ * product, so the latency of the reduction is hidden by the local work
+ * and the halo exchange. The price is four additional vectors and
+ * somewhat worse rounding behaviour.
+ *
+ * (c) 2014 Prof Dr Andreas Mueller, Hochschule Rapperswil
+ */
+#include "cg.h"
+#include "boundary.h"
+#include "stencil.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <mpi.h>
+
+extern int	debug;
+
+struct cg_s {
+	precond_t	precond;
+	double	omega;	// relaxation factor of the SSOR preconditioner
+	int	pipelined;
+	double	*r;	// residual -b - A u
+	double	*z;	// preconditioned residual M^-1 r
+	double	*p;	// search direction
+	double	*q;	// A p, pipelined: M^-1 s
+	// additional vectors of the pipelined variant
+	double	*w;	// A z
+	double	*m;	// M^-1 w
+	double	*n;	// A m
+	double	*s;	// A p
+	double	*t;	// A q
+};
+
+/**
+ * \brief Allocate the work vectors
+ */
+cg_t	*cg_create(const udata_t *u, precond_t precond, double omega,
+	int pipelined) {
+	cg_t	*cg = (cg_t *)malloc(sizeof(cg_t));
+	cg->precond = precond;
+	cg->omega = omega;
+	cg->pipelined = pipelined;
+	cg->r = doublevector(u->length);
+	cg->z = doublevector(u->length);
+	cg->p = doublevector(u->length);
+	cg->q = doublevector(u->length);
+	cg->w = NULL;
+	cg->m = NULL;
+	cg->n = NULL;
+	cg->s = NULL;
+	cg->t = NULL;
+	if (pipelined) {
+		cg->w = doublevector(u->length);
+		cg->m = doublevector(u->length);
+		cg->n = doublevector(u->length);
+		cg->s = doublevector(u->length);
+		cg->t = doublevector(u->length);
+	}
+	if (debug) {
+		fprintf(stderr, "%s:%d[%d]: %s CG, preconditioner %d\n",
+			__FILE__, __LINE__, u->rank,
+			(pipelined) ? "pipelined" : "classic", precond);
+	}
+	return cg;
+}
+
+/**
+ * \brief Free the work vectors
+ */
+void	cg_free(cg_t *cg) {
+	free(cg->r);
+	free(cg->z);
+	free(cg->p);
+	free(cg->q);
+	free(cg->w);
+	free(cg->m);
+	free(cg->n);
+	free(cg->s);
+	free(cg->t);
+	free(cg);
+}
+
+/**
+ * \brief Matrix vector product q = A p
+ *
+ * p must have the layout of u->u, its halo is updated from the
+ * neighbors first.
+ */
+static void	matvec(udata_t *u, double *p, double *q) {
+	exchange_array(u, p);
+	double	cn = -1. / u->h2;
+	double	c0 = 1. / u->ht + 4. / u->h2;
+	#pragma omp parallel for
+	for (int i = 1; i <= u->height; i++) {
+		int	k = UINDEX(u, i, 1);
+		stencil_row(u->width, p + k, u->stride, p + k, q + k,
+			cn, c0, 0);
+	}
+}
+
+/**
+ * \brief Residual r = -b - A u of the current approximation
+ *
+ * The halo of u is still current from the computation of b.
+ */
+static void	residual(udata_t *u, double *r) {
+	double	cn = 1. / u->h2;
+	double	c0 = -(1. / u->ht + 4. / u->h2);
+	#pragma omp parallel for
+	for (int i = 1; i <= u->height; i++) {
+		int	k = UINDEX(u, i, 1);
+		stencil_row(u->width, u->u + k, u->stride, u->b + k, r + k,
+			cn, c0, -1);
+	}
+}
+
+/**
+ * \brief Local part of the scalar product of two vectors
+ */
+static double	dot(const udata_t *u, const double *a, const double *b) {
+	double	sum = 0;
+	#pragma omp parallel for reduction(+:sum)
+	for (int i = 1; i <= u->height; i++) {
+		int	k = UINDEX(u, i, 1);
+		for (int j = 0; j < u->width; j++) {
+			sum += a[k + j] * b[k + j];
+		}
+	}
+	return sum;
+}
+
+/**
+ * \brief y = x + beta y on the patch
+ */
+static void	xpby(const udata_t *u, const double *x, double beta,
+	double *y) {
+	#pragma omp parallel for
+	for (int i = 1; i <= u->height; i++) {
+		int	k = UINDEX(u, i, 1);
+		for (int j = 0; j < u->width; j++) {
+			y[k + j] = x[k + j] + beta * y[k + j];
+		}
+	}
+}
+
+/**
+ * \brief y = y + alpha x on the patch
+ */
+static void	axpy(const udata_t *u, double alpha, const double *x,
+	double *y) {
+	#pragma omp parallel for
+	for (int i = 1; i <= u->height; i++) {
+		int	k = UINDEX(u, i, 1);
+		for (int j = 0; j < u->width; j++) {
+			y[k + j] += alpha * x[k + j];
+		}
+	}
+}
+
+/**
+ * \brief Apply the SSOR preconditioner z = M^-1 r
+ *
+ * M = omega / (2 - omega) (D / omega + L) (D / omega)^-1 (D / omega + U)
+ * is built from the part of A that couples points of the same patch
+ * only (block Jacobi with SSOR blocks), so that the preconditioner
+ * needs no communication and stays symmetric. The forward and the
+ * backward substitution are done in place in z, the couplings to
+ * points outside the patch are skipped explicitly, because the halo
+ * of z may contain values from an exchange.
+ */
+static void	ssor(const udata_t *u, double omega, const double *r,
+	double *z) {
+	double	d = (1. / u->ht + 4. / u->h2) / omega;
+	double	c = 1. / (d * u->h2);
+	int	s = u->stride;
+	// forward substitution (D / omega + L) y = r
+	for (int i = 1; i <= u->height; i++) {
+		int	k = UINDEX(u, i, 1);
+		for (int j = 0; j < u->width; j++, k++) {
+			double	v = r[k] / d;
+			if (j > 0) {
+				v += c * z[k - 1];
+			}
+			if (i > 1) {
+				v += c * z[k - s];
+			}
+			z[k] = v;
+		}
+	}
+	// backward substitution (D / omega + U) z = (D / omega) y
+	double	scale = (2 - omega) / omega;
+	for (int i = u->height; i >= 1; i--) {
+		int	k = UINDEX(u, i, u->width);
+		for (int j = u->width - 1; j >= 0; j--, k--) {
+			double	v = z[k];
+			if (j < u->width - 1) {
+				v += c * z[k + 1];
+			}
+			if (i < u->height) {
+				v += c * z[k + s];
+			}
+			z[k] = v;
+		}
+	}
+	// the scale factor of M can only be applied when all values are
+	// known, because the substitution uses the unscaled ones
+	for (int i = 1; i <= u->height; i++) {
+		int	k = UINDEX(u, i, 1);
+		for (int j = 0; j < u->width; j++) {
+			z[k + j] *= scale;
+		}
+	}
+}
+
+/**
+ * \brief Apply the preconditioner z = M^-1 r
+ */
+static void	precondition(const cg_t *cg, const udata_t *u,
+	const double *r, double *z) {
+	double	f = 1;
+	switch (cg->precond) {
+	case PRECOND_SSOR:
+		ssor(u, cg->omega, r, z);
+		return;
+	case PRECOND_JACOBI:
+		f = 1. / (1. / u->ht + 4. / u->h2);
+		break;
+	case PRECOND_NONE:
+		break;
+	}
+	#pragma omp parallel for
+	for (int i = 1; i <= u->height; i++) {
+		int	k = UINDEX(u, i, 1);
+		for (int j = 0; j < u->width; j++) {
+			z[k + j] = f * r[k + j];
+		}
+	}
+}
+
+/**
+ * \brief Convert the global sums to the norms reported to the caller
+ */
+static void	scale_norms(const udata_t *u, double rr, double bb,
+	double points, double norm[2]) {
+	norm[0] = u->ht * sqrt(rr / points);
+	norm[1] = u->ht * sqrt(bb / points);
+}
+
+/**
+ * \brief Classic preconditioned conjugate gradients
+ *
+ * The reduction after the matrix vector product computes (p, A p),
+ * the second one computes (r, z) and (r, r) together.
+ */
+static int	solve_classic(cg_t *cg, udata_t *u, double epsilon,
+	int maxiter, double norm[2]) {
+	residual(u, cg->r);
+	precondition(cg, u, cg->r, cg->z);
+	xpby(u, cg->z, 0, cg->p);
+
+	// the first reduction also computes the norm of the right hand side
+	// and the number of points
+	double	local[4] = { dot(u, cg->r, cg->r), dot(u, cg->r, cg->z),
+			dot(u, u->b, u->b), u->width * u->height };
+	double	global[4];
+	MPI_Allreduce(local, global, 4, MPI_DOUBLE, MPI_SUM, u->comm);
+	double	rr = global[0], rz = global[1], bb = global[2];
+	double	points = global[3];
+
+	int	k = 0;
+	while (k < maxiter) {
+		if ((rr == 0) || ((epsilon > 0)
+			&& (rr <= epsilon * epsilon * bb))) {
+			break;
+		}
+		matvec(u, cg->p, cg->q);
+		double	pq, localpq = dot(u, cg->p, cg->q);
+		MPI_Allreduce(&localpq, &pq, 1, MPI_DOUBLE, MPI_SUM,
+			u->comm);
+		double	alpha = rz / pq;
+		axpy(u, alpha, cg->p, u->u);
+		axpy(u, -alpha, cg->q, cg->r);
+		precondition(cg, u, cg->r, cg->z);
+		local[0] = dot(u, cg->r, cg->r);
+		local[1] = dot(u, cg->r, cg->z);
+		MPI_Allreduce(local, global, 2, MPI_DOUBLE, MPI_SUM,
+			u->comm);
+		rr = global[0];
+		double	beta = global[1] / rz;
+		rz = global[1];
+		xpby(u, cg->z, beta, cg->p);
+		k++;
+	}
+	scale_norms(u, rr, bb, points, norm);
+	return k;
+}
+
+/**
+ * \brief Pipelined preconditioned conjugate gradients
+ *
+ * Recurrences as in Ghysels and Vanroose, Algorithm 4: z = M^-1 r,
+ * w = A z, m = M^-1 w, n = A m, and the updates of p, s = A p,
+ * q = M^-1 s and t = A q only need the three scalar products
+ * (r, z), (w, z) and (r, r) of the current iteration, which are reduced
+ * while m and n are computed.
+ */
+static int	solve_pipelined(cg_t *cg, udata_t *u, double epsilon,
+	int maxiter, double norm[2]) {
+	residual(u, cg->r);
+	precondition(cg, u, cg->r, cg->z);
+	matvec(u, cg->z, cg->w);
+
+	double	local[2] = { dot(u, u->b, u->b), u->width * u->height };
+	double	global[3];
+	MPI_Allreduce(local, global, 2, MPI_DOUBLE, MPI_SUM, u->comm);
+	double	bb = global[0];
+	double	points = global[1];
+
+	double	rr = 0;
+	double	gamma = 0, gammaold = 0, alpha = 0;
+	int	k = 0;
+	while (k < maxiter) {
+		double	sums[3] = { dot(u, cg->r, cg->z), dot(u, cg->w, cg->z),
+				dot(u, cg->r, cg->r) };
+		MPI_Request	request;
+		MPI_Iallreduce(sums, global, 3, MPI_DOUBLE, MPI_SUM,
+			u->comm, &request);
+
+		// local work and halo exchange overlap with the reduction
+		precondition(cg, u, cg->w, cg->m);
+		matvec(u, cg->m, cg->n);
+
+		MPI_Wait(&request, MPI_STATUS_IGNORE);
+		gamma = global[0];
+		double	delta = global[1];
+		rr = global[2];
+		if ((rr == 0) || ((epsilon > 0)
+			&& (rr <= epsilon * epsilon * bb))) {
+			break;
+		}
+		double	beta;
+		if (k > 0) {
+			beta = gamma / gammaold;
+			alpha = gamma / (delta - beta * gamma / alpha);
+		} else {
+			beta = 0;
+			alpha = gamma / delta;
+		}
+		gammaold = gamma;
+
+		xpby(u, cg->n, beta, cg->t);
+		xpby(u, cg->m, beta, cg->q);
+		xpby(u, cg->w, beta, cg->s);
+		xpby(u, cg->z, beta, cg->p);
+		axpy(u, alpha, cg->p, u->u);
+		axpy(u, -alpha, cg->s, cg->r);
+		axpy(u, -alpha, cg->q, cg->z);
+		axpy(u, -alpha, cg->t, cg->w);
+		k++;
+	}
+
+	// the residual norm of the last iteration is only known after
+	// another reduction, which would not be needed otherwise
+	if (k == maxiter) {
+		double	localrr = dot(u, cg->r, cg->r);
+		MPI_Allreduce(&localrr, &rr, 1, MPI_DOUBLE, MPI_SUM,
+			u->comm);
+	}
+	scale_norms(u, rr, bb, points, norm);
+	return k;
+}
+
+/**
+ * \brief Solve the linear system of a time step
+ */
+int	cg_solve(cg_t *cg, udata_t *u, double epsilon, int maxiter,
+	double norm[2]) {
+	if (cg->pipelined) {
+		return solve_pipelined(cg, u, epsilon, maxiter, norm);
+	}
+	return solve_classic(cg, u, epsilon, maxiter, norm);
+}
@@ -0,0 +1,39 @@
+/*
+ * cg.h -- conjugate gradient solver for the implicit time step
+ *
+ * (c) 2014 Prof Dr Andreas Mueller, Hochschule Rapperswil
+ */
+#ifndef _cg_h
+#define _cg_h
+
+#include "domain.h"
+
+typedef enum {
+	PRECOND_NONE, PRECOND_JACOBI, PRECOND_SSOR
+} precond_t;
+
+typedef struct cg_s	cg_t;
+
+/*
+ * Allocate the work vectors for the patch of u. If pipelined is set,
+ * the pipelined variant is used, which needs a single non blocking
+ * reduction per iteration. omega is the relaxation factor of the SSOR
+ * preconditioner.
+ */
+extern cg_t	*cg_create(const udata_t *u, precond_t precond, double omega,
+			int pipelined);
+extern void	cg_free(cg_t *cg);
+
+/*
+ * Solve (1 - ht laplacian) u = -ht b with u->u as initial approximation,
+ * u->b must already have been computed. The iteration stops after
+ * maxiter iterations, or when the 2-norm of the residual is at most
+ * epsilon times the norm of the right hand side. norm[0] and norm[1]
+ * receive these norms, scaled like the change of a Jordan step, i.e.
+ * multiplied by ht / sqrt(number of points). Returns the number of
+ * iterations.
+ */
+extern int	cg_solve(cg_t *cg, udata_t *u, double epsilon,
+			int maxiter, double norm[2]);
+
+#endif /* _cg_h */
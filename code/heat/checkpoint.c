@@ -0,0 +1,170 @@
+/*
+ * checkpoint.c -- save and restore the state of a heat_mpi run
+ *
+ * A checkpoint file starts with a header of HEADER_SIZE bytes, which
+ * contains a magic string and the checkpoint_t structure, followed by
+ * the values of u for the whole image as doubles, row by row. All ranks
+ * write and read their patch with a single collective MPI-IO call, the
+ * file view is the subarray of the patch in the image, the memory type
+ * the interior of the u array. Since the file does not depend on the
+ * patches, a run can be restarted with a different number of ranks.
+ * The file is in the native binary format, so it can only be read on
+ * a machine with the same byte order.
+ *
+ * (c) 2014 Prof Dr Andreas Mueller, Hochschule Rapperswil
+ */
+#include "checkpoint.h"
+#include "partition.h"
+#include <stdio.h>
+#include <string.h>
+
+extern int	debug;
+
+#define	HEADER_SIZE	64
+#define	MAGIC		"HEATCKPT"
+
+/**
+ * \brief Datatype for the patch of this rank in the image stored in the file
+ */
+static MPI_Datatype	filetype(const udata_t *u, int width, int height) {
+	const int	*range = &u->ranges[4 * u->rank];
+	int	sizes[2] = { height, width };
+	int	subsizes[2] = { u->height, u->width };
+	int	starts[2] = { range[2], range[0] };
+	MPI_Datatype	type;
+	MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C,
+		MPI_DOUBLE, &type);
+	MPI_Type_commit(&type);
+	return type;
+}
+
+/**
+ * \brief Combine the error flags of all ranks, so that all agree
+ */
+static int	failed(const udata_t *u, int err) {
+	int	any = 0;
+	MPI_Allreduce(&err, &any, 1, MPI_INT, MPI_MAX, u->comm);
+	return any;
+}
+
+/**
+ * \brief Write the patches collectively
+ */
+int	checkpoint_write(const udata_t *u, const char *filename,
+	const checkpoint_t *state) {
+	char	tmpname[1024];
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+	if (debug) {
+		fprintf(stderr, "%s:%d[%d]: writing checkpoint %s at step %d\n",
+			__FILE__, __LINE__, u->rank, tmpname, state->tcounter);
+	}
+	MPI_File	fh;
+	if (MPI_SUCCESS != MPI_File_open(u->comm, tmpname,
+		MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh)) {
+		if (u->rank == 0) {
+			fprintf(stderr, "cannot create checkpoint %s\n",
+				tmpname);
+		}
+		return -1;
+	}
+	int	err = (MPI_SUCCESS != MPI_File_set_size(fh, 0));
+
+	// rank 0 writes the header
+	if (u->rank == 0) {
+		char	header[HEADER_SIZE];
+		memset(header, 0, sizeof(header));
+		memcpy(header, MAGIC, strlen(MAGIC));
+		memcpy(header + 8, state, sizeof(checkpoint_t));
+		err |= (MPI_SUCCESS != MPI_File_write_at(fh, 0, header,
+			HEADER_SIZE, MPI_BYTE, MPI_STATUS_IGNORE));
+	}
+
+	// all ranks write their patch
+	MPI_Datatype	ftype = filetype(u, state->width, state->height);
+	MPI_Datatype	mtype = patchtype(u);
+	err |= (MPI_SUCCESS != MPI_File_set_view(fh, HEADER_SIZE, MPI_DOUBLE,
+		ftype, "native", MPI_INFO_NULL));
+	err |= (MPI_SUCCESS != MPI_File_write_all(fh, u->u, 1, mtype,
+		MPI_STATUS_IGNORE));
+	err |= (MPI_SUCCESS != MPI_File_close(&fh));
+	MPI_Type_free(&ftype);
+	MPI_Type_free(&mtype);
+
+	// only replace the previous checkpoint if all ranks succeeded
+	if (failed(u, err)) {
+		if (u->rank == 0) {
+			fprintf(stderr, "cannot write checkpoint %s\n",
+				tmpname);
+		}
+		return -1;
+	}
+	if (u->rank == 0) {
+		err = rename(tmpname, filename);
+		if (err) {
+			perror("cannot rename checkpoint");
+		}
+	}
+	MPI_Bcast(&err, 1, MPI_INT, 0, u->comm);
+	return (err) ? -1 : 0;
+}
+
+/**
+ * \brief Read the patches collectively
+ *
+ * state->width and state->height must be set to the size of the image,
+ * the checkpoint must have been written for an image of the same size.
+ */
+int	checkpoint_read(udata_t *u, const char *filename,
+	checkpoint_t *state) {
+	if (debug) {
+		fprintf(stderr, "%s:%d[%d]: reading checkpoint %s\n",
+			__FILE__, __LINE__, u->rank, filename);
+	}
+	MPI_File	fh;
+	if (MPI_SUCCESS != MPI_File_open(u->comm, filename, MPI_MODE_RDONLY,
+		MPI_INFO_NULL, &fh)) {
+		if (u->rank == 0) {
+			fprintf(stderr, "cannot open checkpoint %s\n",
+				filename);
+		}
+		return -1;
+	}
+
+	// all ranks need the header
+	char	header[HEADER_SIZE];
+	int	err = (MPI_SUCCESS != MPI_File_read_at_all(fh, 0, header,
+		HEADER_SIZE, MPI_BYTE, MPI_STATUS_IGNORE));
+	checkpoint_t	saved;
+	memcpy(&saved, header + 8, sizeof(checkpoint_t));
+	if ((!err) && ((0 != memcmp(header, MAGIC, strlen(MAGIC)))
+		|| (saved.width != state->width)
+		|| (saved.height != state->height))) {
+		if (u->rank == 0) {
+			fprintf(stderr, "%s is not a checkpoint for a %d x %d "
+				"image\n", filename, state->width,
+				state->height);
+		}
+		MPI_File_close(&fh);
+		return -1;
+	}
+
+	// all ranks read their patch
+	MPI_Datatype	ftype = filetype(u, state->width, state->height);
+	MPI_Datatype	mtype = patchtype(u);
+	err |= (MPI_SUCCESS != MPI_File_set_view(fh, HEADER_SIZE, MPI_DOUBLE,
+		ftype, "native", MPI_INFO_NULL));
+	err |= (MPI_SUCCESS != MPI_File_read_all(fh, u->u, 1, mtype,
+		MPI_STATUS_IGNORE));
+	err |= (MPI_SUCCESS != MPI_File_close(&fh));
+	MPI_Type_free(&ftype);
+	MPI_Type_free(&mtype);
+	if (failed(u, err)) {
+		if (u->rank == 0) {
+			fprintf(stderr, "cannot read checkpoint %s\n",
+				filename);
+		}
+		return -1;
+	}
+	*state = saved;
+	return 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * checkpoint.h -- save and restore the state of a heat_mpi run
+ *
+ * (c) 2014 Prof Dr Andreas Mueller, Hochschule Rapperswil
+ */
+#ifndef _checkpoint_h
+#define _checkpoint_h
+
+#include "domain.h"
+
+/*
+ * Global state of the simulation, besides the values of u. The right
+ * hand side b is not part of the state, every solver computes it from
+ * u at the beginning of a time step, so u, t and the counters are
+ * enough to continue a run.
+ */
+typedef struct {
+	int	width;		// size of the whole image
+	int	height;
+	int	tcounter;	// number of time steps done
+	int	tag;		// next tag for image transfers
+	double	t;		// simulation time
+	double	ht;		// time step, must not change on restart
+} checkpoint_t;
+
+/*
+ * Write the state and the patch of every rank to filename. The file
+ * contains u for the whole image, independent of the layout of the
+ * patches. It is written to filename.tmp first and then renamed, so a
+ * crash while writing leaves the previous checkpoint intact. This is a
+ * collective operation on u->comm. Returns 0 on success, -1 on error.
+ */
+extern int	checkpoint_write(const udata_t *u, const char *filename,
+			const checkpoint_t *state);
+
+/*
+ * Read the state and the patch of this rank from filename, the layout
+ * of the patches may differ from the one used to write it. This is a
+ * collective operation on u->comm. Returns 0 on success, -1 on error.
+ */
+extern int	checkpoint_read(udata_t *u, const char *filename,
+			checkpoint_t *state);
+
+#endif /* _checkpoint_h */
@@ -22,86 +22,126 @@ double	*doublevector(int size) {
 	return result;
 }
 
+/**
+ * \brief allocate u and the spare array in a shared memory window
+ *
+ * This is a collective operation on the ranks of the node, which are all
+ * ranks of u->comm, in the same order, see createtopology. The segments
+ * of the neighbors and their dimensions are looked up once, the segments
+ * need not be contiguous, so that each can be placed in the memory
+ * close to the core of its rank.
+ */
+static void	allocate_shared(udata_t *u) {
+	MPI_Info	info;
+	MPI_Info_create(&info);
+	MPI_Info_set(info, "alloc_shared_noncontig", "true");
+	MPI_Aint	size = 2 * (MPI_Aint)u->length * sizeof(double);
+	MPI_Win_allocate_shared(size, sizeof(double), info, u->shm.comm,
+		&u->shm.own, &u->shm.window);
+	MPI_Info_free(&info);
+	for (int i = 0; i < 2 * u->length; i++) {
+		u->shm.own[i] = 0;
+	}
+	u->u = u->shm.own;
+	u->spare = u->shm.own + u->length;
+	for (int d = 0; d < 4; d++) {
+		int	n = u->neighbors[d];
+		u->shm.base[d] = NULL;
+		if (n == MPI_PROC_NULL) {
+			continue;
+		}
+		MPI_Aint	nsize;
+		int	disp;
+		MPI_Win_shared_query(u->shm.window, n, &nsize, &disp,
+			&u->shm.base[d]);
+		u->shm.width[d] = u->ranges[4 * n + 1] - u->ranges[4 * n];
+		u->shm.height[d] = u->ranges[4 * n + 3] - u->ranges[4 * n + 2];
+	}
+	if (debug) {
+		fprintf(stderr, "%s:%d[%d]: shared window of %ld bytes\n",
+			__FILE__, __LINE__, u->rank, (long)size);
+	}
+}
+
 /**
  * \brief allocate all data arrays needed for the computation
  */
 void	allocate_u(udata_t *u) {
-	u->length = u->width * u->height;
-	u->u = doublevector(u->length);
+	u->stride = u->width + 2 * u->halo;
+	u->length = u->stride * (u->height + 2 * u->halo);
+	if (u->sharedmem) {
+		allocate_shared(u);
+	} else {
+		u->u = doublevector(u->length);
+		u->spare = NULL;
+		u->shm.window = MPI_WIN_NULL;
+	}
 	u->b = doublevector(u->length);
 	if (debug) {
 		fprintf(stderr, "[%d]: %ld bytes allocated\n", u->rank,
 			u->length * sizeof(double));
 	}
 
-	// allocate memory for the borders from other areas
-	u->left = doublevector(u->height);
-	u->right = doublevector(u->height);
-	u->top = doublevector(u->width);
-	u->bottom = doublevector(u->width);
+	// the left and right columns are not contiguous, a vector datatype
+	// describes them, so that they can be sent and received in place
+	// just like the top and bottom rows
+	MPI_Type_vector(u->height, u->halo, u->stride, MPI_DOUBLE,
+		&u->column);
+	MPI_Type_commit(&u->column);
+	for (int a = 0; a < HALO_ARRAYS; a++) {
+		u->halos[a].v = NULL;
+	}
+	u->nexthalo = 0;
+}
 
-	u->send_left = doublevector(u->height);
-	u->send_right = doublevector(u->height);
-	u->send_top = doublevector(u->width);
-	u->send_bottom = doublevector(u->width);
+/**
+ * \brief free the persistent requests of an array
+ */
+void	free_halo(halo_t *h) {
+	for (int d = 0; d < h->ncolumns; d++) {
+		MPI_Request_free(&h->columns[d]);
+	}
+	for (int d = 0; d < h->nrows; d++) {
+		MPI_Request_free(&h->rows[d]);
+	}
+	h->v = NULL;
 }
 
 /**
  * \brief free the arrays allocated
  */
 void	free_u(udata_t *u) {
-	free(u->u);		u->u = NULL;
+	if (u->shm.window != MPI_WIN_NULL) {
+		MPI_Win_free(&u->shm.window);
+	} else {
+		free(u->u);
+	}
+	u->u = NULL;
+	u->spare = NULL;
 	free(u->b);		u->b = NULL;
 
-	free(u->left);		u->left = NULL;
-	free(u->right);		u->right = NULL;
-	free(u->top);		u->top = NULL;
-	free(u->bottom);	u->bottom = NULL;
-
-	free(u->send_left);	u->send_left = NULL;
-	free(u->send_right);	u->send_right = NULL;
-	free(u->send_top);	u->send_top = NULL;
-	free(u->send_bottom);	u->send_bottom = NULL;
+	for (int a = 0; a < HALO_ARRAYS; a++) {
+		if (u->halos[a].v) {
+			free_halo(&u->halos[a]);
+		}
+	}
+	MPI_Type_free(&u->column);
 }
 
 /**
  * \brief Access to the u data
  *
- * This method gives access to the data in the u array, including the special
- * cases when (i,j) is a boundary point.
+ * This method gives access to the data in the u array, including the
+ * boundary points (i,j) in the halo.
  */
 double	U(const udata_t *u, int i, int j) {
-	if (i == 0) {
-		if (j == 0) {
-			return 0;
-		}
-		if (j == u->width + 1) {
-			return 0;
-		}
-		return u->top[j - 1];
-	}
-	if (i == u->height + 1) {
-		if (j == 0) {
-			return 0;
-		}
-		if (j == u->width + 1) {
-			return 0;
-		}
-		return u->bottom[j - 1];
-	}
-	if (j == 0) {
-		return u->left[i - 1];
-	}
-	if (j == u->width + 1) {
-		return u->right[i - 1];
-	}
-	return u->u[(j - 1) + (i - 1) * u->width];
+	return u->u[UINDEX(u, i, j)];
 }
 
 /**
  * \brief Access to the b vector
  */
 double	B(const udata_t *u, int i, int j) {
-	return u->b[j - 1 + (i - 1) * u->width];
+	return u->b[UINDEX(u, i, j)];
 }
 
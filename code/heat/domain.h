@@ -8,37 +8,106 @@
 
 #include <mpi.h>
 
+/*
+ * Persistent requests for the halo exchange of one array. They are
+ * bound to the address of the array, so they are created the first
+ * time an array is exchanged, and reused for all later exchanges.
+ * Only the neighbors that exist have requests, receives come first.
+ */
 typedef struct {
-	double	*u;	// u values
-	double	*b;	// b values
-	double	*left;	// left border (left neighbor)
-	double	*right;	// right border (right neighbor)
-	double	*top;	// top border (top neighbor)
-	double	*bottom;// bottom border (bottom neighbor)
-	double	*send_left;
-	double	*send_right;
-	double	*send_top;
-	double	*send_bottom;
-	MPI_Request	left_request;
-	MPI_Request	right_request;
-	MPI_Request	top_request;
-	MPI_Request	bottom_request;
+	double	*v;		// array the requests belong to, or NULL
+	MPI_Request	columns[4];	// left and right halo columns
+	int	ncolumns;
+	MPI_Request	rows[4];	// top and bottom halo rows
+	int	nrows;
+} halo_t;
+
+#define	HALO_ARRAYS	8	// arrays per patch with persistent requests
+#define	HALO_TAG	0	// tag of all halo messages, never used otherwise
+
+// neighbors in the order of the Cartesian topology: dimension 0 (y)
+// first, in each dimension the lower index first
+#define	TOP	0
+#define	BOTTOM	1
+#define	LEFT	2
+#define	RIGHT	3
+
+/*
+ * Arguments of a halo exchange with a neighborhood collective. They
+ * have to stay valid until a non blocking exchange is complete.
+ * Displacements are in bytes relative to the array.
+ */
+typedef struct {
+	int	counts[4];
+	MPI_Aint	sdispls[4];
+	MPI_Aint	rdispls[4];
+	MPI_Datatype	types[4];
+	MPI_Request	request;
+} collective_t;
+
+/*
+ * Shared memory window for the halo exchange of ranks on the same node.
+ * The segment of each rank in the window holds two arrays with the
+ * layout of u, the u array and the spare, which may be swapped by the
+ * iteration. The neighbors copy the halo directly from the array at
+ * the same position in the segment of the neighbor.
+ */
+typedef struct {
+	MPI_Comm	comm;	// ranks on this node, or MPI_COMM_NULL
+	MPI_Win	window;	// segments of all ranks, or MPI_WIN_NULL
+	double	*own;	// segment of this rank
+	double	*base[4];	// segments of the neighbors, or NULL
+	int	width[4];	// patch width of the neighbors
+	int	height[4];	// patch height of the neighbors
+} shared_t;
+
+/*
+ * The u and b arrays have a halo of halo cells around the patch, i.e.
+ * they contain (width + 2 halo) x (height + 2 halo) values. The points
+ * of the patch have indices i = 1..height, j = 1..width, the rows
+ * i = 1 - halo..0 and height + 1..height + halo and the corresponding
+ * columns contain the boundary values received from the neighbors, or 0
+ * at the boundary of the domain. This allows to compute the laplacian
+ * without distinguishing boundary cases. A halo wider than one cell
+ * allows to perform several iteration steps between exchanges, see
+ * iterate_blocked.
+ */
+typedef struct {
+	double	*u;	// u values, with halo
+	double	*b;	// b values, same layout as u
+	MPI_Datatype	column;	// halo columns, strided in the arrays
+	halo_t	halos[HALO_ARRAYS];
+	int	nexthalo;	// next entry of halos to replace
+	int	collective;	// exchange with neighborhood collectives
+	collective_t	nb;
+	int	sharedmem;	// exchange through a shared memory window
+	shared_t	shm;
+	double	*spare;	// second array in the window, or NULL
 	int	width;	// width of this part of u
 	int	height;	// height of this part of u
-	int	length;	// number of values in this patch
+	int	length;	// number of values in the arrays, including halo
+	int	halo;	// width of the halo
+	int	stride;	// length of a row of the arrays, width + 2 halo
 	int	rh;	// range index in x direction
 	int	rv;	// range index in y direction
 	int	*ranges;
 	int	nx;	// number of ranges in x direction
 	int	ny;	// number of ranges in y direction
-	int	rank;	// rank of this processes
+	int	rank;	// rank of this processes in comm
+	MPI_Comm	comm;	// Cartesian communicator of the patches
+	int	neighbors[4];	// ranks of the neighbors, or MPI_PROC_NULL
 	double	ht;	// time step
 	double	h2;	// 2h^2_x, used in laplacian computation
 } udata_t;
 
+// index of point (i,j) in the u and b arrays
+#define	UINDEX(_u, _i, _j)	((_j) + (_u)->halo - 1 \
+				+ ((_i) + (_u)->halo - 1) * (_u)->stride)
+
 extern double	*doublevector(int size);
 extern void	allocate_u(udata_t *u);
 extern void	free_u(udata_t *u);
+extern void	free_halo(halo_t *h);
 extern double	U(const udata_t *u, int i, int j);
 extern double	B(const udata_t *u, int i, int j);
 
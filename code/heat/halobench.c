@@ -0,0 +1,138 @@
+/*
+ * halobench.c -- compare the variants of the halo exchange
+ *
+ * Every rank gets an n x n patch in a Cartesian layout of the ranks,
+ * and the halo of the u array is exchanged a number of times with
+ * persistent point to point messages, with a neighborhood collective,
+ * and, if all ranks are on the same node, by copying it from the shared
+ * memory window. The time per exchange of the slowest rank and the
+ * bandwidth of an interior rank (four neighbors) are reported.
+ *
+ * Run it with mpirun -n <n> ./halobench n ...
+ *
+ * (c) 2014 Prof Dr Andreas Mueller, Hochschule Rapperswil
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <mpi.h>
+#include "domain.h"
+#include "boundary.h"
+#include "partition.h"
+
+int	debug = 0;
+
+static const char	*modes[3] = { "messages", "collective", "shared" };
+
+/**
+ * \brief Time per exchange of the slowest rank in seconds
+ */
+static double	measure(udata_t *u, int mode, int repeats) {
+	u->collective = (mode == 1);
+	u->sharedmem = (mode == 2);
+	allocate_u(u);
+	for (int i = 0; i < u->length; i++) {
+		u->u[i] = u->rank;
+	}
+	exchange_boundaries(u);		// sets up the requests
+	MPI_Barrier(u->comm);
+	double	start = MPI_Wtime();
+	for (int r = 0; r < repeats; r++) {
+		exchange_boundaries(u);
+	}
+	double	t = (MPI_Wtime() - start) / repeats;
+	free_u(u);
+	double	slowest;
+	MPI_Allreduce(&t, &slowest, 1, MPI_DOUBLE, MPI_MAX, u->comm);
+	return slowest;
+}
+
+static void	usage(const char *progname) {
+	fprintf(stderr, "usage: mpirun -n <n> %s [ -k halo ] [ -r repeats ] "
+		"n ...\n", progname);
+	fprintf(stderr, "measure the halo exchange of n x n patches\n");
+	fprintf(stderr, "options:\n");
+	fprintf(stderr, " -k halo    width of the halo (default 1)\n");
+	fprintf(stderr, " -r repeats number of exchanges per size and "
+		"variant (default 1000)\n");
+}
+
+int	main(int argc, char *argv[]) {
+	MPI_Init(&argc, &argv);
+	int	num_procs;
+	MPI_Comm_size(MPI_COMM_WORLD, &num_procs);
+
+	udata_t	u;
+	u.halo = 1;
+	int	repeats = 1000;
+	int	c;
+	while (EOF != (c = getopt(argc, argv, "dk:r:?")))
+		switch (c) {
+		case 'd':
+			debug++;
+			break;
+		case 'k':
+			u.halo = atoi(optarg);
+			break;
+		case 'r':
+			repeats = atoi(optarg);
+			break;
+		case '?':
+			usage(argv[0]);
+			MPI_Finalize();
+			return EXIT_SUCCESS;
+		}
+
+	// Cartesian layout as in heat_mpi, with the node communicator
+	int	dims[2] = { 0, 0 };
+	MPI_Dims_create(num_procs, 2, dims);
+	u.ny = dims[0];
+	u.nx = dims[1];
+	u.sharedmem = 1;
+	createtopology(&u);
+	int	shared = u.sharedmem;
+	u.ranges = (int *)malloc(4 * num_procs * sizeof(int));
+	if (u.rank == 0) {
+		fprintf(stderr, "%d x %d patches, halo %d\n", u.nx, u.ny,
+			u.halo);
+		printf("n,variant,usec,gbytes\n");
+	}
+
+	for (; optind < argc; optind++) {
+		int	n = atoi(argv[optind]);
+		if (n < u.halo) {
+			if (u.rank == 0) {
+				fprintf(stderr, "not a valid size: %s\n",
+					argv[optind]);
+			}
+			continue;
+		}
+		for (int r = 0; r < num_procs; r++) {
+			u.ranges[4 * r + 0] = (r % u.nx) * n;
+			u.ranges[4 * r + 1] = (r % u.nx + 1) * n;
+			u.ranges[4 * r + 2] = (r / u.nx) * n;
+			u.ranges[4 * r + 3] = (r / u.nx + 1) * n;
+		}
+		u.width = n;
+		u.height = n;
+
+		// an interior rank receives four strips of n x halo values
+		double	bytes = 4. * n * u.halo * sizeof(double);
+		for (int mode = 0; mode < ((shared) ? 3 : 2); mode++) {
+			double	t = measure(&u, mode, repeats);
+			if (u.rank == 0) {
+				printf("%d,%s,%.3f,%.3f\n", n, modes[mode],
+					1e6 * t, bytes / t / 1e9);
+				fflush(stdout);
+			}
+		}
+	}
+
+	free(u.ranges);
+	if (u.shm.comm != MPI_COMM_NULL) {
+		MPI_Comm_free(&u.shm.comm);
+	}
+	MPI_Comm_free(&u.comm);
+	MPI_Finalize();
+	return EXIT_SUCCESS;
+}
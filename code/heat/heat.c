@@ -5,30 +5,441 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
 #include "output.h"
+#include "writer.h"
 #include <getopt.h>
 #include <common.h>
+#include <band.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 int	debug = 0;
 
+// methods to solve the linear system of the implicit time step
+typedef enum {
+	METHOD_JACOBI, METHOD_THOMAS, METHOD_PCR, METHOD_MULTIGRID
+} method_t;
+
+/*
+ * Smallest number of points for which the loops over the interval use
+ * threads. Below, the time saved by dividing a loop among the threads
+ * is less than the time of the barrier at its end, so the loops run
+ * serially. Set by measure_threshold.
+ */
+static int	parallel_min = 0;
+
+/*
+ * Number of points per tile for the temporally blocked iteration. The
+ * two tile buffers and the corresponding part of b, 48 kB, stay in the
+ * L1/L2 cache while several sweeps are performed.
+ */
+#define	TILE	2048
+
+/**
+ * \brief Perform several Jacobi iteration steps with overlapped tiling
+ *
+ * The interval is cut into tiles of TILE points. To perform sweeps
+ * steps on a tile without any communication with neighboring tiles,
+ * each tile is copied into a local buffer together with sweeps
+ * additional points on each side. Each step then computes one point
+ * less on each side, so that after sweeps steps, the points of the
+ * tile have the correct values. The points at the boundary of the
+ * interval never change. The full arrays are read and written only
+ * once for all steps, at the price of 2 * sweeps redundant points
+ * per tile. The result is written to unew.
+ *
+ * The last two steps of each tile are still in the cache at the end,
+ * so the maximum change in the last step (norm[0]) and the maximum of
+ * |u| (norm[1]) are computed for the convergence check.
+ */
+static void	jacobi_tiled(int n, const double *u, double *unew,
+	const double *b, double ht, double hx2, int sweeps, int threads,
+	double norm[2]) {
+	int	tiles = (n + TILE - 1) / TILE;
+	double	change = 0, umax = 0;
+#pragma omp parallel num_threads(threads) if(n >= parallel_min) \
+	reduction(max:change,umax)
+	{
+	double	*v = (double *)malloc((TILE + 2 * sweeps) * sizeof(double));
+	double	*w = (double *)malloc((TILE + 2 * sweeps) * sizeof(double));
+#pragma omp for
+	for (int tile = 0; tile < tiles; tile++) {
+		// tile points a..e, local buffer points lo..hi
+		int	a = 1 + tile * TILE;
+		int	e = (a + TILE - 1 < n) ? a + TILE - 1 : n;
+		int	lo = (a - sweeps > 0) ? a - sweeps : 0;
+		int	hi = (e + sweeps < n + 1) ? e + sweeps : n + 1;
+		memcpy(v, u + lo, (hi - lo + 1) * sizeof(double));
+		memcpy(w, u + lo, (hi - lo + 1) * sizeof(double));
+		const double	*bl = b + lo;
+		double	*src = v, *dst = w;
+		for (int t = 1; t <= sweeps; t++) {
+			int	j0 = (lo == 0) ? 1 : t;
+			int	j1 = (hi == n + 1) ? hi - lo - 1 : hi - lo - t;
+			for (int j = j0; j <= j1; j++) {
+				dst[j] = -ht * (bl[j] - (src[j-1] - 2 * src[j] + src[j+1]) / hx2);
+			}
+			double	*tmp = src; src = dst; dst = tmp;
+		}
+		memcpy(unew + a, src + a - lo, (e - a + 1) * sizeof(double));
+		for (int j = a - lo; j <= e - lo; j++) {
+			double	d = fabs(src[j] - dst[j]);
+			change = (d > change) ? d : change;
+			umax = (fabs(src[j]) > umax) ? fabs(src[j]) : umax;
+		}
+	}
+	free(v);
+	free(w);
+	}
+	norm[0] = change;
+	norm[1] = umax;
+}
+
+/**
+ * \brief Measure the number of points above which threads pay off
+ *
+ * An iteration step on n points takes n * point seconds serially and
+ * n * point / threads + barrier seconds with threads, so threads are
+ * faster if n > barrier / (point * (1 - 1 / threads)). The time per
+ * point is measured with the Jacobi step on an interval that fits in
+ * the cache, the barrier in a parallel region with many barriers, so
+ * the cost of starting the threads is amortized as in jacobi_run.
+ */
+static int	measure_threshold(int threads) {
+	if (threads <= 1) {
+		return INT_MAX;
+	}
+	int	m = 4096, repeats = 1000;
+	double	*v = (double *)calloc(m + 2, sizeof(double));
+	double	*w = (double *)calloc(m + 2, sizeof(double));
+	double	*b = (double *)malloc((m + 2) * sizeof(double));
+	for (int j = 0; j < m + 2; j++) {
+		b[j] = j % 7;
+	}
+	double	start = gettime();
+	for (int r = 0; r < repeats; r++) {
+		for (int j = 1; j <= m; j++) {
+			w[j] = -0.1 * (b[j] - (v[j-1] - 2 * v[j] + v[j+1]) / 2);
+		}
+		double	*tmp = v; v = w; w = tmp;
+	}
+	double	point = (gettime() - start) / ((double)repeats * m);
+	volatile double	sink = v[m / 2];
+	(void)sink;
+	free(v);
+	free(w);
+	free(b);
+
+	start = gettime();
+#pragma omp parallel num_threads(threads)
+	for (int r = 0; r < repeats; r++) {
+#pragma omp barrier
+	}
+	double	barrier = (gettime() - start) / repeats;
+	double	limit = barrier / (point * (1 - 1. / threads));
+	if (debug) {
+		fprintf(stderr, "%s:%d: %.3g s per point, %.3g s per barrier, "
+			"threads from %.0f points\n", __FILE__, __LINE__,
+			point, barrier, limit);
+	}
+	return (limit < INT_MAX) ? (int)limit : INT_MAX;
+}
+
+/**
+ * \brief All time steps of the Jacobi iteration in one parallel region
+ *
+ * Starting the threads for every loop costs more than the loop itself
+ * for small n, so the threads are started once for the whole run. All
+ * threads step through the time loop, each with its own copy of the
+ * counters and of the pointers to the two buffers, which are swapped
+ * after each iteration instead of copying unew to u. The loops over
+ * the points use the same static schedule, so every thread computes
+ * b for the points it later iterates, and only needs a barrier after
+ * each iteration, when it reads the values of its neighbors. For the
+ * convergence check, the maxima are reduced and read by all threads.
+ * Output and logging are done by the master thread, the barrier at the
+ * end of the first iteration of the next step protects the snapshot.
+ * Below parallel_min points, the region runs on a single thread.
+ *
+ * Returns the number of time steps, or -1 if the iteration diverges.
+ */
+static int	jacobi_run(int n, double **u, double **unew, double *b,
+	double ht, double hx2, double maxt, int maxiter, double epsilon,
+	int interval, int threads, int steps, writer_t *writer,
+	int verbose, double norm[2]) {
+	int	tcounter = 0;
+	int	diverged = 0;
+	double	change = 0, umax = 0;	// shared for the reductions
+	(*unew)[0] = (*u)[0];
+	(*unew)[n + 1] = (*u)[n + 1];
+#pragma omp parallel num_threads(threads) if(n >= parallel_min)
+	{
+	double	*src = *u, *dst = *unew;
+	double	t = 0;
+	int	tc = 0;
+	double	lastnorm[2] = { 0, 0 };
+	while (t < maxt) {
+		tc++;
+		t += ht;
+
+		// b only depends on u, which does not change before the
+		// first iteration, and each thread uses its own points
+#pragma omp for schedule(static) nowait
+		for (int j = 1; j <= n; j++) {
+			b[j] = -(src[j-1] - 2 * src[j] + src[j+1]) / hx2
+				- src[j] / ht;
+		}
+
+		int	iterations = 0;
+		while (iterations < maxiter) {
+			iterations++;
+			int	check = (epsilon > 0)
+					&& (0 == iterations % interval);
+			if (check) {
+#pragma omp single
+				{
+				change = 0;
+				umax = 0;
+				}
+#pragma omp for schedule(static) reduction(max:change,umax)
+				for (int j = 1; j <= n; j++) {
+					dst[j] = -ht * (b[j] - (src[j-1] - 2 * src[j] + src[j+1]) / hx2);
+					double	d = fabs(dst[j] - src[j]);
+					change = (d > change) ? d : change;
+					umax = (fabs(dst[j]) > umax)
+						? fabs(dst[j]) : umax;
+				}
+				lastnorm[0] = change;
+				lastnorm[1] = umax;
+				// nobody may reset the maxima before all
+				// threads have read them
+#pragma omp barrier
+			} else {
+#pragma omp for schedule(static) nowait
+				for (int j = 1; j <= n; j++) {
+					dst[j] = -ht * (b[j] - (src[j-1] - 2 * src[j] + src[j+1]) / hx2);
+				}
+#pragma omp barrier
+			}
+			double	*tmp = src; src = dst; dst = tmp;
+			if ((check) && (lastnorm[0] <= epsilon * lastnorm[1])) {
+				break;
+			}
+		}
+		if ((epsilon > 0) && (!isfinite(lastnorm[0]))) {
+			// all threads see the same norm and leave together
+#pragma omp master
+			diverged = 1;
+			break;
+		}
+#pragma omp master
+		{
+		if (verbose) {
+			if (epsilon > 0) {
+				fprintf(stderr, "step %d: %d iterations, "
+					"change %.3e\n", tc, iterations,
+					lastnorm[0]);
+			} else {
+				fprintf(stderr, "step %d: %d iterations\n",
+					tc, iterations);
+			}
+		}
+		if ((writer) && (0 == tc % steps)) {
+			writer_add(writer, tc / steps, src + 1);
+		}
+		}
+	}
+#pragma omp master
+	{
+	*u = src;
+	*unew = dst;
+	tcounter = tc;
+	norm[0] = lastnorm[0];
+	norm[1] = lastnorm[1];
+	}
+	}
+	return (diverged) ? -1 : tcounter;
+}
+
+/*
+ * Multigrid for the tridiagonal system (1 + 2c) u[j] - c (u[j-1] + u[j+1])
+ * = f[j] with c = ht / hx2 and f = -ht b. Coarse point J corresponds to
+ * fine point 2J, the coarse grid has half the points and twice the
+ * grid spacing, so c is divided by 4. This only holds if the fine grid
+ * has an odd number of points, then the boundary n + 1 of the fine grid
+ * is the boundary of the coarse grid. For even n, the last coarse point
+ * would be only one fine cell away from the boundary, so a grid with an
+ * even number of points is not coarsened further, it is the coarsest
+ * level and solved directly. Only n = 2^k m - 1 gets k coarse levels.
+ */
+#define	MG_NU	2	// smoothing steps, must be even
+#define	MG_OMEGA	(2. / 3.)	// weight of the Jacobi smoother
+
+typedef struct {
+	int	n;	// number of points, without boundary
+	double	c;	// ht / hx2 on this level
+	double	*u, *f, *r, *tmp;	// n + 2 values including boundary
+	double	*work;	// 4 n values for the direct solver, coarsest level
+} mglevel_t;
+
+/**
+ * \brief Create the grid hierarchy, returns the number of levels
+ */
+static int	mg_create(int n, double c, mglevel_t **levels) {
+	int	nlevels = 1;
+	for (int m = n; (m >= 3) && (m % 2); m /= 2) {
+		nlevels++;
+	}
+	mglevel_t	*l = (mglevel_t *)calloc(nlevels, sizeof(mglevel_t));
+	for (int i = 0; i < nlevels; i++) {
+		l[i].n = n;
+		l[i].c = c;
+		l[i].u = (double *)calloc(n + 2, sizeof(double));
+		l[i].f = (double *)calloc(n + 2, sizeof(double));
+		l[i].r = (double *)calloc(n + 2, sizeof(double));
+		l[i].tmp = (double *)calloc(n + 2, sizeof(double));
+		if (i == nlevels - 1) {
+			l[i].work = (double *)malloc(4 * n * sizeof(double));
+		}
+		n = n / 2;
+		c = c / 4;
+	}
+	*levels = l;
+	return nlevels;
+}
+
+static void	mg_free(int nlevels, mglevel_t *l) {
+	for (int i = 0; i < nlevels; i++) {
+		free(l[i].u);
+		free(l[i].f);
+		free(l[i].r);
+		free(l[i].tmp);
+		free(l[i].work);
+	}
+	free(l);
+}
+
+/**
+ * \brief Weighted Jacobi smoothing steps, in pairs so u stays in place
+ */
+static void	mg_smooth(mglevel_t *l, int sweeps, int threads) {
+	double	d = 1 + 2 * l->c;
+	double	w = MG_OMEGA / d;
+	for (int s = 0; s < sweeps; s++) {
+		double	*src = (s % 2) ? l->tmp : l->u;
+		double	*dst = (s % 2) ? l->u : l->tmp;
+#pragma omp parallel for num_threads(threads) if(l->n >= parallel_min)
+		for (int j = 1; j <= l->n; j++) {
+			dst[j] = src[j] + w * (l->f[j] - d * src[j]
+				+ l->c * (src[j - 1] + src[j + 1]));
+		}
+	}
+}
+
+/**
+ * \brief Residual r = f - A u, returns its maximum norm
+ */
+static double	mg_residual(mglevel_t *l, int threads) {
+	double	d = 1 + 2 * l->c;
+	double	rmax = 0;
+#pragma omp parallel for num_threads(threads) \
+	if(l->n >= parallel_min) reduction(max:rmax)
+	for (int j = 1; j <= l->n; j++) {
+		l->r[j] = l->f[j] - d * l->u[j]
+			+ l->c * (l->u[j - 1] + l->u[j + 1]);
+		rmax = (fabs(l->r[j]) > rmax) ? fabs(l->r[j]) : rmax;
+	}
+	return rmax;
+}
+
+/**
+ * \brief Recursive V-cycle on level i
+ *
+ * The coarsest level has at most two points, or an even number of
+ * points, and is solved directly.
+ */
+static void	mg_vcycle(mglevel_t *l, int nlevels, int i, int threads) {
+	mglevel_t	*fine = &l[i];
+	if (i == nlevels - 1) {
+		int	n = fine->n;
+		double	*sub = fine->work, *diag = sub + n, *super = diag + n;
+		double	*work = super + n;
+		for (int j = 0; j < n; j++) {
+			sub[j] = super[j] = -fine->c;
+			diag[j] = 1 + 2 * fine->c;
+			fine->u[j + 1] = fine->f[j + 1];
+		}
+		dtridiagonal(n, sub, diag, super, fine->u + 1, work);
+		return;
+	}
+	mglevel_t	*coarse = &l[i + 1];
+	mg_smooth(fine, MG_NU, threads);
+	mg_residual(fine, threads);
+
+	// full weighting restriction
+	for (int J = 1; J <= coarse->n; J++) {
+		coarse->f[J] = (fine->r[2 * J - 1] + 2 * fine->r[2 * J]
+			+ fine->r[2 * J + 1]) / 4;
+	}
+	memset(coarse->u, 0, (coarse->n + 2) * sizeof(double));
+	mg_vcycle(l, nlevels, i + 1, threads);
+
+	// linear interpolation of the correction
+	for (int j = 1; j <= fine->n; j++) {
+		const double	*e = coarse->u + j / 2;
+		fine->u[j] += (j % 2) ? (e[0] + e[1]) / 2 : e[0];
+	}
+	mg_smooth(fine, MG_NU, threads);
+}
+
+/**
+ * \brief Write a snapshot to the NetCDF file, called by the writer
+ */
+static void	write_snapshot(void *arg, int t, const double *data) {
+	output_add((heatfile_t *)arg, t, (double *)data);
+}
+
 /**
  * \brief Usage function
  *
  * Inform user about options.
  */
 void	usage(const char *progname) {
-	fprintf(stderr, "usage: %s [ -?r ] [ -n n ] [ -h timestep ] [ -s steps ] [ -t maxtime ] [ -T threads ] netcdffile\n", progname);
+	fprintf(stderr, "usage: %s [ -?frv ] [ -c interval ] [ -e epsilon ] [ -i maxiter ] [ -k depth ] [ -m method ] [ -n n ] [ -q depth ] [ -Q digits ] [ -h timestep ] [ -s steps ] [ -t maxtime ] [ -T threads ] [ -z level ] netcdffile\n", progname);
 	fprintf(stderr, "compute one-dimensional heat equation solution on a unit interval\n");
 	fprintf(stderr, "and write results to netcdf file\n");
 	fprintf(stderr, "options:\n");
+	fprintf(stderr, " -c interval    check convergence every <interval> iterations (default 5)\n");
 	fprintf(stderr, " -d             increase debug level\n");
+	fprintf(stderr, " -e epsilon     stop the jacobi iteration when the change of u is at\n");
+	fprintf(stderr, "                most <epsilon> times max |u| (default: always <maxiter>)\n");
+	fprintf(stderr, " -f             store u as float instead of double\n");
 	fprintf(stderr, " -h timestep    use different time step, in units of the maximal time step\n");
+	fprintf(stderr, " -i maxiter     maximum number of jacobi iterations per time step\n");
+	fprintf(stderr, "                (default 30, 1000 with -e, for multigrid 2, 100 with -e)\n");
+	fprintf(stderr, " -k depth       perform <depth> jacobi iterations per pass over the\n");
+	fprintf(stderr, "                data with overlapped tiling (default 1, no tiling)\n");
+	fprintf(stderr, " -m method      solver for the linear system in each time step:\n");
+	fprintf(stderr, "                jacobi (default, 30 iterations), thomas (exact, O(n))\n");
+	fprintf(stderr, "                pcr (parallel cyclic reduction, uses threads)\n");
+	fprintf(stderr, "                or multigrid (V-cycles, counted as iterations)\n");
 	fprintf(stderr, " -n n           subdivisions of interval\n");
+	fprintf(stderr, " -q depth       number of snapshots queued for the writer thread\n");
+	fprintf(stderr, "                (default 2, 0 writes in the time loop)\n");
+	fprintf(stderr, " -Q digits      keep only <digits> significant digits of u\n");
 	fprintf(stderr, " -r             dry run, don't output anything\n");
 	fprintf(stderr, " -s steps       record only solutions at a multiple of <steps>\n");
 	fprintf(stderr, " -t maxtime     do simulation up to time <maxtime>\n");
 	fprintf(stderr, " -T threads     use <threads> threads for iteration step parallelization\n");
-	fprintf(stderr, "                default is 1 thread, use carefully\n");
+	fprintf(stderr, "                default is 1 thread, loops over too few points\n");
+	fprintf(stderr, "                to pay for the threads run serially\n");
+	fprintf(stderr, " -v             log the number of iterations of each time step,\n");
+	fprintf(stderr, "                and the statistics of the writer queue\n");
+	fprintf(stderr, " -z level       compress u with zlib at <level> (1-9)\n");
 	fprintf(stderr, " -?             display this help message\n");
 }
 
@@ -42,20 +453,68 @@ int	main(int argc, char *argv[]) {
 	double	maxt = 1;	// simulate up to time 1
 	int	threads = 1;	// default number of threads
 	int	dryrun = 0;	// no dry run, write data
+	int	depth = 1;	// iterations per pass over the data
+	double	epsilon = 0;	// convergence criterion, 0: fixed iterations
+	int	maxiter = -1;	// maximum iterations per time step
+	int	interval = 5;	// iterations between convergence checks
+	int	verbose = 0;
+	int	queue = 2;	// snapshots queued for the writer thread
+	output_format_t	format = { 0, 0, 0, 0, 0 };
+	method_t	method = METHOD_JACOBI;
 
 	// parse command line
 	int	c;
-	while (EOF != (c = getopt(argc, argv, "dh:n:rs:t:T:?")))
+	while (EOF != (c = getopt(argc, argv, "c:de:fh:i:k:m:n:q:Q:rs:t:T:vz:?")))
 		switch (c) {
+		case 'c':
+			interval = atoi(optarg);
+			break;
 		case 'd':
 			debug++;
 			break;
+		case 'e':
+			epsilon = atof(optarg);
+			break;
+		case 'f':
+			format.single = 1;
+			break;
 		case 'h':
 			ht = atof(optarg);
 			break;
+		case 'i':
+			maxiter = atoi(optarg);
+			break;
+		case 'k':
+			depth = atoi(optarg);
+			if (depth < 1) {
+				fprintf(stderr, "depth must be positive\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'm':
+			if (0 == strcmp(optarg, "jacobi")) {
+				method = METHOD_JACOBI;
+			} else if (0 == strcmp(optarg, "thomas")) {
+				method = METHOD_THOMAS;
+			} else if (0 == strcmp(optarg, "pcr")) {
+				method = METHOD_PCR;
+			} else if (0 == strcmp(optarg, "multigrid")) {
+				method = METHOD_MULTIGRID;
+			} else {
+				fprintf(stderr, "unknown method %s\n", optarg);
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
 		case 'n':
 			n = atoi(optarg);
 			break;
+		case 'q':
+			queue = atoi(optarg);
+			break;
+		case 'Q':
+			format.digits = atoi(optarg);
+			break;
 		case 'r':
 			dryrun = 1;
 			break;
@@ -68,12 +527,27 @@ int	main(int argc, char *argv[]) {
 		case 'T':
 			threads = atoi(optarg);
 			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'z':
+			format.deflate = atoi(optarg);
+			format.shuffle = 1;
+			break;
 		case '?':
 			usage(argv[0]);
 			return EXIT_SUCCESS;
 			break;
 		}
 
+	if (maxiter < 0) {
+		if (method == METHOD_MULTIGRID) {
+			maxiter = (epsilon > 0) ? 100 : 2;
+		} else {
+			maxiter = (epsilon > 0) ? 1000 : 30;
+		}
+	}
+
 	// compute step size. For the iteration algorithm to be stable,
 	// the value of ht must be smaller than hx^2/4. The ht value set
 	// with the -h option is multiplied by this maximum value.
@@ -92,12 +566,19 @@ int	main(int argc, char *argv[]) {
 	}
 	char	*filename = argv[optind];
 	heatfile_t	*hf = NULL;
+	writer_t	*writer = NULL;
 	if (!dryrun) {
+		format.report = verbose;
+		output_format(&format);
 		hf = output_create(filename, hx, steps * ht, n);
 		if (NULL == hf) {
 			fprintf(stderr, "cannot create output file\n");
 			return EXIT_FAILURE;
 		}
+		writer = writer_create(queue, n, write_snapshot, hf);
+		if (NULL == writer) {
+			return EXIT_FAILURE;
+		}
 		if (debug) {
 			fprintf(stderr, "%s:%d: writing output to %s\n",
 				__FILE__, __LINE__, filename);
@@ -125,19 +606,64 @@ int	main(int argc, char *argv[]) {
 		fprintf(stderr, "%s:%d: initialization complete\n",
 			__FILE__, __LINE__);
 	}
-	if (hf) {
+	if (writer) {
 		// write the initial function to the NetCDF file
-		output_add(hf, 0, u + 1);
+		writer_add(writer, 0, u + 1);
 	}
 
-	// get start time for timing measurement
-	double	start = gettime();
-
 	// compute the solution using a time marching algorithm and an iterative
 	// algorithm to solve the linear system of equations.
 	double	t = 0;			// simulation time
 	double	hx2 = 2 * hx * hx;	// needed for second derivative
+
+	// The iteration below converges to the solution of the tridiagonal
+	// system (1 - ht * L) u = -ht * b, where L is the second difference
+	// operator divided by hx2. The direct solvers need the three
+	// diagonals of this matrix.
+	double	*sub = NULL, *diag = NULL, *super = NULL, *work = NULL;
+	if ((method == METHOD_THOMAS) || (method == METHOD_PCR)) {
+		sub = (double *)malloc(n * sizeof(double));
+		diag = (double *)malloc(n * sizeof(double));
+		super = (double *)malloc(n * sizeof(double));
+		work = (double *)malloc(8 * n * sizeof(double));
+		for (int j = 0; j < n; j++) {
+			sub[j] = -ht / hx2;
+			diag[j] = 1 + 2 * ht / hx2;
+			super[j] = -ht / hx2;
+		}
+#ifdef _OPENMP
+		omp_set_num_threads(threads);
+#endif
+	}
+
+	// multigrid works on the same system, with a hierarchy of grids
+	mglevel_t	*levels = NULL;
+	int	nlevels = 0;
+	if (method == METHOD_MULTIGRID) {
+		nlevels = mg_create(n, ht / hx2, &levels);
+	}
+
+	// loops over fewer points than this run on one thread
+	parallel_min = measure_threshold(threads);
+
+	// get start time for timing measurement
+	double	start = gettime();
+
 	int	tcounter = 0;		// counts time steps
+	int	iterations = 0;		// iterations in the current time step
+	double	norm[2] = { 0, 0 };	// change in last iteration, max |u|
+
+	// the Jordan iteration runs all time steps in one parallel region,
+	// the other methods step by step below
+	if ((method == METHOD_JACOBI) && (depth == 1)) {
+		if (jacobi_run(n, &u, &unew, b, ht, hx2, maxt, maxiter,
+			epsilon, interval, threads, steps, writer, verbose,
+			norm) < 0) {
+			fprintf(stderr, "iteration diverges, reduce time step\n");
+			return EXIT_FAILURE;
+		}
+		t = maxt;
+	}
 	while (t < maxt) {
 		tcounter++;
 		t += ht;
@@ -148,42 +674,92 @@ int	main(int argc, char *argv[]) {
 				- u[j] / ht;
 		}
 
-		// first approximation
-		unew[0] = 0;
-		unew[n + 1] = 0;
-		for (int i = 0; i < n + 2; i++) {
-			unew[i] = u[i];
-		}
-
-		// now performa iteration 30 times to get the solution
-		// of the equation for the next time step
-		for (int k = 0; k < 30; k++) {
-			// the iteration step can be parallelized as a
-			// parallel for, but one has to be very careful about
-			// the number of threads or it will not help performance
-			// at all
-#pragma omp parallel for num_threads(threads)
+		if (method == METHOD_MULTIGRID) {
+			// V-cycles starting from the current u, the
+			// convergence is checked after every cycle
+			memcpy(levels[0].u, u, (n + 2) * sizeof(double));
+			for (int j = 1; j <= n; j++) {
+				levels[0].f[j] = -ht * b[j];
+			}
+			for (iterations = 0; iterations < maxiter; ) {
+				mg_vcycle(levels, nlevels, 0, threads);
+				iterations++;
+				if (epsilon > 0) {
+					norm[0] = mg_residual(&levels[0], threads);
+					norm[1] = 0;
+					for (int j = 1; j <= n; j++) {
+						norm[1] = (fabs(levels[0].u[j]) > norm[1])
+							? fabs(levels[0].u[j]) : norm[1];
+					}
+					if (norm[0] <= epsilon * norm[1]) {
+						break;
+					}
+				}
+			}
+			memcpy(u, levels[0].u, (n + 2) * sizeof(double));
+		} else if ((method == METHOD_THOMAS) || (method == METHOD_PCR)) {
+			// the direct solvers compute the new u in one step
 			for (int j = 1; j <= n; j++) {
-				unew[j] = -ht * (b[j] - (u[j-1] - 2 * u[j] + u[j+1]) / hx2);
+				u[j] = -ht * b[j];
 			}
+			int	rc = (method == METHOD_THOMAS)
+				? dtridiagonal(n, sub, diag, super, u + 1, work)
+				: dpcr(n, sub, diag, super, u + 1, work);
+			if (rc) {
+				fprintf(stderr, "singular system\n");
+				return EXIT_FAILURE;
+			}
+		} else {
+			// the end points of unew have to contain the boundary
+			// values, the tiles only write the interior
+			unew[0] = u[0];
+			unew[n + 1] = u[n + 1];
 
-			// copy new vector to old location
-#pragma omp parallel for num_threads(threads)
-			for (int j = 0; j < n + 2; j++) {
-				u[j] = unew[j];
+			// iterations in passes of depth iterations each, the
+			// convergence is checked after each pass
+			for (iterations = 0; iterations < maxiter; ) {
+				int	sweeps = (maxiter - iterations < depth)
+						? maxiter - iterations : depth;
+				jacobi_tiled(n, u, unew, b, ht, hx2, sweeps,
+					threads, norm);
+				double	*tmp = u; u = unew; unew = tmp;
+				iterations += sweeps;
+				if ((epsilon > 0)
+					&& (norm[0] <= epsilon * norm[1])) {
+					break;
+				}
+			}
+		}
+		if ((epsilon > 0) && (!isfinite(norm[0]))) {
+			fprintf(stderr, "iteration diverges, reduce time step\n");
+			return EXIT_FAILURE;
+		}
+		if ((verbose) && ((method == METHOD_JACOBI)
+			|| (method == METHOD_MULTIGRID))) {
+			if (epsilon > 0) {
+				fprintf(stderr, "step %d: %d iterations, "
+					"change %.3e\n", tcounter, iterations,
+					norm[0]);
+			} else {
+				fprintf(stderr, "step %d: %d iterations\n",
+					tcounter, iterations);
 			}
 		}
 
 		// if the result is divisible by steps, we add a row to the
 		// output file
 		if (0 == tcounter % steps) {
-			if (hf) {
-				output_add(hf, tcounter / steps, u + 1);
+			if (writer) {
+				writer_add(writer, tcounter / steps, u + 1);
 			}
 		}
 	}
 
-	// report timing
+	// report timing, this includes waiting for the snapshots that are
+	// still queued
+	if (writer) {
+		writer_close(writer, verbose);
+	}
 	double	end = gettime();
 	printf("%d,%f,%d\n", n, end - start, threads);
 
@@ -196,6 +772,15 @@ int	main(int argc, char *argv[]) {
 	free(u);
 	free(unew);
 	free(b);
+	if (levels) {
+		mg_free(nlevels, levels);
+	}
+	if (work) {
+		free(sub);
+		free(diag);
+		free(super);
+		free(work);
+	}
 
 	return EXIT_SUCCESS;
 }
@@ -5,16 +5,26 @@
  */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
 #include <mpi.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <common.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "output.h"
 #include "image.h"
 #include "domain.h"
 #include "iteration.h"
 #include "partition.h"
 #include "boundary.h"
+#include "mg.h"
+#include "cg.h"
+#include "writer.h"
+#include "checkpoint.h"
+#include "balance.h"
 
 int	debug = 0;
 
@@ -24,39 +34,328 @@ int	debug = 0;
  * Tell user about options and command line arguments
  */
 static void	usage(const char *progname) {
-	fprintf(stderr, "usage: mpirun -n <n> %s [ -d? ] [ -b basedir ] [ -h h ] [ -s steps ] [ -t maxtime ] [ -x nx ] [ -y ny ] imagefile [ netcdffile ]\n", progname);
+	fprintf(stderr, "usage: mpirun -n <n> %s [ -d?fvBNp ] [ -b basedir ] [ -c interval ] [ -C checkpoint ] [ -e epsilon ] [ -h h ] [ -i maxiter ] [ -L steps ] [ -m method ] [ -O overhead ] [ -P precond ] [ -q depth ] [ -Q digits ] [ -R checkpoint ] [ -T threads ] [ -w omega ] [ -s steps ] [ -S ] [ -t maxtime ] [ -k depth ] [ -x nx ] [ -y ny ] [ -z level ] imagefile [ netcdffile ]\n", progname);
 	fprintf(stderr, "Solve heat equation for initial condition from <imagefile>\n");
 	fprintf(stderr, "and write results to <netcdffile>.\n");
 	fprintf(stderr, "options:\n");
 	fprintf(stderr, " -b basedir    write images to <basedir> (default: don't write images)\n");
+	fprintf(stderr, " -B            blocking exchange, don't overlap it with the iteration\n");
+	fprintf(stderr, " -c interval   check convergence every <interval> iterations (default 5)\n");
+	fprintf(stderr, " -C checkpoint write checkpoints to the file <checkpoint>, as often\n");
+	fprintf(stderr, "               as the overhead allows\n");
 	fprintf(stderr, " -d            increase debug level\n");
+	fprintf(stderr, " -e epsilon    stop iterating when the change of u is at most\n");
+	fprintf(stderr, "               <epsilon> times max |u| (default: always <maxiter>),\n");
+	fprintf(stderr, "               for CG the residual relative to the right hand side\n");
+	fprintf(stderr, " -f            store u as float instead of double\n");
 	fprintf(stderr, " -h h          h_x value to use (default 1)\n");
+	fprintf(stderr, " -i maxiter    maximum number of iterations per time step\n");
+	fprintf(stderr, "               (default 30, 1000 with -e, for multigrid 2, 100 with -e)\n");
+	fprintf(stderr, " -q depth      number of snapshots rank 0 queues for the writer\n");
+	fprintf(stderr, "               thread (default 2, 0 writes in the time loop)\n");
+	fprintf(stderr, " -Q digits     keep only <digits> significant digits of u\n");
+	fprintf(stderr, " -R checkpoint restart from the file <checkpoint>, the layout of the\n");
+	fprintf(stderr, "               patches may differ, the time step must be the same,\n");
+	fprintf(stderr, "               <netcdffile> must exist and is continued\n");
 	fprintf(stderr, " -s steps      write data/image every <steps> steps (default 1)\n");
+	fprintf(stderr, " -k depth      halo width, number of iteration steps between boundary\n");
+	fprintf(stderr, "               exchanges (default 1, jacobi only)\n");
+	fprintf(stderr, " -L steps      measure the speed of the ranks and move the patch\n");
+	fprintf(stderr, "               boundaries accordingly every <steps> steps (jacobi only)\n");
+	fprintf(stderr, " -m method     iteration method: jacobi (default), sor (red-black SOR)\n");
+	fprintf(stderr, "               multigrid (V-cycles, iterations count cycles), cg\n");
+	fprintf(stderr, "               (conjugate gradients) or pipecg (pipelined CG with\n");
+	fprintf(stderr, "               one non blocking reduction per iteration)\n");
+	fprintf(stderr, " -O overhead   fraction of the run time spent on checkpoints\n");
+	fprintf(stderr, "               (default 0.05)\n");
+	fprintf(stderr, " -p            all ranks write their patch to the NetCDF file in\n");
+	fprintf(stderr, "               parallel, instead of sending it to rank 0\n");
+	fprintf(stderr, " -P precond    preconditioner for CG: none (default), jacobi or ssor\n");
+	fprintf(stderr, " -S            copy the halo through a shared memory window,\n");
+	fprintf(stderr, "               if all ranks are on the same node\n");
 	fprintf(stderr, " -t maxtime    maximum time\n");
-	fprintf(stderr, " -x nx         number of patches in x direction (default 1)\n");
-	fprintf(stderr, " -y ny         number of patches in y direction (default 1)\n");
+	fprintf(stderr, " -T threads    threads per process for the SOR sweeps (default 1)\n");
+	fprintf(stderr, " -v            log the number of iterations of each time step, and\n");
+	fprintf(stderr, "               the time spent in the phases of the Jordan iteration\n");
+	fprintf(stderr, "               and the statistics of the writer queue\n");
+	fprintf(stderr, " -w omega      relaxation factor for SOR (default: estimated optimum)\n");
+	fprintf(stderr, "               and the SSOR preconditioner (default 1)\n");
+	fprintf(stderr, " -N            exchange the halo with neighborhood collectives\n");
+	fprintf(stderr, " -x nx         number of patches in x direction\n");
+	fprintf(stderr, " -y ny         number of patches in y direction (default: the\n");
+	fprintf(stderr, "               layout with the smallest patch perimeter)\n");
+	fprintf(stderr, " -z level      compress u with zlib at <level> (1-9)\n");
 	fprintf(stderr, "This is a MPI-programm, it cannot be run standalone. Run it using mpirun,\n");
-	fprintf(stderr, "as shown above. You must start <n> = <nx> x <ny> processes.\n");
+	fprintf(stderr, "as shown above. If both <nx> and <ny> are given, <n> must be <nx> x <ny>.\n");
 }
 
+// iterative methods to solve the linear system in each time step
+typedef enum {
+	METHOD_JACOBI, METHOD_SOR, METHOD_MULTIGRID, METHOD_CG, METHOD_PIPECG
+} method_t;
+
+/**
+ * \brief Check convergence across all processes
+ *
+ * The local norms are combined with a global reduction, which
+ * synchronizes all ranks, so this is only done every interval
+ * iterations. Returns nonzero if the change of u is small enough.
+ */
+static int	converged(const udata_t *u, const double localnorm[2],
+	double norm[2], double epsilon) {
+	MPI_Allreduce((void *)localnorm, norm, 2, MPI_DOUBLE, MPI_MAX,
+		u->comm);
+	return norm[0] <= epsilon * norm[1];
+}
+
+// time spent in the phases of the Jordan iteration, in seconds
+typedef struct {
+	double	exchange;	// posting the messages, or the whole exchange
+	double	interior;	// computation while the messages are in flight
+	double	wait;		// waiting for the halo after the interior
+	double	border;		// points next to the halo
+	double	hidden;		// communication overlapped with computation
+} timing_t;
+
+#define	CHUNK	16	// interior rows between tests for the halo
+
+/**
+ * \brief One iteration step overlapping the exchange with computation
+ *
+ * The interior of the patch does not depend on the halo, so it is
+ * computed while the messages are in flight, testing for their arrival
+ * every CHUNK rows. This also lets the MPI library progress. Only the
+ * points next to the halo have to wait for the exchange.
+ */
+static void	iterate_overlapped(udata_t *u, double **unew, int withb,
+	timing_t *timing) {
+	double	t0 = MPI_Wtime();
+	exchange_start(u, u->u);
+	double	t1 = MPI_Wtime();
+	double	arrived = 0;
+	for (int i = 2; i < u->height; i += CHUNK) {
+		if ((arrived == 0) && exchange_test(u, u->u)) {
+			arrived = MPI_Wtime();
+		}
+		iterate_interior(u, *unew, i, i + CHUNK - 1, withb);
+	}
+	double	t2 = MPI_Wtime();
+	exchange_finish(u, u->u);
+	double	t3 = MPI_Wtime();
+	iterate_border(u, *unew, withb);
+	double	t4 = MPI_Wtime();
+	double	*t = u->u; u->u = *unew; *unew = t;
+
+	timing->exchange += t1 - t0;
+	timing->interior += t2 - t1;
+	timing->wait += t3 - t2;
+	timing->border += t4 - t3;
+	timing->hidden += ((arrived > 0) ? arrived : t2) - t1;
+}
+
+/**
+ * \brief Solve the linear system with the Jordan iteration
+ *
+ * The b vector needs the current boundary values from the neighbors
+ * in the halo, and is computed in the same sweep as the first iteration
+ * step. With a halo of width k, k iteration steps can be performed
+ * between exchanges of the boundaries. With a halo of one cell, the
+ * exchange is overlapped with the computation, unless blocking is set.
+ * Returns the number of iterations performed.
+ */
+static int	solve_jacobi(udata_t *u, double **unew, double epsilon,
+	int maxiter, int interval, int blocking,
+	timing_t *timing, double norm[2]) {
+	int	k = 0;
+	int	lastcheck = 0;
+	while (k < maxiter) {
+		if ((u->halo == 1) && (!blocking)) {
+			iterate_overlapped(u, unew, k == 0, timing);
+			k++;
+		} else {
+			// synchronize current values of boundary with neighbors
+			double	t0 = MPI_Wtime();
+			exchange_boundaries(u);
+			double	t1 = MPI_Wtime();
+
+			// perform iteration steps
+			int	sweeps = (maxiter - k < u->halo)
+					? maxiter - k : u->halo;
+			iterate_blocked(u, unew, sweeps, k == 0);
+			k += sweeps;
+			timing->exchange += t1 - t0;
+			timing->interior += MPI_Wtime() - t1;
+		}
+
+		// check for convergence
+		if ((epsilon > 0) && (k - lastcheck >= interval)) {
+			double	localnorm[2];
+			update_norm(u, *unew, localnorm);
+			lastcheck = k;
+			if (converged(u, localnorm, norm, epsilon)) {
+				break;
+			}
+		}
+	}
+	return k;
+}
+
+/**
+ * \brief Solve the linear system with red-black SOR
+ *
+ * Each iteration updates the red points, exchanges the boundaries so
+ * that the neighbors see the new red values, and then does the same
+ * for the black points. Returns the number of iterations performed.
+ */
+static int	solve_sor(udata_t *u, double omega, double epsilon,
+	int maxiter, int interval, double norm[2]) {
+	exchange_boundaries(u);
+	compute_b(u);
+	int	k = 0;
+	while (k < maxiter) {
+		double	localnorm[2] = { 0, 0 };
+		for (int color = 0; color < 2; color++) {
+			sor_sweep(u, color, omega, localnorm);
+			exchange_boundaries(u);
+		}
+		k++;
+
+		// check for convergence
+		if ((epsilon > 0) && (0 == k % interval)) {
+			if (converged(u, localnorm, norm, epsilon)) {
+				break;
+			}
+		}
+	}
+	return k;
+}
+
+/**
+ * \brief Solve the linear system with multigrid V-cycles
+ *
+ * Returns the number of V-cycles performed. The convergence is checked
+ * after every cycle, because each cycle is much more expensive than
+ * the residual.
+ */
+static int	solve_multigrid(udata_t *u, mg_t *mg, double epsilon,
+	int maxiter, double norm[2]) {
+	exchange_boundaries(u);
+	compute_b(u);
+	int	k = 0;
+	while (k < maxiter) {
+		mg_vcycle(mg);
+		k++;
+
+		// check for convergence
+		if (epsilon > 0) {
+			double	localnorm[2];
+			mg_residual_norm(mg, localnorm);
+			if (converged(u, localnorm, norm, epsilon)) {
+				break;
+			}
+		}
+	}
+	return k;
+}
+
+/**
+ * \brief Solve the linear system with conjugate gradients
+ *
+ * The CG solver does its own reductions, which also give the norm of
+ * the residual, so the convergence is checked in every iteration.
+ */
+static int	solve_cg(udata_t *u, cg_t *cg, double epsilon,
+	int maxiter, double norm[2]) {
+	exchange_boundaries(u);
+	compute_b(u);
+	return cg_solve(cg, u, epsilon, maxiter, norm);
+}
+
+// destinations of the snapshots that rank 0 writes
+typedef struct {
+	heatfile_t	*hf;		// NetCDF file, or NULL
+	const char	*basedir;	// directory for FITS images, or NULL
+	int	width;
+	int	height;
+} snapshot_t;
+
+/**
+ * \brief Write a snapshot of the whole image, called by the writer
+ */
+static void	write_snapshot(void *arg, int t, const double *data) {
+	snapshot_t	*s = (snapshot_t *)arg;
+	if (s->basedir) {
+		image_t	image = { s->width, s->height, (double *)data };
+		char	outfilename[1024];
+		snprintf(outfilename, sizeof(outfilename), "%s/%05d.fits",
+			s->basedir, t);
+		writeimage(&image, outfilename);
+	}
+	if (s->hf) {
+		output2_add(s->hf, t, (double *)data);
+	}
+}
+
+#ifdef HAVE_NETCDF_PAR
+/**
+ * \brief Write the patch of this rank to a parallel output file
+ *
+ * The interior of u is copied to the contiguous buffer patch, which is
+ * then written collectively at the position of the patch in the image,
+ * so all ranks must call this for the same time value.
+ */
+static int	write_patch(heatfile_t *hf, const udata_t *u, int tvalue,
+	double *patch) {
+	for (int i = 0; i < u->height; i++) {
+		memcpy(patch + i * u->width, u->u + UINDEX(u, i + 1, 1),
+			u->width * sizeof(double));
+	}
+	const int	*range = &u->ranges[4 * u->rank];
+	return output2_add_par(hf, tvalue, range[0], range[2], u->width,
+		u->height, patch);
+}
+#endif /* HAVE_NETCDF_PAR */
+
 /**
  * \brief main function
  */
 int	main(int argc, char *argv[]) {
 	int	ierr;
 	int	num_procs;
-	int	tag = 1;
+	int	tag = 1;	// tags of the image transfers, HALO_TAG is 0
 	double	h = 1;
 	int	steps = 1;
 	double	maxtime = 1;
 	char	*basedir = NULL;
+	double	epsilon = 0;	// convergence criterion, 0: fixed iterations
+	int	maxiter = -1;	// maximum iterations per time step
+	int	interval = 5;	// iterations between convergence checks
+	int	verbose = 0;
+	method_t	method = METHOD_JACOBI;
+	double	omega = 0;	// SOR relaxation factor, 0: estimate
+	precond_t	precond = PRECOND_NONE;	// CG preconditioner
+	int	threads = 1;	// OpenMP threads per process
+	int	blocking = 0;	// don't overlap exchange and computation
+	int	parallelio = 0;	// all ranks write to the NetCDF file
+	int	queue = 2;	// snapshots queued for the writer thread
+	output_format_t	format = { 0, 0, 0, 0, 0 };
+	char	*checkpointfile = NULL;	// checkpoints are written here
+	char	*restartfile = NULL;	// checkpoint to restart from
+	double	overhead = 0.05;	// fraction of time for checkpoints
+	int	balancesteps = 0;	// steps between rebalancing, 0: never
+	timing_t	timing = { 0, 0, 0, 0, 0 };
 
 	udata_t	udata;
-	udata.nx = 1;
-	udata.ny = 1;
-
-	// initialize MPI
-	ierr = MPI_Init(&argc, &argv);
+	udata.nx = 0;	// 0: choose automatically
+	udata.ny = 0;
+	udata.collective = 0;
+	udata.sharedmem = 0;
+	udata.halo = 1;
+
+	// initialize MPI. The OpenMP threads (-T) compute between MPI
+	// calls, only the main thread calls MPI, so FUNNELED is enough
+	int	provided = MPI_THREAD_SINGLE;
+	ierr = MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
 	if (ierr) {
 		fprintf(stderr, "cannot initialize MPI: %d\n", ierr);
 		return EXIT_FAILURE;
@@ -75,26 +374,120 @@ int	main(int argc, char *argv[]) {
 
 	// parse the command line
 	int	c;
-	while (EOF != (c = getopt(argc, argv, "b:dh:r:s:t:x:y:?")))
+	while (EOF != (c = getopt(argc, argv, "b:Bc:C:de:fh:i:k:L:m:NO:pP:q:Q:r:R:s:St:T:vw:x:y:z:?")))
 		switch (c) {
+		case 'B':
+			blocking = 1;
+			break;
+		case 'c':
+			interval = atoi(optarg);
+			break;
+		case 'C':
+			checkpointfile = optarg;
+			break;
 		case 'd':
 			debug++;
 			break;
+		case 'e':
+			epsilon = atof(optarg);
+			break;
+		case 'f':
+			format.single = 1;
+			break;
 		case 'h':
 			h = atof(optarg);
 			break;
+		case 'i':
+			maxiter = atoi(optarg);
+			break;
+		case 'k':
+			udata.halo = atoi(optarg);
+			break;
+		case 'L':
+			balancesteps = atoi(optarg);
+			break;
+		case 'm':
+			if (0 == strcmp(optarg, "jacobi")) {
+				method = METHOD_JACOBI;
+			} else if (0 == strcmp(optarg, "sor")) {
+				method = METHOD_SOR;
+			} else if (0 == strcmp(optarg, "multigrid")) {
+				method = METHOD_MULTIGRID;
+			} else if (0 == strcmp(optarg, "cg")) {
+				method = METHOD_CG;
+			} else if (0 == strcmp(optarg, "pipecg")) {
+				method = METHOD_PIPECG;
+			} else {
+				fprintf(stderr, "unknown method %s\n", optarg);
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'N':
+			udata.collective = 1;
+			break;
+		case 'O':
+			overhead = atof(optarg);
+			break;
+		case 'p':
+#ifdef HAVE_NETCDF_PAR
+			parallelio = 1;
+#else
+			fprintf(stderr, "no parallel NetCDF support\n");
+			return EXIT_FAILURE;
+#endif
+			break;
+		case 'P':
+			if (0 == strcmp(optarg, "none")) {
+				precond = PRECOND_NONE;
+			} else if (0 == strcmp(optarg, "jacobi")) {
+				precond = PRECOND_JACOBI;
+			} else if (0 == strcmp(optarg, "ssor")) {
+				precond = PRECOND_SSOR;
+			} else {
+				fprintf(stderr, "unknown preconditioner %s\n",
+					optarg);
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'q':
+			queue = atoi(optarg);
+			break;
+		case 'Q':
+			format.digits = atoi(optarg);
+			break;
+		case 'R':
+			restartfile = optarg;
+			break;
 		case 's':
 			steps = atoi(optarg);
 			break;
+		case 'S':
+			udata.sharedmem = 1;
+			break;
 		case 't':
 			maxtime = atof(optarg);
 			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'T':
+			threads = atoi(optarg);
+			break;
+		case 'w':
+			omega = atof(optarg);
+			break;
 		case 'x':
 			udata.nx = atoi(optarg);
 			break;
 		case 'y':
 			udata.ny = atoi(optarg);
 			break;
+		case 'z':
+			format.deflate = atoi(optarg);
+			format.shuffle = 1;
+			break;
 		case 'b':
 			basedir = optarg;
 			break;
@@ -103,26 +496,41 @@ int	main(int argc, char *argv[]) {
 			return EXIT_SUCCESS;
 		}
 
-	// compute step sizes from h
-	udata.ht = h * h / 8;
-	udata.h2 = 2 * h * h;
+	// without FUNNELED support the process must not have any other
+	// threads than the one that calls MPI, neither OpenMP threads nor
+	// the writer thread
+	if ((provided < MPI_THREAD_FUNNELED)
+		&& ((threads > 1) || (queue > 0))) {
+		if (udata.rank == 0) {
+			fprintf(stderr, "MPI does not support threads, "
+				"using -T 1 -q 0\n");
+		}
+		threads = 1;
+		queue = 0;
+	}
+#ifdef _OPENMP
+	omp_set_num_threads(threads);
+#endif
+	if (maxiter < 0) {
+		if (method == METHOD_MULTIGRID) {
+			maxiter = (epsilon > 0) ? 100 : 2;
+		} else {
+			maxiter = (epsilon > 0) ? 1000 : 30;
+		}
+	}
 
-	// make sure the arguments are consistent
-	if (num_procs != udata.nx * udata.ny) {
-		fprintf(stderr, "number of processes does not match "
-			"dimensions: %d != %d x %d\n", num_procs, udata.nx,
-			udata.ny);
-		usage(argv[0]);
+	if ((balancesteps > 0) && (method != METHOD_JACOBI)) {
+		if (udata.rank == 0) {
+			fprintf(stderr, "load balancing needs the jacobi "
+				"method\n");
+		}
+		MPI_Finalize();
 		return EXIT_FAILURE;
 	}
 
-	// compute horizontal and vertical index of this rank
-	udata.rh = udata.rank % udata.nx;
-	udata.rv = udata.rank / udata.nx;
-	if (debug) {
-		fprintf(stderr, "%s:%d[%d]: rh = %d, rv = %d\n",
-			__FILE__, __LINE__, udata.rank, udata.rh, udata.rv);
-	}
+	// compute step sizes from h
+	udata.ht = h * h / 8;
+	udata.h2 = 2 * h * h;
 
 	// next argument is image file name
 	if (argc <= optind) {
@@ -145,29 +553,79 @@ int	main(int argc, char *argv[]) {
 	// image file and output file
 	heatfile_t      *hf = NULL;
 	image_t	*image = NULL;
-	
-	// process zero initializes and writes data
+
+	// process zero reads the image, all processes need its size to
+	// choose the layout of the patches
+	int	size[2] = { 0, 0 };
 	if (udata.rank == 0) {
-		// read the image file
 		image = readimage(imagefilename);
 		if (NULL == image) {
 			fprintf(stderr, "cannot read image\n");
-			return EXIT_FAILURE;
+		} else {
+			size[0] = image->width;
+			size[1] = image->height;
+		}
+	}
+	MPI_Bcast(size, 2, MPI_INT, 0, MPI_COMM_WORLD);
+	if (size[0] == 0) {
+		MPI_Finalize();
+		return EXIT_FAILURE;
+	}
+
+	// make sure the arguments are consistent
+	if (!choosedimensions(&udata, num_procs, size[0], size[1])) {
+		if (udata.rank == 0) {
+			fprintf(stderr, "number of processes does not match "
+				"dimensions: %d != %d x %d\n", num_procs,
+				udata.nx, udata.ny);
+			usage(argv[0]);
 		}
+		MPI_Finalize();
+		return EXIT_FAILURE;
+	}
+	if ((verbose) && (udata.rank == 0)) {
+		fprintf(stderr, "%d x %d patches\n", udata.nx, udata.ny);
+	}
+
+	// compute horizontal and vertical index of this rank, from here on
+	// all communication uses the Cartesian communicator, in which this
+	// process may have a different rank
+	createtopology(&udata);
+
+	// storage format of the NetCDF file, only rank 0 reports
+	format.report = (verbose) && (udata.rank == 0);
+	output_format(&format);
+
+	// process zero of the new communicator initializes and writes data,
+	// if the ranks were reordered, it has to read the image itself
+	if ((udata.rank == 0) && (NULL == image)) {
+		image = readimage(imagefilename);
+	}
+	if ((udata.rank != 0) && (NULL != image)) {
+		free(image->data);
+		free(image);
+		image = NULL;
+	}
+	if (udata.rank == 0) {
 		if (debug) {
 			fprintf(stderr, "%s:%d[%d]: %d x %d image read\n",
 				__FILE__, __LINE__, udata.rank,
 				image->width, image->height);
 		}
 
-		// create the output file
-		if (netcdffilename) {
+		// create the output file, a restarted run continues the
+		// file of the original run
+		if ((netcdffilename) && (!parallelio)) {
 			if (debug) {
 				fprintf(stderr, "%s:%d: creating NetCDF %s\n",
 					__FILE__, __LINE__, netcdffilename);
 			}
-			hf = output2_create(netcdffilename, h,
-				steps * udata.ht, image->width, image->height);
+			hf = (restartfile)
+				? output2_open(netcdffilename, image->width,
+					image->height)
+				: output2_create(netcdffilename, h,
+					steps * udata.ht, image->width,
+					image->height);
 			if (NULL == hf) {
 				fprintf(stderr, "cannot create output file\n");
 				return EXIT_FAILURE;
@@ -175,14 +633,24 @@ int	main(int argc, char *argv[]) {
 		}
 	}
 
-	// write the first image
-	if ((basedir) && (udata.rank == 0)) {
-		char	outfilename[1024];
-		snprintf(outfilename, sizeof(outfilename), "%s/00000.fits",
-			basedir);
-		writeimage(image, outfilename);
-	}
+	// rank 0 writes images and the NetCDF file in a background thread,
+	// parallel output is collective, so the ranks write it themselves.
+	// write_snapshot does not call MPI, as required for FUNNELED.
+	snapshot_t	snapshot = { (parallelio) ? NULL : hf, basedir,
+		size[0], size[1] };
+	writer_t	*writer = NULL;
+	if ((udata.rank == 0) && ((snapshot.hf) || (basedir))) {
+		writer = writer_create(queue, size[0] * size[1],
+			write_snapshot, &snapshot);
+		if (NULL == writer) {
+			MPI_Abort(udata.comm, EXIT_FAILURE);
+		}
 
+		// write the first image, a restarted run continues
+		if (NULL == restartfile) {
+			writer_add(writer, 0, image->data);
+		}
+	}
 	// index ranges for each rank
 	udata.ranges = (int *)malloc(4 * num_procs * sizeof(int));
 	if (udata.rank == 0) {
@@ -192,73 +660,172 @@ int	main(int argc, char *argv[]) {
 	// exchange range size information with all other ranks. The ranks
 	// then pick the dimensions they need from the array, this is
 	// the purpose of the range pointer
-	MPI_Bcast(udata.ranges, 4 * num_procs, MPI_INT, 0, MPI_COMM_WORLD);
+	MPI_Bcast(udata.ranges, 4 * num_procs, MPI_INT, 0, udata.comm);
 	int	*range = &udata.ranges[4 * udata.rank];
+
+	// the halo cannot be wider than the patches, otherwise the halo
+	// would need values from the neighbors of the neighbors
+	for (int r = 0; r < num_procs; r++) {
+		int	*rr = &udata.ranges[4 * r];
+		if ((udata.halo < 1) || (rr[1] - rr[0] < udata.halo)
+			|| (rr[3] - rr[2] < udata.halo)) {
+			if (udata.rank == 0) {
+				fprintf(stderr, "halo width %d does not fit "
+					"patch %d\n", udata.halo, r);
+			}
+			MPI_Finalize();
+			return EXIT_FAILURE;
+		}
+	}
 	if (debug) {
 		fprintf(stderr, "%s:%d:[%d]: [%d,%d) x [%d,%d)\n",
 			__FILE__, __LINE__, udata.rank,
 			range[0], range[1], range[2], range[3]);
 	}
 
+	// relaxation factor for SOR
+	if ((method == METHOD_SOR) && (omega <= 0)) {
+		omega = sor_omega(&udata);
+	}
+	if ((method == METHOD_SOR) && (verbose) && (udata.rank == 0)) {
+		fprintf(stderr, "SOR with omega = %.4f\n", omega);
+	}
+
 	// allocate memory for the area we are responsible for
 	udata.width = range[1] - range[0];
 	udata.height = range[3] - range[2];
 	allocate_u(&udata);
-	double	*unew = (double *)malloc(udata.length * sizeof(double));
+
+	// with parallel output, all ranks create the file together, the
+	// chunks are as large as the largest patch, so that each rank
+	// writes at most four chunks
+	double	*patch = NULL;
+#ifdef HAVE_NETCDF_PAR
+	if ((netcdffilename) && (parallelio)) {
+		int	chunkx = 0, chunky = 0;
+		for (int r = 0; r < num_procs; r++) {
+			int	*rr = &udata.ranges[4 * r];
+			if (rr[1] - rr[0] > chunkx) { chunkx = rr[1] - rr[0]; }
+			if (rr[3] - rr[2] > chunky) { chunky = rr[3] - rr[2]; }
+		}
+		hf = (restartfile)
+			? output2_open_par(netcdffilename, size[0], size[1],
+				udata.comm)
+			: output2_create_par(netcdffilename, h,
+				steps * udata.ht, size[0], size[1], udata.comm,
+				chunkx, chunky);
+		if (NULL == hf) {
+			fprintf(stderr, "cannot create output file\n");
+			MPI_Abort(udata.comm, EXIT_FAILURE);
+		}
+		patch = doublevector(udata.width * udata.height);
+	}
+#endif /* HAVE_NETCDF_PAR */
+	mg_t	*mg = NULL;
+	if (method == METHOD_MULTIGRID) {
+		mg = mg_create(&udata);
+	}
+	cg_t	*cg = NULL;
+	if ((method == METHOD_CG) || (method == METHOD_PIPECG)) {
+		cg = cg_create(&udata, precond, (omega > 0) ? omega : 1,
+			method == METHOD_PIPECG);
+	}
+	// with the shared memory exchange, the new values of the Jordan
+	// iteration go to the spare array in the window
+	double	*unew = (udata.spare) ? udata.spare
+				: doublevector(udata.length);
 	if (debug) {
 		fprintf(stderr, "%s:%d[%d]: arrays allocated, %d x %d\n",
 			__FILE__, __LINE__,
 			udata.rank, udata.width, udata.height);
 	}
 
-	// write initial data to the output file
-	if ((hf) && (udata.rank == 0)) {
-		output2_add(hf, 0, image->data);
-	}
-
 	// measure start time (after all allocations are done)
 	double	start = gettime();
 
 	// process 0 has to send the data to all the other processes
-	if (udata.rank == 0) {
-		for (int r = 1; r < num_procs; r++) {
-			sendimagerange(&udata, image, r, tag);
-		}
-		copyfromimage(&udata, image);
-	} else {
-		// receive my part of the matrix
-		receiverange(&udata, tag);
-	}
+	distribute_image(&udata, image, tag);
 	tag++;
 
-	// start the solver algorithm
+	// a restarted run replaces u by the values of the checkpoint and
+	// continues with its time and tag counters
 	double	t = 0;		// simulation time
 	int	tcounter = 0;	// counter for time steps
+	if (restartfile) {
+		checkpoint_t	state = { size[0], size[1], 0, 0, 0, 0 };
+		if (checkpoint_read(&udata, restartfile, &state) < 0) {
+			MPI_Abort(udata.comm, EXIT_FAILURE);
+		}
+		if (state.ht != udata.ht) {
+			if (udata.rank == 0) {
+				fprintf(stderr, "checkpoint time step %g differs "
+					"from %g\n", state.ht, udata.ht);
+			}
+			MPI_Abort(udata.comm, EXIT_FAILURE);
+		}
+		t = state.t;
+		tcounter = state.tcounter;
+		tag = state.tag;
+		if ((verbose) && (udata.rank == 0)) {
+			fprintf(stderr, "restart at step %d, t = %g\n",
+				tcounter, t);
+		}
+	}
+#ifdef HAVE_NETCDF_PAR
+	if ((hf) && (parallelio) && (NULL == restartfile)) {
+		write_patch(hf, &udata, 0, patch);
+	}
+#endif /* HAVE_NETCDF_PAR */
+
+	// checkpoints are written every checkinterval steps, the first one
+	// after one step. The interval is then chosen so that the time for
+	// a checkpoint is the fraction overhead of the time for the steps
+	// in between, as observed since the previous checkpoint.
+	int	checkinterval = 1;
+	int	lastcheckpoint = tcounter;
+	double	laststart = MPI_Wtime();
+	int	checkpoints = 0;
+	double	checkpointtime = 0;
+
+	// time spent computing at the last rebalancing
+	double	lastbusy = 0;
+	int	rebalanced = 0;
+
+	// start the solver algorithm
 	while (t < maxtime) {
 		// advance counters
 		t += udata.ht;
 		tcounter++;
 
-		// compute b vector
-		compute_b(&udata);
-
-		// copy everything to unew as the initial approximation
-		for (int i = 0; i < udata.length; i++) {
-			unew[i] = udata.u[i];
+		// solve the linear system for the new u
+		double	norm[2] = { 0, 0 };
+		int	k;
+		if (method == METHOD_SOR) {
+			k = solve_sor(&udata, omega, epsilon, maxiter,
+				interval, norm);
+		} else if (method == METHOD_MULTIGRID) {
+			k = solve_multigrid(&udata, mg, epsilon, maxiter,
+				norm);
+		} else if (cg) {
+			k = solve_cg(&udata, cg, epsilon, maxiter, norm);
+		} else {
+			k = solve_jacobi(&udata, &unew, epsilon, maxiter,
+				interval, blocking, &timing, norm);
 		}
-
-		// now perform 30 Jordan iterations
-		for (int k = 0; k < 30; k++) {
-			// synchronize current values of boundary with neighbors
-			tag++;
-			exchange_boundaries(&udata, tag);
-
-			// perform iteration step
-			iterate_u(unew, &udata);
-
-			// copy the new u to the old u
-			for (int i = 0; i < udata.length; i++) {
-				udata.u[i] = unew[i];
+		if ((epsilon > 0) && (!isfinite(norm[0]))) {
+			if (udata.rank == 0) {
+				fprintf(stderr, "iteration diverges\n");
+			}
+			MPI_Finalize();
+			return EXIT_FAILURE;
+		}
+		if ((verbose) && (udata.rank == 0)) {
+			if (epsilon > 0) {
+				fprintf(stderr, "step %d: %d iterations, "
+					"change %.3e\n", tcounter, k, norm[0]);
+			} else {
+				fprintf(stderr, "step %d: %d iterations\n",
+					tcounter, k);
 			}
 		}
 
@@ -267,26 +834,96 @@ int	main(int argc, char *argv[]) {
 			// time value for this data output
 			int	tvalue = tcounter / steps;
 
-			// output needed, so we synchronize image data
-			tag++;
-			synchronize_image(&udata, image, tag);
+			// output needed, so we synchronize image data, unless
+			// the ranks write the NetCDF file themselves and no
+			// image is needed
+			if ((basedir) || (!parallelio)) {
+				tag++;
+				synchronize_image(&udata, image, tag);
+			}
+
+			// queue the image and the solution data, the writer
+			// copies them, so the image can be overwritten
+			if (writer) {
+				writer_add(writer, tvalue, image->data);
+			}
+#ifdef HAVE_NETCDF_PAR
+			if ((hf) && (parallelio)) {
+				write_patch(hf, &udata, tvalue, patch);
+			}
+#endif /* HAVE_NETCDF_PAR */
+		}
 
-			// write an image
-			if ((basedir) && (udata.rank == 0)) {
-				char	outfilename[1024];
-				snprintf(outfilename, sizeof(outfilename),
-					"%s/%05d.fits", basedir, tvalue);
-				writeimage(image, outfilename);
+		// move the patch boundaries according to the time the ranks
+		// spent computing, the arrays with the old layout of u have
+		// to be reallocated
+		if ((balancesteps > 0) && (0 == tcounter % balancesteps)) {
+			double	busy = timing.interior + timing.border;
+			if (rebalance(&udata, busy - lastbusy)) {
+				if (NULL == udata.spare) {
+					free(unew);
+				}
+				unew = (udata.spare) ? udata.spare
+					: doublevector(udata.length);
+				if (patch) {
+					free(patch);
+					patch = doublevector(udata.width
+						* udata.height);
+				}
+				rebalanced++;
+				if ((verbose) && (udata.rank == 0)) {
+					fprintf(stderr, "step %d: patches "
+						"rebalanced\n", tcounter);
+				}
 			}
+			lastbusy = busy;
+		}
 
-			// write solution data
-			if ((hf) && (udata.rank == 0)) {
-				output2_add(hf, tvalue, image->data);
+		// write a checkpoint, all ranks use the slowest rank's
+		// times, so that they agree on the next interval
+		if ((checkpointfile)
+			&& (tcounter - lastcheckpoint >= checkinterval)) {
+			double	c0 = MPI_Wtime();
+			checkpoint_t	state = { size[0], size[1], tcounter, tag,
+				t, udata.ht };
+			if (checkpoint_write(&udata, checkpointfile, &state) < 0) {
+				MPI_Abort(udata.comm, EXIT_FAILURE);
+			}
+			double	c1 = MPI_Wtime();
+			double	times[2] = { c1 - c0,
+				(c0 - laststart) / (tcounter - lastcheckpoint) };
+			MPI_Allreduce(MPI_IN_PLACE, times, 2, MPI_DOUBLE, MPI_MAX,
+				udata.comm);
+			checkinterval = (int)ceil(times[0] / (overhead * times[1]));
+			if (checkinterval < 1) {
+				checkinterval = 1;
+			}
+			checkpoints++;
+			checkpointtime += times[0];
+			lastcheckpoint = tcounter;
+			laststart = MPI_Wtime();
+			if ((verbose) && (udata.rank == 0)) {
+				fprintf(stderr, "checkpoint at step %d: %.6fs, "
+					"step %.6fs, next after %d steps\n",
+					tcounter, times[0], times[1],
+					checkinterval);
 			}
 		}
 	}
 
-	// measure end time
+	if ((balancesteps > 0) && (verbose)) {
+		fprintf(stderr, "[%d] patch %d x %d after %d rebalancings\n",
+			udata.rank, udata.width, udata.height, rebalanced);
+	}
+	if ((checkpointfile) && (verbose) && (udata.rank == 0)) {
+		fprintf(stderr, "%d checkpoints, %.6fs\n", checkpoints,
+			checkpointtime);
+	}
+
+	// measure end time, after the queued snapshots are written
+	if (writer) {
+		writer_close(writer, verbose);
+	}
 	double	end = gettime();
 
 	// we are now done, rank 0 displays the result
@@ -295,17 +932,55 @@ int	main(int argc, char *argv[]) {
 			end - start, num_procs);
 	}
 
-	// close the netcdf file
-	if ((udata.rank == 0) && (hf)) {
-		output_close(hf);
+	// timing breakdown of the Jordan iteration for each rank
+	if ((verbose) && (method == METHOD_JACOBI)) {
+		double	*all = NULL;
+		if (udata.rank == 0) {
+			all = (double *)malloc(5 * num_procs * sizeof(double));
+		}
+		MPI_Gather(&timing, 5, MPI_DOUBLE, all, 5, MPI_DOUBLE, 0,
+			udata.comm);
+		if (udata.rank == 0) {
+			fprintf(stderr, "rank,exchange,interior,wait,border,"
+				"hidden\n");
+			for (int r = 0; r < num_procs; r++) {
+				double	*t = all + 5 * r;
+				fprintf(stderr, "%d,%.6f,%.6f,%.6f,%.6f,%.6f\n",
+					r, t[0], t[1], t[2], t[3], t[4]);
+			}
+			free(all);
+		}
 	}
 
-	// cleanup MPI
-	MPI_Finalize();
+	// close the netcdf file, with parallel output all ranks have it open
+	if (hf) {
+		output_close(hf);
+	}
+	if (patch) {
+		free(patch);
+	}
 
-	// cleanup the memory we have allocated (silence Raphael Nestler ;-)
+	// cleanup the memory we have allocated (silence Raphael Nestler ;-),
+	// this also frees the persistent requests and datatypes, so it has
+	// to happen before MPI_Finalize
 	free(udata.ranges); udata.ranges = NULL;
+	if (mg) {
+		mg_free(mg);
+	}
+	if (cg) {
+		cg_free(cg);
+	}
+	if (udata.shm.window == MPI_WIN_NULL) {
+		free(unew);
+	}
 	free_u(&udata);
 
+	// cleanup MPI
+	if (udata.shm.comm != MPI_COMM_NULL) {
+		MPI_Comm_free(&udata.shm.comm);
+	}
+	MPI_Comm_free(&udata.comm);
+	MPI_Finalize();
+
 	return EXIT_SUCCESS;
 }
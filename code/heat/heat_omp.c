@@ -0,0 +1,328 @@
+/*
+ * heat_omp.c -- OpenMP solver for the two dimensional heat equation
+ *
+ * This is the Jordan iteration of heat_mpi on a single patch covering
+ * the whole image, computed by the threads of one process instead of
+ * several processes. The rows are divided into tiles of TILE_ROWS rows,
+ * each thread gets a contiguous range of tiles, both for the iteration
+ * and for the initialization of the arrays. The operating system places
+ * a page on the NUMA node of the thread that touches it first, so each
+ * thread then iterates on memory close to its core. The computation
+ * uses the functions of iteration.c, udata_t only describes the patch,
+ * no MPI function is called.
+ *
+ * (c) 2014 Prof Dr Andreas Mueller, Hochschule Rapperswil
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <common.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "output.h"
+#include "image.h"
+#include "domain.h"
+#include "iteration.h"
+#include "writer.h"
+
+int	debug = 0;
+
+#define	TILE_ROWS	8	// rows per tile
+
+/**
+ * \brief usage function
+ */
+static void	usage(const char *progname) {
+	fprintf(stderr, "usage: %s [ -d?v ] [ -b basedir ] [ -c interval ] [ -e epsilon ] [ -h h ] [ -i maxiter ] [ -q depth ] [ -s steps ] [ -t maxtime ] [ -T threads ] imagefile [ netcdffile ]\n", progname);
+	fprintf(stderr, "Solve heat equation for initial condition from <imagefile>\n");
+	fprintf(stderr, "with OpenMP threads and write results to <netcdffile>.\n");
+	fprintf(stderr, "options:\n");
+	fprintf(stderr, " -b basedir    write images to <basedir> (default: don't write images)\n");
+	fprintf(stderr, " -c interval   check convergence every <interval> iterations (default 5)\n");
+	fprintf(stderr, " -d            increase debug level\n");
+	fprintf(stderr, " -e epsilon    stop iterating when the change of u is at most\n");
+	fprintf(stderr, "               <epsilon> times max |u| (default: always <maxiter>)\n");
+	fprintf(stderr, " -h h          h_x value to use (default 1)\n");
+	fprintf(stderr, " -i maxiter    maximum number of iterations per time step\n");
+	fprintf(stderr, "               (default 30, 1000 with -e)\n");
+	fprintf(stderr, " -q depth      number of snapshots queued for the writer thread\n");
+	fprintf(stderr, "               (default 2, 0 writes in the time loop)\n");
+	fprintf(stderr, " -s steps      write data/image every <steps> steps (default 1)\n");
+	fprintf(stderr, " -t maxtime    maximum time\n");
+	fprintf(stderr, " -T threads    number of threads (default 1)\n");
+	fprintf(stderr, " -v            log the number of iterations of each time step\n");
+}
+
+/**
+ * \brief Allocate an array with the layout of u, touched by the threads
+ *
+ * The rows are zeroed by the threads that will iterate on them, the
+ * halo rows by the first and the last thread.
+ */
+static double	*allocate_array(const udata_t *u) {
+	double	*v = (double *)malloc(u->length * sizeof(double));
+	int	tiles = (u->height + TILE_ROWS - 1) / TILE_ROWS;
+#pragma omp parallel for schedule(static)
+	for (int t = 0; t < tiles; t++) {
+		int	i0 = (t == 0) ? 0 : 1 + t * TILE_ROWS;
+		int	i1 = (t == tiles - 1) ? u->height + 1
+				: (t + 1) * TILE_ROWS;
+		memset(v + UINDEX(u, i0, 0), 0,
+			(i1 - i0 + 1) * u->stride * sizeof(double));
+	}
+	return v;
+}
+
+/**
+ * \brief Copy between the image and the points of the patch
+ */
+static void	copy_image(udata_t *u, double *data, int toimage) {
+#pragma omp parallel for schedule(static)
+	for (int i = 1; i <= u->height; i++) {
+		double	*row = data + (i - 1) * u->width;
+		if (toimage) {
+			memcpy(row, u->u + UINDEX(u, i, 1),
+				u->width * sizeof(double));
+		} else {
+			memcpy(u->u + UINDEX(u, i, 1), row,
+				u->width * sizeof(double));
+		}
+	}
+}
+
+/**
+ * \brief One iteration step, the tiles in parallel
+ *
+ * The halo is the boundary of the domain and stays 0, so the interior
+ * and border functions of heat_mpi compute the whole step. The border
+ * are only 2 (width + height) points, they are computed by one thread.
+ */
+static void	sweep(udata_t *u, double *unew, int withb) {
+	int	tiles = (u->height + TILE_ROWS - 1) / TILE_ROWS;
+#pragma omp parallel for schedule(static)
+	for (int t = 0; t < tiles; t++) {
+		iterate_interior(u, unew, 1 + t * TILE_ROWS,
+			(t + 1) * TILE_ROWS, withb);
+	}
+	iterate_border(u, unew, withb);
+}
+
+/**
+ * \brief Change of u in the last iteration step, the tiles in parallel
+ *
+ * Each tile is described by a copy of u that starts at the tile, so that
+ * update_norm can be used for it.
+ */
+static void	tile_norm(const udata_t *u, const double *uprev,
+	double norm[2]) {
+	int	tiles = (u->height + TILE_ROWS - 1) / TILE_ROWS;
+	double	change = 0, umax = 0;
+#pragma omp parallel for schedule(static) reduction(max:change,umax)
+	for (int t = 0; t < tiles; t++) {
+		udata_t	tile = *u;
+		int	offset = t * TILE_ROWS * u->stride;
+		tile.height = (u->height - t * TILE_ROWS < TILE_ROWS)
+				? u->height - t * TILE_ROWS : TILE_ROWS;
+		tile.u = u->u + offset;
+		double	tilenorm[2];
+		update_norm(&tile, uprev + offset, tilenorm);
+		change = (tilenorm[0] > change) ? tilenorm[0] : change;
+		umax = (tilenorm[1] > umax) ? tilenorm[1] : umax;
+	}
+	norm[0] = change;
+	norm[1] = umax;
+}
+
+// destinations of the snapshots
+typedef struct {
+	heatfile_t	*hf;		// NetCDF file, or NULL
+	const char	*basedir;	// directory for FITS images, or NULL
+	int	width;
+	int	height;
+} snapshot_t;
+
+/**
+ * \brief Write a snapshot of the whole image, called by the writer
+ */
+static void	write_snapshot(void *arg, int t, const double *data) {
+	snapshot_t	*s = (snapshot_t *)arg;
+	if (s->basedir) {
+		image_t	image = { s->width, s->height, (double *)data };
+		char	outfilename[1024];
+		snprintf(outfilename, sizeof(outfilename), "%s/%05d.fits",
+			s->basedir, t);
+		writeimage(&image, outfilename);
+	}
+	if (s->hf) {
+		output2_add(s->hf, t, (double *)data);
+	}
+}
+
+/**
+ * \brief main function
+ */
+int	main(int argc, char *argv[]) {
+	double	h = 1;
+	int	steps = 1;
+	double	maxtime = 1;
+	char	*basedir = NULL;
+	double	epsilon = 0;	// convergence criterion, 0: fixed iterations
+	int	maxiter = -1;	// maximum iterations per time step
+	int	interval = 5;	// iterations between convergence checks
+	int	verbose = 0;
+	int	threads = 1;
+	int	queue = 2;	// snapshots queued for the writer thread
+
+	int	c;
+	while (EOF != (c = getopt(argc, argv, "b:c:de:h:i:q:s:t:T:v?")))
+		switch (c) {
+		case 'b':
+			basedir = optarg;
+			break;
+		case 'c':
+			interval = atoi(optarg);
+			break;
+		case 'd':
+			debug++;
+			break;
+		case 'e':
+			epsilon = atof(optarg);
+			break;
+		case 'h':
+			h = atof(optarg);
+			break;
+		case 'i':
+			maxiter = atoi(optarg);
+			break;
+		case 'q':
+			queue = atoi(optarg);
+			break;
+		case 's':
+			steps = atoi(optarg);
+			break;
+		case 't':
+			maxtime = atof(optarg);
+			break;
+		case 'T':
+			threads = atoi(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case '?':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		}
+#ifdef _OPENMP
+	omp_set_num_threads(threads);
+#endif
+	if (maxiter < 0) {
+		maxiter = (epsilon > 0) ? 1000 : 30;
+	}
+
+	// image file and output file
+	if (argc <= optind) {
+		fprintf(stderr, "image file name argument missing\n");
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	image_t	*image = readimage(argv[optind++]);
+	if (NULL == image) {
+		fprintf(stderr, "cannot read image\n");
+		return EXIT_FAILURE;
+	}
+
+	// a single patch for the whole image
+	udata_t	udata;
+	memset(&udata, 0, sizeof(udata));
+	udata.ht = h * h / 8;
+	udata.h2 = 2 * h * h;
+	udata.width = image->width;
+	udata.height = image->height;
+	udata.halo = 1;
+	udata.stride = udata.width + 2;
+	udata.length = udata.stride * (udata.height + 2);
+	udata.nx = 1;
+	udata.ny = 1;
+	int	ranges[4] = { 0, image->width, 0, image->height };
+	udata.ranges = ranges;
+	udata.u = allocate_array(&udata);
+	udata.b = allocate_array(&udata);
+	double	*unew = allocate_array(&udata);
+	copy_image(&udata, image->data, 0);
+
+	heatfile_t	*hf = NULL;
+	if (argc > optind) {
+		hf = output2_create(argv[optind], h, steps * udata.ht,
+			image->width, image->height);
+		if (NULL == hf) {
+			fprintf(stderr, "cannot create output file\n");
+			return EXIT_FAILURE;
+		}
+	}
+	snapshot_t	snapshot = { hf, basedir, image->width, image->height };
+	writer_t	*writer = NULL;
+	if ((hf) || (basedir)) {
+		writer = writer_create(queue, image->width * image->height,
+			write_snapshot, &snapshot);
+		if (NULL == writer) {
+			return EXIT_FAILURE;
+		}
+		writer_add(writer, 0, image->data);
+	}
+
+	double	start = gettime();
+	double	t = 0;
+	int	tcounter = 0;
+	while (t < maxtime) {
+		t += udata.ht;
+		tcounter++;
+
+		// Jordan iteration, b is computed in the first sweep
+		int	k = 0;
+		double	norm[2] = { 0, 0 };
+		while (k < maxiter) {
+			sweep(&udata, unew, k == 0);
+			double	*tmp = udata.u; udata.u = unew; unew = tmp;
+			k++;
+			if ((epsilon > 0) && (0 == k % interval)) {
+				tile_norm(&udata, unew, norm);
+				if (norm[0] <= epsilon * norm[1]) {
+					break;
+				}
+			}
+		}
+		if ((epsilon > 0) && (!isfinite(norm[0]))) {
+			fprintf(stderr, "iteration diverges\n");
+			return EXIT_FAILURE;
+		}
+		if (verbose) {
+			fprintf(stderr, "step %d: %d iterations\n", tcounter,
+				k);
+		}
+
+		if ((writer) && (0 == tcounter % steps)) {
+			copy_image(&udata, image->data, 1);
+			writer_add(writer, tcounter / steps, image->data);
+		}
+	}
+	if (writer) {
+		writer_close(writer, verbose);
+	}
+	double	end = gettime();
+	printf("%d,%.6f,%d\n", image->width * image->height, end - start,
+		threads);
+
+	if (hf) {
+		output_close(hf);
+	}
+	free(udata.u);
+	free(udata.b);
+	free(unew);
+	free(image->data);
+	free(image);
+	return EXIT_SUCCESS;
+}
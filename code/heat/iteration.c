@@ -5,39 +5,36 @@
  */
 #include "iteration.h"
 #include "domain.h"
+#include "stencil.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <math.h>
 
-extern int	debug;
+#ifndef M_PI
+#define M_PI	3.14159265358979323846
+#endif
 
-/**
- * \brief Compute the laplacian
- *
- * This uses the U function to compute the laplacian operator at point (i,j)
- */
-static double	laplacian(const udata_t *u, int i, int j) {
-	double	l = (-4 * U(u, i, j)
-			+ U(u, i - 1, j)
-			+ U(u, i + 1, j)
-			+ U(u, i,     j - 1)
-			+ U(u, i,     j + 1)) / u->h2;
-	return l;
-}
+extern int	debug;
 
 /**
  * \brief Compute the b vector
+ *
+ * b = -laplacian(u) - u / ht, the laplacian is
+ * (u[k-s] + u[k+s] + u[k-1] + u[k+1] - 4 u[k]) / h2, so this is the
+ * stencil with cn = -1/h2 and c0 = 4/h2 - 1/ht.
  */
 void	compute_b(udata_t *u) {
 	if (debug) {
 		fprintf(stderr, "%s:%d[%d]: computation of b\n",
 			__FILE__, __LINE__, u->rank);
 	}
+	int	s = u->stride;
+	double	cn = -1. / u->h2;
+	double	c0 = 4. / u->h2 - 1. / u->ht;
 	for (int i = 1; i <= u->height; i++) {
-		for (int j = 1; j <= u->width; j++) {
-			double	b;
-			b = -laplacian(u, i, j) - U(u, i, j) / u->ht;
-			u->b[j - 1 + (i - 1) * u->width] = b;
-		}
+		int	k = UINDEX(u, i, 1);
+		stencil_row(u->width, u->u + k, s, u->u + k, u->b + k,
+			cn, c0, 0);
 	}
 	if (debug) {
 		fprintf(stderr, "%s:%d:[%d]: computation of b complete\n",
@@ -46,24 +43,251 @@ void	compute_b(udata_t *u) {
 }
 
 /**
- * \brief Compute a single u iteration step
+ * \brief Region of the arrays computed by a sweep
+ *
+ * A sweep with extension e also computes the values in the e halo
+ * cells next to each neighbor, but never the halo cells at the boundary
+ * of the domain, which must stay 0.
+ */
+typedef struct {
+	int	i0, i1;	// first and last row
+	int	j0;	// first column
+	int	n;	// number of columns
+} region_t;
+
+static region_t	sweep_region(const udata_t *u, int e) {
+	region_t	r;
+	int	left = (u->rh > 0) ? e : 0;
+	int	right = (u->rh < u->nx - 1) ? e : 0;
+	r.i0 = 1 - ((u->rv > 0) ? e : 0);
+	r.i1 = u->height + ((u->rv < u->ny - 1) ? e : 0);
+	r.j0 = 1 - left;
+	r.n = u->width + left + right;
+	return r;
+}
+
+/**
+ * \brief Perform several iteration steps between two boundary exchanges
+ *
+ * After an exchange of a halo of width w, w iteration steps can be
+ * performed without further communication: the first step also computes
+ * the values in the w - 1 halo cells next to the neighbors, the second
+ * in w - 2 cells and so on, the last one only the patch itself. This
+ * reduces the number of messages by a factor w, at the price of some
+ * redundant computation in the halo.
+ *
+ * The steps are performed as a wavefront through the rows: when row r
+ * of step 1 has been computed, row r - 1 of step 2 can be computed, and
+ * so on. The rows involved are still in the cache, so the arrays are
+ * read from memory only once for all steps. Two buffers are sufficient:
+ * when step t + 1 overwrites row r - t of step t - 1, step t no longer
+ * needs it.
+ *
+ * If withb is set, the b vector is computed in the first step, from the
+ * same rows of u. The new u ends up in u->u, *unew is the other buffer,
+ * its halo at the boundary of the domain must be 0.
  */
-void	iterate_u(double *unew, const udata_t *u) {
+void	iterate_blocked(udata_t *u, double **unew, int sweeps, int withb) {
 	if (debug) {
-		fprintf(stderr, "%s:%d[%d]: iteration step for u\n",
+		fprintf(stderr, "%s:%d[%d]: %d iteration steps%s\n",
+			__FILE__, __LINE__, u->rank, sweeps,
+			(withb) ? " and b" : "");
+	}
+	int	s = u->stride;
+	double	bcn = -1. / u->h2;
+	double	bc0 = 4. / u->h2 - 1. / u->ht;
+	double	cn = u->ht / u->h2;
+	double	c0 = -4 * cn;
+	double	cb = -u->ht;
+	double	*buffer[2] = { u->u, *unew };
+	region_t	region[sweeps];
+	for (int t = 0; t < sweeps; t++) {
+		region[t] = sweep_region(u, sweeps - 1 - t);
+	}
+	for (int r = region[0].i0; r <= region[sweeps - 1].i1 + sweeps - 1;
+		r++) {
+		for (int t = 0; t < sweeps; t++) {
+			int	i = r - t;
+			if ((i < region[t].i0) || (i > region[t].i1)) {
+				continue;
+			}
+			int	k = UINDEX(u, i, region[t].j0);
+			const double	*src = buffer[t % 2] + k;
+			double	*dst = buffer[(t + 1) % 2] + k;
+			if ((t == 0) && withb) {
+				stencil_row(region[t].n, src, s, src, u->b + k,
+					bcn, bc0, 0);
+			}
+			stencil_row(region[t].n, src, s, u->b + k, dst,
+				cn, c0, cb);
+		}
+	}
+	// after an odd number of steps, the result is in the other buffer
+	if (sweeps % 2) {
+		u->u = buffer[1];
+		*unew = buffer[0];
+	}
+	if (debug) {
+		fprintf(stderr, "%s:%d[%d]: iteration steps complete\n",
 			__FILE__, __LINE__, u->rank);
 	}
-	// perform iteration step
+}
+
+/**
+ * \brief Iteration step for the rows i0..i1, columns j0..j1 of the patch
+ *
+ * If withb is set, b is computed for the same points first.
+ */
+static void	iterate_block(udata_t *u, double *unew, int i0, int i1,
+	int j0, int j1, int withb) {
+	int	n = j1 - j0 + 1;
+	if (n <= 0) {
+		return;
+	}
+	int	s = u->stride;
+	double	bcn = -1. / u->h2;
+	double	bc0 = 4. / u->h2 - 1. / u->ht;
+	double	cn = u->ht / u->h2;
+	double	c0 = -4 * cn;
+	double	cb = -u->ht;
+	for (int i = i0; i <= i1; i++) {
+		int	k = UINDEX(u, i, j0);
+		if (withb) {
+			stencil_row(n, u->u + k, s, u->u + k, u->b + k,
+				bcn, bc0, 0);
+		}
+		stencil_row(n, u->u + k, s, u->b + k, unew + k, cn, c0, cb);
+	}
+}
+
+/**
+ * \brief Iteration step for the interior rows i0..i1 of the patch
+ *
+ * The interior are the points that have no neighbor in the halo, i.e.
+ * rows and columns 2 .. size - 1, so they can be computed while the
+ * halo is being exchanged. Rows outside 2..height - 1 are ignored, so
+ * the caller can process the interior in chunks of rows.
+ */
+void	iterate_interior(udata_t *u, double *unew, int i0, int i1,
+	int withb) {
+	i0 = (i0 < 2) ? 2 : i0;
+	i1 = (i1 > u->height - 1) ? u->height - 1 : i1;
+	iterate_block(u, unew, i0, i1, 2, u->width - 1, withb);
+}
+
+/**
+ * \brief Iteration step for the points of the patch next to the halo
+ *
+ * Together with iterate_interior, this performs the same step as
+ * iterate_blocked with a single sweep, after the exchange is complete.
+ */
+void	iterate_border(udata_t *u, double *unew, int withb) {
+	iterate_block(u, unew, 1, 1, 1, u->width, withb);
+	if (u->height > 1) {
+		iterate_block(u, unew, u->height, u->height, 1, u->width,
+			withb);
+	}
+	iterate_block(u, unew, 2, u->height - 1, 1, 1, withb);
+	if (u->width > 1) {
+		iterate_block(u, unew, 2, u->height - 1, u->width, u->width,
+			withb);
+	}
+}
+
+/**
+ * \brief Change of u in the last iteration step
+ *
+ * The difference between two consecutive iteration steps is
+ * ht (b - laplacian(u)) + u, i.e. the residual of the linear system
+ * (1 - ht laplacian) u = -ht b, so it measures how far the iteration is
+ * from the solution. norm[0] is set to the maximum of the change over
+ * the patch, norm[1] to the maximum of |u|, for a relative criterion.
+ * uprev has the same layout as u->u.
+ */
+void	update_norm(const udata_t *u, const double *uprev, double norm[2]) {
+	double	change = 0, umax = 0;
 	for (int i = 1; i <= u->height; i++) {
-		for (int j = 1; j <= u->width; j++) {
-			double	v;
-			v = -u->ht * (B(u, i, j) - laplacian(u, i, j));
-			unew[j - 1 + (i - 1) * u->width] = v;
+		int	k = UINDEX(u, i, 1);
+		const double	*ui = u->u + k;
+		const double	*uprevi = uprev + k;
+		for (int j = 0; j < u->width; j++) {
+			double	d = fabs(ui[j] - uprevi[j]);
+			double	a = fabs(ui[j]);
+			change = (d > change) ? d : change;
+			umax = (a > umax) ? a : umax;
 		}
 	}
+	norm[0] = change;
+	norm[1] = umax;
+}
+
+/**
+ * \brief One half step of red-black SOR
+ *
+ * Each point of the linear system (1 - ht laplacian) u = -ht b only
+ * couples to its four neighbors. Coloring the points like a checkerboard
+ * by the parity of the global index i + j, red points (color 0) only
+ * couple to black points (color 1) and vice versa. So all points of one
+ * color can be updated at the same time with the Gauss-Seidel formula,
+ * in any order, by any number of threads, and by all processes, if the
+ * halo contains the current values of the other color. The new value
+ * is then extrapolated by the relaxation factor omega.
+ *
+ * norm[0] and norm[1] are updated with the maximum change of u and
+ * the maximum of |u| for the convergence check.
+ */
+void	sor_sweep(udata_t *u, int color, double omega, double norm[2]) {
 	if (debug) {
-		fprintf(stderr, "%s:%d[%d]: iteration step for u complete\n",
-			__FILE__, __LINE__, u->rank);
+		fprintf(stderr, "%s:%d[%d]: SOR sweep, color %d\n",
+			__FILE__, __LINE__, u->rank, color);
+	}
+	int	s = u->stride;
+	double	c = u->ht / u->h2;
+	double	d = 1. / (1 + 4 * c);
+	// global coordinates of the point (1,1) of the patch
+	int	x0 = u->ranges[4 * u->rank + 0];
+	int	y0 = u->ranges[4 * u->rank + 2];
+	double	change = norm[0], umax = norm[1];
+#pragma omp parallel for reduction(max:change,umax)
+	for (int i = 1; i <= u->height; i++) {
+		double	*ui = u->u + UINDEX(u, i, 0);
+		const double	*bi = u->b + UINDEX(u, i, 0);
+		// first point of the row with the right color
+		int	j0 = 1 + ((x0 + y0 + i - 1 + color) & 1);
+		for (int j = j0; j <= u->width; j += 2) {
+			double	gs = d * (c * ((ui[j - s] + ui[j + s])
+					+ (ui[j - 1] + ui[j + 1]))
+					- u->ht * bi[j]);
+			double	delta = omega * (gs - ui[j]);
+			ui[j] += delta;
+			change = (fabs(delta) > change) ? fabs(delta) : change;
+			umax = (fabs(ui[j]) > umax) ? fabs(ui[j]) : umax;
+		}
 	}
+	norm[0] = change;
+	norm[1] = umax;
 }
 
+/**
+ * \brief Estimate the optimal relaxation factor for SOR
+ *
+ * For the five point laplacian on a W x H grid with zero boundary
+ * values, the largest eigenvalue of the Jacobi iteration matrix of
+ * the system (1 - ht laplacian) u = -ht b is
+ *
+ *     rho = c (2 cos(pi / (W + 1)) + 2 cos(pi / (H + 1))) / (1 + 4 c)
+ *
+ * with c = ht / h2, and the optimal relaxation factor is
+ * 2 / (1 + sqrt(1 - rho^2)). The grid size is taken from the ranges.
+ */
+double	sor_omega(const udata_t *u) {
+	int	W = 0, H = 0;
+	for (int r = 0; r < u->nx * u->ny; r++) {
+		W = (u->ranges[4 * r + 1] > W) ? u->ranges[4 * r + 1] : W;
+		H = (u->ranges[4 * r + 3] > H) ? u->ranges[4 * r + 3] : H;
+	}
+	double	c = u->ht / u->h2;
+	double	rho = c * (2 * cos(M_PI / (W + 1)) + 2 * cos(M_PI / (H + 1)))
+			/ (1 + 4 * c);
+	return 2 / (1 + sqrt(1 - rho * rho));
+}
@@ -9,6 +9,15 @@
 #include "domain.h"
 
 extern void	compute_b(udata_t *u);
-extern void	iterate_u(double *unew, const udata_t *u);
+extern void	iterate_blocked(udata_t *u, double **unew, int sweeps,
+			int withb);
+extern void	iterate_interior(udata_t *u, double *unew, int i0, int i1,
+			int withb);
+extern void	iterate_border(udata_t *u, double *unew, int withb);
+extern void	update_norm(const udata_t *u, const double *uprev,
+			double norm[2]);
+extern void	sor_sweep(udata_t *u, int color, double omega,
+			double norm[2]);
+extern double	sor_omega(const udata_t *u);
 
 #endif /* _iteration_h */
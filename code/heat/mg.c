@@ -0,0 +1,387 @@
+/*
+ * mg.c -- geometric multigrid solver for the implicit time step
+ *
+ * Each time step has to solve (1 - ht laplacian) u = -ht b, or
+ * equivalently A u = -b with A = 1/ht - laplacian. The Jordan iteration
+ * only removes the high frequency part of the error quickly, the low
+ * frequencies need O(n^2) steps. Multigrid uses a few Jordan steps as a
+ * smoother, and computes the smooth remaining error on a grid with half
+ * the resolution, recursively.
+ *
+ * Coarse grid point G corresponds to the fine grid point 2G + 1 (global
+ * indices), so every rank can compute its coarse patch from its fine
+ * patch without any communication, and the process layout is the same
+ * on all levels. When the patches become too small, the coarse problem
+ * is gathered on rank 0, which solves it with a hierarchy of its own
+ * (agglomeration), and the solution is scattered back.
+ *
+ * (c) 2014 Prof Dr Andreas Mueller, Hochschule Rapperswil
+ */
+#include "mg.h"
+#include "boundary.h"
+#include "stencil.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <mpi.h>
+
+extern int	debug;
+
+#define	NU1	2	// smoothing steps before the coarse grid correction
+#define	NU2	2	// smoothing steps after the coarse grid correction
+#define	OMEGA	0.8	// weight of the Jacobi smoother
+#define	MINSIZE	2	// minimum size of a patch on a coarse level
+#define	COARSE_SWEEPS	20	// smoothing steps on the coarsest grid
+#define	COARSE_CYCLES	2	// V-cycles for the agglomerated problem
+
+typedef struct {
+	udata_t	*u;	// patch: u = approximation, b = right hand side
+	double	*r;	// residual, same layout as u->u
+	double	*tmp;	// second buffer for the smoother
+} level_t;
+
+struct mg_s {
+	int	nlevels;
+	level_t	*level;
+	int	nprocs;
+	mg_t	*coarse;	// agglomerated problem, only on rank 0
+	int	*counts;	// number of points of each rank's patch
+	int	*displs;	// on the coarsest level, for gather/scatter
+	double	*buffer;	// coarsest level values, packed
+};
+
+/**
+ * \brief Smoothing steps: weighted Jacobi
+ *
+ * The Jacobi step u + OMEGA D^-1 (-b - A u) with D = 1/ht + 4/h2 is a
+ * five point stencil, so it uses the same kernel as the Jordan
+ * iteration.
+ */
+static void	smooth(level_t *l, int sweeps) {
+	udata_t	*u = l->u;
+	double	d = 1. / u->ht + 4. / u->h2;
+	double	cn = OMEGA / (d * u->h2);
+	double	c0 = 1 - OMEGA;
+	double	cb = -OMEGA / d;
+	for (int s = 0; s < sweeps; s++) {
+		exchange_boundaries(u);
+		for (int i = 1; i <= u->height; i++) {
+			int	k = UINDEX(u, i, 1);
+			stencil_row(u->width, u->u + k, u->stride, u->b + k,
+				l->tmp + k, cn, c0, cb);
+		}
+		double	*t = u->u; u->u = l->tmp; l->tmp = t;
+	}
+}
+
+/**
+ * \brief Compute the residual r = -b - A u on the patch
+ */
+static void	residual(level_t *l) {
+	udata_t	*u = l->u;
+	exchange_boundaries(u);
+	double	d = 1. / u->ht + 4. / u->h2;
+	for (int i = 1; i <= u->height; i++) {
+		int	k = UINDEX(u, i, 1);
+		stencil_row(u->width, u->u + k, u->stride, u->b + k,
+			l->r + k, 1. / u->h2, -d, -1);
+	}
+}
+
+/**
+ * \brief Full weighting restriction of the residual to the coarse level
+ *
+ * The coarse equation is A_c e = r_c, so the coarse right hand side is
+ * b = -r_c. The residual is needed in the halo, so it is exchanged.
+ */
+static void	restriction(level_t *fine, level_t *coarse) {
+	udata_t	*f = fine->u;
+	udata_t	*c = coarse->u;
+	exchange_array(f, fine->r);
+	int	x0 = f->ranges[4 * f->rank + 0];
+	int	y0 = f->ranges[4 * f->rank + 2];
+	int	X0 = c->ranges[4 * c->rank + 0];
+	int	Y0 = c->ranges[4 * c->rank + 2];
+	int	s = f->stride;
+	for (int I = 1; I <= c->height; I++) {
+		// fine point corresponding to coarse point (I, 1)
+		int	i = 2 * (Y0 + I - 1) + 1 - y0 + 1;
+		int	j = 2 * X0 + 1 - x0 + 1;
+		const double	*r = fine->r + UINDEX(f, i, j);
+		double	*b = c->b + UINDEX(c, I, 1);
+		for (int J = 0; J < c->width; J++, r += 2) {
+			b[J] = -(4 * r[0]
+				+ 2 * (r[-1] + r[1] + r[-s] + r[s])
+				+ (r[-s - 1] + r[-s + 1] + r[s - 1] + r[s + 1]))
+				/ 16;
+		}
+	}
+	memset(c->u, 0, c->length * sizeof(double));
+}
+
+/**
+ * \brief Bilinear interpolation of the coarse correction, added to u
+ *
+ * Fine point g lies between the coarse points (g + 1) / 2 - 1 and g / 2,
+ * which are the same point if g is odd.
+ */
+static void	prolongation(level_t *coarse, level_t *fine) {
+	udata_t	*f = fine->u;
+	udata_t	*c = coarse->u;
+	exchange_boundaries(c);
+	int	x0 = f->ranges[4 * f->rank + 0];
+	int	y0 = f->ranges[4 * f->rank + 2];
+	int	X0 = c->ranges[4 * c->rank + 0];
+	int	Y0 = c->ranges[4 * c->rank + 2];
+	int	jlo[f->width + 1], jhi[f->width + 1];
+	for (int j = 1; j <= f->width; j++) {
+		int	g = x0 + j - 1;
+		jlo[j] = (g + 1) / 2 - 1 - X0 + 1;
+		jhi[j] = g / 2 - X0 + 1;
+	}
+	for (int i = 1; i <= f->height; i++) {
+		int	g = y0 + i - 1;
+		int	ilo = (g + 1) / 2 - 1 - Y0 + 1;
+		int	ihi = g / 2 - Y0 + 1;
+		const double	*clo = c->u + UINDEX(c, ilo, 0);
+		const double	*chi = c->u + UINDEX(c, ihi, 0);
+		double	*ui = f->u + UINDEX(f, i, 0);
+		for (int j = 1; j <= f->width; j++) {
+			ui[j] += 0.25 * ((clo[jlo[j]] + clo[jhi[j]])
+				+ (chi[jlo[j]] + chi[jhi[j]]));
+		}
+	}
+}
+
+/**
+ * \brief Copy the patch of a rank to or from a packed buffer
+ *
+ * u is either the patch of the rank itself (local), or the complete
+ * domain of the agglomerated problem, where the patch is at the global
+ * position given by the ranges.
+ */
+static void	pack(const udata_t *u, const int *range, int local, double *v,
+	double *buffer, int topack) {
+	int	width = range[1] - range[0];
+	int	i0 = (local) ? 1 : range[2] + 1;
+	int	j0 = (local) ? 1 : range[0] + 1;
+	for (int i = 0; i < range[3] - range[2]; i++, buffer += width) {
+		int	k = UINDEX(u, i0 + i, j0);
+		if (topack) {
+			memcpy(buffer, v + k, width * sizeof(double));
+		} else {
+			memcpy(v + k, buffer, width * sizeof(double));
+		}
+	}
+}
+
+/**
+ * \brief Solve the problem on the coarsest level
+ *
+ * With a single process, a few smoothing steps are enough, because the
+ * coarsest grid only has a few points, and because 1/ht dominates the
+ * coarse operator. Otherwise, the right hand side is gathered on rank 0,
+ * which solves the complete problem with its own hierarchy.
+ */
+static void	coarse_solve(mg_t *mg) {
+	level_t	*l = &mg->level[mg->nlevels - 1];
+	if (mg->nprocs == 1) {
+		smooth(l, COARSE_SWEEPS);
+		return;
+	}
+	udata_t	*u = l->u;
+	int	*range = &u->ranges[4 * u->rank];
+	pack(u, range, 1, u->b, mg->buffer, 1);
+	double	*all = NULL;
+	if (mg->coarse) {
+		all = (double *)malloc((mg->displs[mg->nprocs - 1]
+			+ mg->counts[mg->nprocs - 1]) * sizeof(double));
+	}
+	MPI_Gatherv(mg->buffer, mg->counts[u->rank], MPI_DOUBLE, all,
+		mg->counts, mg->displs, MPI_DOUBLE, 0, u->comm);
+	if (mg->coarse) {
+		udata_t	*cu = mg->coarse->level[0].u;
+		for (int r = 0; r < mg->nprocs; r++) {
+			pack(cu, &u->ranges[4 * r], 0, cu->b,
+				all + mg->displs[r], 0);
+		}
+		memset(cu->u, 0, cu->length * sizeof(double));
+		// the agglomerated problem does not communicate
+		for (int c = 0; c < COARSE_CYCLES; c++) {
+			mg_vcycle(mg->coarse);
+		}
+		for (int r = 0; r < mg->nprocs; r++) {
+			pack(cu, &u->ranges[4 * r], 0, cu->u,
+				all + mg->displs[r], 1);
+		}
+	}
+	MPI_Scatterv(all, mg->counts, mg->displs, MPI_DOUBLE, mg->buffer,
+		mg->counts[u->rank], MPI_DOUBLE, 0, u->comm);
+	pack(u, range, 1, u->u, mg->buffer, 0);
+	free(all);
+}
+
+/**
+ * \brief Recursive V-cycle starting at level l
+ */
+static void	vcycle(mg_t *mg, int l) {
+	if (l == mg->nlevels - 1) {
+		coarse_solve(mg);
+		return;
+	}
+	level_t	*fine = &mg->level[l];
+	level_t	*coarse = &mg->level[l + 1];
+	smooth(fine, NU1);
+	residual(fine);
+	restriction(fine, coarse);
+	vcycle(mg, l + 1);
+	prolongation(coarse, fine);
+	smooth(fine, NU2);
+}
+
+void	mg_vcycle(mg_t *mg) {
+	if (debug) {
+		fprintf(stderr, "%s:%d[%d]: V-cycle, %d levels\n",
+			__FILE__, __LINE__, mg->level[0].u->rank, mg->nlevels);
+	}
+	vcycle(mg, 0);
+}
+
+void	mg_residual_norm(mg_t *mg, double norm[2]) {
+	level_t	*l = &mg->level[0];
+	udata_t	*u = l->u;
+	residual(l);
+	double	rmax = 0, umax = 0;
+	for (int i = 1; i <= u->height; i++) {
+		int	k = UINDEX(u, i, 1);
+		for (int j = 0; j < u->width; j++) {
+			double	r = fabs(l->r[k + j]);
+			double	a = fabs(u->u[k + j]);
+			rmax = (r > rmax) ? r : rmax;
+			umax = (a > umax) ? a : umax;
+		}
+	}
+	norm[0] = u->ht * rmax;
+	norm[1] = umax;
+}
+
+/**
+ * \brief Create the next coarser level, if all patches are big enough
+ */
+static udata_t	*coarsen(const udata_t *f) {
+	int	nprocs = f->nx * f->ny;
+	int	*ranges = (int *)malloc(4 * nprocs * sizeof(int));
+	for (int r = 0; r < 4 * nprocs; r++) {
+		ranges[r] = f->ranges[r] / 2;
+	}
+	for (int r = 0; r < nprocs; r++) {
+		if ((ranges[4 * r + 1] - ranges[4 * r + 0] < MINSIZE)
+			|| (ranges[4 * r + 3] - ranges[4 * r + 2] < MINSIZE)) {
+			free(ranges);
+			return NULL;
+		}
+	}
+	udata_t	*c = (udata_t *)malloc(sizeof(udata_t));
+	*c = *f;
+	c->ranges = ranges;
+	c->width = ranges[4 * c->rank + 1] - ranges[4 * c->rank + 0];
+	c->height = ranges[4 * c->rank + 3] - ranges[4 * c->rank + 2];
+	c->halo = 1;
+	c->h2 = 4 * f->h2;
+	c->sharedmem = 0;
+	allocate_u(c);
+	return c;
+}
+
+mg_t	*mg_create(udata_t *u) {
+	mg_t	*mg = (mg_t *)calloc(1, sizeof(mg_t));
+	mg->nprocs = u->nx * u->ny;
+
+	// build the levels until the patches become too small
+	udata_t	*levels[64];
+	int	n = 0;
+	levels[n++] = u;
+	udata_t	*c;
+	while ((n < 64) && (NULL != (c = coarsen(levels[n - 1])))) {
+		levels[n++] = c;
+	}
+	mg->nlevels = n;
+	mg->level = (level_t *)calloc(n, sizeof(level_t));
+	for (int l = 0; l < n; l++) {
+		mg->level[l].u = levels[l];
+		mg->level[l].r = doublevector(levels[l]->length);
+		mg->level[l].tmp = doublevector(levels[l]->length);
+	}
+	if (debug) {
+		fprintf(stderr, "%s:%d[%d]: %d levels, coarsest %d x %d\n",
+			__FILE__, __LINE__, u->rank, n, levels[n - 1]->width,
+			levels[n - 1]->height);
+	}
+	if (mg->nprocs == 1) {
+		return mg;
+	}
+
+	// agglomeration: rank 0 solves the complete coarsest problem
+	udata_t	*coarsest = levels[n - 1];
+	mg->counts = (int *)malloc(mg->nprocs * sizeof(int));
+	mg->displs = (int *)malloc(mg->nprocs * sizeof(int));
+	int	W = 0, H = 0, total = 0;
+	for (int r = 0; r < mg->nprocs; r++) {
+		int	*range = &coarsest->ranges[4 * r];
+		mg->counts[r] = (range[1] - range[0]) * (range[3] - range[2]);
+		mg->displs[r] = total;
+		total += mg->counts[r];
+		W = (range[1] > W) ? range[1] : W;
+		H = (range[3] > H) ? range[3] : H;
+	}
+	mg->buffer = doublevector(mg->counts[u->rank]);
+	if (u->rank == 0) {
+		udata_t	*cu = (udata_t *)malloc(sizeof(udata_t));
+		*cu = *coarsest;
+		cu->nx = 1;
+		cu->ny = 1;
+		cu->rh = 0;
+		cu->rv = 0;
+		cu->comm = MPI_COMM_SELF;
+		for (int d = 0; d < 4; d++) {
+			cu->neighbors[d] = MPI_PROC_NULL;
+		}
+		cu->collective = 0;
+		cu->sharedmem = 0;
+		cu->width = W;
+		cu->height = H;
+		cu->ranges = (int *)malloc(4 * sizeof(int));
+		cu->ranges[0] = 0; cu->ranges[1] = W;
+		cu->ranges[2] = 0; cu->ranges[3] = H;
+		allocate_u(cu);
+		mg->coarse = mg_create(cu);
+	}
+	return mg;
+}
+
+void	mg_free(mg_t *mg) {
+	// the finest level belongs to the caller, unless this is the
+	// hierarchy of an agglomerated problem
+	for (int l = 0; l < mg->nlevels; l++) {
+		free(mg->level[l].r);
+		free(mg->level[l].tmp);
+	}
+	for (int l = 1; l < mg->nlevels; l++) {
+		free_u(mg->level[l].u);
+		free(mg->level[l].u->ranges);
+		free(mg->level[l].u);
+	}
+	if (mg->coarse) {
+		udata_t	*cu = mg->coarse->level[0].u;
+		mg_free(mg->coarse);
+		free_u(cu);
+		free(cu->ranges);
+		free(cu);
+	}
+	free(mg->level);
+	free(mg->counts);
+	free(mg->displs);
+	free(mg->buffer);
+	free(mg);
+}
@@ -0,0 +1,34 @@
+/*
+ * mg.h -- geometric multigrid solver for the implicit time step
+ *
+ * (c) 2014 Prof Dr Andreas Mueller, Hochschule Rapperswil
+ */
+#ifndef _mg_h
+#define _mg_h
+
+#include "domain.h"
+
+typedef struct mg_s	mg_t;
+
+/*
+ * Build the grid hierarchy for the patches described by u. The finest
+ * level uses the arrays of u itself, so u must stay allocated while the
+ * hierarchy is in use. This is a local operation, but all ranks must
+ * call it, because all take part in the V-cycles.
+ */
+extern mg_t	*mg_create(udata_t *u);
+extern void	mg_free(mg_t *mg);
+
+/*
+ * Perform one V-cycle for the system (1 - ht laplacian) u = -ht b, with
+ * u->u as initial approximation, u->b must already have been computed.
+ */
+extern void	mg_vcycle(mg_t *mg);
+
+/*
+ * Local maximum of the residual, scaled by ht so that it is comparable
+ * to the change of an iteration step (norm[0]), and of |u| (norm[1]).
+ */
+extern void	mg_residual_norm(mg_t *mg, double norm[2]);
+
+#endif /* _mg_h */
@@ -1,20 +1,41 @@
 /*
  * output.c -- create netcdf file for heat equation simulation
  *
+ * The two dimensional array u has the dimensions (t, y, x), so that a
+ * time step is stored row by row like the image. With HAVE_NETCDF_PAR,
+ * the file can also be written by all ranks of heat_mpi in parallel,
+ * each one writing the hyperslab of its own patch. The files use the
+ * NetCDF-4 format, so that u can be chunked and compressed.
+ *
  * (c) 2014 Prof Dr Andreas Mueller, Hochschule Rapperswil
  */
 #include "output.h"
 #include <netcdf.h>
+#ifdef HAVE_NETCDF_PAR
+#include <netcdf_par.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <common.h>
 
 extern int	debug;
 
+static output_format_t	format = { 0, 0, 0, 0, 0 };
+
 /**
- * \brief create the output file, generic version
+ * \brief set the format for the files created from now on
  */
-static heatfile_t	*create0(int dim, const char *filename,
-	double h, double ht, int nx, int ny) {
+void	output_format(const output_format_t *f) {
+	format = *f;
+}
+
+/**
+ * \brief allocate the output file structure
+ */
+static heatfile_t	*allocate0(int dim, const char *filename, int nx,
+	int ny) {
 	heatfile_t	*hf = (heatfile_t *)malloc(sizeof(heatfile_t));
 	if (NULL == hf) {
 		fprintf(stderr, "cannot allocate output file structure\n");
@@ -24,20 +45,32 @@ static heatfile_t	*create0(int dim, const char *filename,
 	hf->nx = nx;
 	hf->ny = ny;
 	hf->ncid = -1;
+	hf->filename = (char *)malloc(strlen(filename) + 1);
+	strcpy(hf->filename, filename);
+	hf->slices = 0;
+	hf->bytes = 0;
+	hf->writetime = 0;
 	if (debug) {
-		fprintf(stderr, "%s:%d: creating NetCDF file %s\n",
+		fprintf(stderr, "%s:%d: using NetCDF file %s\n",
 			__FILE__, __LINE__, filename);
 	}
+	return hf;
+}
 
+/**
+ * \brief define the variables of a newly created file and write h, ht, n
+ *
+ * The u array is stored in chunks of the given size, or of one time step
+ * if chunks is NULL, with the compression and precision of the current
+ * format. Returns 0 on success, -1 on error.
+ */
+static int	define0(heatfile_t *hf, double h, double ht,
+	const size_t *chunks) {
+	int	dim = hf->dim;
+	int	nx = hf->nx;
+	int	ny = hf->ny;
 	int	status;
 
-	// create the file
-	status = nc_create(filename, NC_NOCLOBBER, &hf->ncid);
-	if (NC_NOERR != status) {
-		fprintf(stderr, "cannot create file %s: %s\n", filename,
-			nc_strerror(status));
-	}
-
 	// add variables hx, hy, and n
 	int	hid, htid, nxid, nyid;
 	status = nc_def_var(hf->ncid, "h", NC_DOUBLE, 0, NULL, &hid);
@@ -69,7 +102,7 @@ static heatfile_t	*create0(int dim, const char *filename,
 
 	// create the array dimensions
 	size_t	lenx = nx;
-	int	x_dim, y_dim, t_dim;
+	int	x_dim, y_dim = -1, t_dim;
 	if (NC_NOERR != (status = nc_def_dim(hf->ncid, "x", lenx, &x_dim))) {
 		fprintf(stderr, "cannot define x dimension: %s\n",
 			nc_strerror(status));
@@ -92,13 +125,41 @@ static heatfile_t	*create0(int dim, const char *filename,
 	}
 
 	// define the array
-	int	dimensions[3] = { t_dim, x_dim, y_dim };
-	if (NC_NOERR != (status = nc_def_var(hf->ncid, "u", NC_DOUBLE,
+	int	dimensions[3] = { t_dim, (dim == 2) ? y_dim : x_dim, x_dim };
+	if (NC_NOERR != (status = nc_def_var(hf->ncid, "u",
+		(format.single) ? NC_FLOAT : NC_DOUBLE,
 		dim + 1, dimensions, &hf->arrayid))) {
 		fprintf(stderr, "cannot define u array: %s\n",
 			nc_strerror(status));
 		goto bad;
 	}
+	size_t	slice[3] = { 1, (dim == 2) ? ny : nx, nx };
+	if (NC_NOERR != (status = nc_def_var_chunking(hf->ncid, hf->arrayid,
+		NC_CHUNKED, (chunks) ? chunks : slice))) {
+		fprintf(stderr, "cannot set chunk size: %s\n",
+			nc_strerror(status));
+		goto bad;
+	}
+	if ((format.deflate > 0) && (NC_NOERR != (status =
+		nc_def_var_deflate(hf->ncid, hf->arrayid, format.shuffle, 1,
+			format.deflate)))) {
+		fprintf(stderr, "cannot set compression: %s\n",
+			nc_strerror(status));
+		goto bad;
+	}
+	if (format.digits > 0) {
+#ifdef NC_QUANTIZE_BITGROOM
+		if (NC_NOERR != (status = nc_def_var_quantize(hf->ncid,
+			hf->arrayid, NC_QUANTIZE_BITGROOM, format.digits))) {
+			fprintf(stderr, "cannot set quantization: %s\n",
+				nc_strerror(status));
+			goto bad;
+		}
+#else
+		fprintf(stderr, "NetCDF library cannot quantize, "
+			"keeping all digits\n");
+#endif
+	}
 
 	// end define mode
 	if (NC_NOERR != (status = nc_enddef(hf->ncid))) {
@@ -134,14 +195,38 @@ static heatfile_t	*create0(int dim, const char *filename,
 			goto bad;
 		}
 	}
-
-	return hf;
+	return 0;
 bad:
-	if (hf->ncid >= 0) {
+	return -1;
+}
+
+/**
+ * \brief create the output file, generic version
+ */
+static heatfile_t	*create0(int dim, const char *filename,
+	double h, double ht, int nx, int ny) {
+	heatfile_t	*hf = allocate0(dim, filename, nx, ny);
+	if (NULL == hf) {
+		return NULL;
+	}
+
+	// create the file
+	int	status = nc_create(filename, NC_NETCDF4 | NC_NOCLOBBER,
+		&hf->ncid);
+	if (NC_NOERR != status) {
+		fprintf(stderr, "cannot create file %s: %s\n", filename,
+			nc_strerror(status));
+		free(hf->filename);
+		free(hf);
+		return NULL;
+	}
+	if (define0(hf, h, ht, NULL) < 0) {
 		nc_close(hf->ncid);
+		free(hf->filename);
+		free(hf);
+		return NULL;
 	}
-	free(hf);
-	return NULL;
+	return hf;
 }
 
 /**
@@ -161,43 +246,250 @@ fprintf(stderr, "create file %s\n", filename);
 	return create0(2, filename, h, ht, nx, ny);
 }
 
+/**
+ * \brief find the u array of an existing 2-dim file and check its size
+ *
+ * The number of time steps already in the file is stored in slices.
+ * Returns 0 on success, -1 on error.
+ */
+static int	inquire0(heatfile_t *hf) {
+	int	status;
+	if (NC_NOERR != (status = nc_inq_varid(hf->ncid, "u",
+		&hf->arrayid))) {
+		fprintf(stderr, "no u array in %s: %s\n", hf->filename,
+			nc_strerror(status));
+		return -1;
+	}
+	int	ndims = 0;
+	int	dims[3];
+	size_t	len[3];
+	if ((NC_NOERR != nc_inq_varndims(hf->ncid, hf->arrayid, &ndims))
+		|| (ndims != 3)
+		|| (NC_NOERR != nc_inq_vardimid(hf->ncid, hf->arrayid, dims))) {
+		fprintf(stderr, "u in %s is not a (t, y, x) array\n",
+			hf->filename);
+		return -1;
+	}
+	for (int k = 0; k < 3; k++) {
+		if (NC_NOERR != (status = nc_inq_dimlen(hf->ncid, dims[k],
+			&len[k]))) {
+			fprintf(stderr, "cannot get dimension of u: %s\n",
+				nc_strerror(status));
+			return -1;
+		}
+	}
+	if ((len[1] != (size_t)hf->ny) || (len[2] != (size_t)hf->nx)) {
+		fprintf(stderr, "%s is not a file for a %d x %d image\n",
+			hf->filename, hf->nx, hf->ny);
+		return -1;
+	}
+	hf->slices = len[0];
+	return 0;
+}
+
+/**
+ * \brief open an existing 2-dim output file to add more time steps
+ *
+ * This is used to continue the file when a run is restarted from a
+ * checkpoint. Time steps that are written again replace the old ones.
+ */
+heatfile_t	*output2_open(const char *filename, int nx, int ny) {
+	heatfile_t	*hf = allocate0(2, filename, nx, ny);
+	if (NULL == hf) {
+		return NULL;
+	}
+	int	status = nc_open(filename, NC_WRITE, &hf->ncid);
+	if (NC_NOERR != status) {
+		fprintf(stderr, "cannot open file %s: %s\n", filename,
+			nc_strerror(status));
+		free(hf->filename);
+		free(hf);
+		return NULL;
+	}
+	if (inquire0(hf) < 0) {
+		nc_close(hf->ncid);
+		free(hf->filename);
+		free(hf);
+		return NULL;
+	}
+	return hf;
+}
+
+/**
+ * \brief write a hyperslab and keep track of the write rate
+ *
+ * The data is converted to the type of the u array by the library.
+ */
+static int	put0(heatfile_t *hf, int t, const size_t *start,
+	const size_t *size, const double *u) {
+	double	t0 = gettime();
+	int	status = nc_put_vara_double(hf->ncid, hf->arrayid, start, size,
+		u);
+	hf->writetime += gettime() - t0;
+	if (NC_NOERR != status) {
+		fprintf(stderr, "cannot write data: %s\n",
+			nc_strerror(status));
+		return -1;
+	}
+	hf->bytes += (double)size[1] * ((hf->dim == 2) ? size[2] : 1)
+		* sizeof(double);
+	if (t >= hf->slices) {
+		hf->slices = t + 1;
+	}
+	return 0;
+}
+
 /**
  * \brief add a row to the result fiel
  */
 int	output_add(heatfile_t *hf, int t, double *u) {
 	size_t	start[2] = { t, 0 };
 	size_t	size[2] = { 1, hf->nx };
-	int	status = nc_put_vara(hf->ncid, hf->arrayid, start, size, u);
+	put0(hf, t, start, size, u);
+	return 0;
+}
+
+#ifdef HAVE_NETCDF_PAR
+/**
+ * \brief create a 2-dim output file that all ranks of comm write to
+ *
+ * This is a collective operation. The file is a NetCDF-4/HDF5 file
+ * accessed through MPI-IO, the u array is stored in chunks of
+ * chunkx x chunky points, which should match the patches, so that each
+ * rank writes whole chunks.
+ */
+heatfile_t	*output2_create_par(const char *filename, double h,
+			double ht, int nx, int ny, MPI_Comm comm,
+			int chunkx, int chunky) {
+	heatfile_t	*hf = allocate0(2, filename, nx, ny);
+	if (NULL == hf) {
+		return NULL;
+	}
+	int	status = nc_create_par(filename,
+		NC_NETCDF4 | NC_NOCLOBBER, comm, MPI_INFO_NULL, &hf->ncid);
 	if (NC_NOERR != status) {
-		fprintf(stderr, "cannot write data: %s\n",
+		fprintf(stderr, "cannot create file %s: %s\n", filename,
 			nc_strerror(status));
+		free(hf->filename);
+		free(hf);
+		return NULL;
 	}
-	return 0;
+	size_t	chunks[3] = { 1, chunky, chunkx };
+	if (define0(hf, h, ht, chunks) < 0) {
+		nc_close(hf->ncid);
+		free(hf->filename);
+		free(hf);
+		return NULL;
+	}
+
+	// all ranks write their hyperslab of each time step together
+	status = nc_var_par_access(hf->ncid, hf->arrayid, NC_COLLECTIVE);
+	if (NC_NOERR != status) {
+		fprintf(stderr, "cannot set collective access: %s\n",
+			nc_strerror(status));
+		nc_close(hf->ncid);
+		free(hf->filename);
+		free(hf);
+		return NULL;
+	}
+	return hf;
 }
 
 /**
- * \brief add a row to the result fiel
+ * \brief open an existing 2-dim output file that all ranks of comm write to
+ *
+ * This is a collective operation, the parallel version of output2_open.
+ * The chunks of the file are those chosen when it was created.
  */
-int	output2_add(heatfile_t *hf, int t, double *u) {
-	size_t	start[3] = { t, 0, 0 };
-	size_t	size[3] = { 1, hf->nx, hf->ny };
-	int	status = nc_put_vara(hf->ncid, hf->arrayid, start, size, u);
+heatfile_t	*output2_open_par(const char *filename, int nx, int ny,
+			MPI_Comm comm) {
+	heatfile_t	*hf = allocate0(2, filename, nx, ny);
+	if (NULL == hf) {
+		return NULL;
+	}
+	int	status = nc_open_par(filename, NC_WRITE, comm, MPI_INFO_NULL,
+		&hf->ncid);
 	if (NC_NOERR != status) {
-		fprintf(stderr, "cannot write data: %s\n",
+		fprintf(stderr, "cannot open file %s: %s\n", filename,
+			nc_strerror(status));
+		free(hf->filename);
+		free(hf);
+		return NULL;
+	}
+	if (inquire0(hf) < 0) {
+		nc_close(hf->ncid);
+		free(hf->filename);
+		free(hf);
+		return NULL;
+	}
+	status = nc_var_par_access(hf->ncid, hf->arrayid, NC_COLLECTIVE);
+	if (NC_NOERR != status) {
+		fprintf(stderr, "cannot set collective access: %s\n",
 			nc_strerror(status));
+		nc_close(hf->ncid);
+		free(hf->filename);
+		free(hf);
+		return NULL;
 	}
+	return hf;
+}
+
+/**
+ * \brief write the patch [x0, x0 + width) x [y0, y0 + height) of time t
+ *
+ * This is a collective operation, all ranks must call it for the same
+ * t. u contains the values of the patch row by row. Compressed chunks
+ * can only be written collectively, which is why the access to u is
+ * collective.
+ */
+int	output2_add_par(heatfile_t *hf, int t, int x0, int y0, int width,
+		int height, const double *u) {
+	size_t	start[3] = { t, y0, x0 };
+	size_t	size[3] = { 1, height, width };
+	return put0(hf, t, start, size, u);
+}
+#endif /* HAVE_NETCDF_PAR */
+
+/**
+ * \brief add a row to the result fiel
+ */
+int	output2_add(heatfile_t *hf, int t, double *u) {
+	size_t	start[3] = { t, 0, 0 };
+	size_t	size[3] = { 1, hf->ny, hf->nx };
+	put0(hf, t, start, size, u);
 	return 0;
 }
 
 /**
  * \brief close the output file
+ *
+ * Closing flushes the chunks that are still in the cache, so this time
+ * counts as write time. The compression ratio compares the size of all
+ * time steps as doubles with the size of the file.
  */
 int	output_close(heatfile_t *hf) {
 	int	status;
+	double	t0 = gettime();
 	if (NC_NOERR != (status = nc_close(hf->ncid))) {
 		fprintf(stderr, "cannot close file: %s\n", nc_strerror(status));
 		return -1;
 	}
+	hf->writetime += gettime() - t0;
+	if (format.report) {
+		struct stat	sb;
+		double	raw = (double)hf->slices * hf->nx
+				* ((hf->dim == 2) ? hf->ny : 1) * sizeof(double);
+		double	ratio = 0;
+		if ((0 == stat(hf->filename, &sb)) && (sb.st_size > 0)) {
+			ratio = raw / sb.st_size;
+		}
+		fprintf(stderr, "output: %d steps, %.1f MB in %.3fs, "
+			"%.1f MB/s, compression ratio %.2f\n", hf->slices,
+			hf->bytes / 1e6, hf->writetime,
+			(hf->writetime > 0) ? hf->bytes / 1e6 / hf->writetime : 0.,
+			ratio);
+	}
+	free(hf->filename);
 	free(hf);
 	return 0;
 }
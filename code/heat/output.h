@@ -12,8 +12,31 @@ typedef struct {
 	int	dim;
 	int	nx;
 	int	ny;
+	char	*filename;
+	int	slices;		// number of time steps in the file
+	double	bytes;		// bytes of double data written by this process
+	double	writetime;	// time spent writing and closing
 } heatfile_t;
 
+/*
+ * Storage format of the u array. The files are NetCDF-4 files, u is
+ * stored in chunks of one time step (one patch for parallel output),
+ * which can be compressed with zlib (deflate level 1-9), after the bytes
+ * have been reordered by the shuffle filter. u can be stored as float,
+ * and quantized to the given number of significant digits, which makes
+ * it compress much better.
+ */
+typedef struct {
+	int	deflate;	// zlib level, 0: no compression
+	int	shuffle;	// shuffle the bytes before compression
+	int	single;		// store float instead of double
+	int	digits;		// significant digits to keep, 0: all
+	int	report;		// report rate and compression ratio on close
+} output_format_t;
+
+// format of the files created from now on
+extern void	output_format(const output_format_t *format);
+
 extern heatfile_t	*output_create(const char *filename,
 				double hx, double ht, int n);
 extern int	output_add(heatfile_t *hf, int t, double *u);
@@ -22,6 +45,22 @@ extern heatfile_t	*output2_create(const char *filename,
 				double h, double ht, int nx, int ny);
 extern int	output2_add(heatfile_t *hf, int t, double *u);
 
+// continue an existing file, e.g. after a restart from a checkpoint
+extern heatfile_t	*output2_open(const char *filename, int nx, int ny);
+
+#ifdef HAVE_NETCDF_PAR
+#include <mpi.h>
+
+// parallel output, all ranks of comm write their own patch
+extern heatfile_t	*output2_create_par(const char *filename, double h,
+				double ht, int nx, int ny, MPI_Comm comm,
+				int chunkx, int chunky);
+extern heatfile_t	*output2_open_par(const char *filename, int nx, int ny,
+				MPI_Comm comm);
+extern int	output2_add_par(heatfile_t *hf, int t, int x0, int y0,
+			int width, int height, const double *u);
+#endif /* HAVE_NETCDF_PAR */
+
 extern int	output_close(heatfile_t *hf);
 
 #endif /* _OUTPUT_H */
@@ -14,6 +14,99 @@
 
 extern int	debug;
 
+/**
+ * \brief Choose the number of patches in x and y direction
+ *
+ * Dimensions given on the command line (nx or ny nonzero) are kept, a
+ * single missing one is filled in with MPI_Dims_create. If neither is
+ * given, all factorizations nx * ny = num_procs are tried, and the one
+ * with the smallest patch perimeter width / nx + height / ny is used,
+ * because that is what every rank has to exchange in each iteration.
+ * Returns 0 if the given dimensions do not fit the number of processes.
+ */
+int	choosedimensions(udata_t *u, int num_procs, int width, int height) {
+	if ((u->nx > 0) && (u->ny > 0)) {
+		return num_procs == u->nx * u->ny;
+	}
+	if ((u->nx > 0) || (u->ny > 0)) {
+		int	given = (u->nx > 0) ? u->nx : u->ny;
+		if (num_procs % given) {
+			return 0;
+		}
+		int	dims[2] = { u->ny, u->nx };
+		MPI_Dims_create(num_procs, 2, dims);
+		u->ny = dims[0];
+		u->nx = dims[1];
+		return 1;
+	}
+	double	best = -1;
+	for (int nx = 1; nx <= num_procs; nx++) {
+		if (num_procs % nx) {
+			continue;
+		}
+		int	ny = num_procs / nx;
+		double	perimeter = width / (double)nx + height / (double)ny;
+		if ((best < 0) || (perimeter < best)) {
+			best = perimeter;
+			u->nx = nx;
+			u->ny = ny;
+		}
+	}
+	return 1;
+}
+
+/**
+ * \brief Create the Cartesian communicator of the patches
+ *
+ * The MPI library may reorder the ranks so that neighboring patches
+ * end up on nearby cores, so the rank of this process in u->comm can
+ * differ from its rank in MPI_COMM_WORLD. The ranks are in row major
+ * order, i.e. rank = rv * nx + rh, like the ranges.
+ */
+void	createtopology(udata_t *u) {
+	int	dims[2] = { u->ny, u->nx };
+	int	periods[2] = { 0, 0 };
+	MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 1, &u->comm);
+	MPI_Comm_rank(u->comm, &u->rank);
+	int	coords[2];
+	MPI_Cart_coords(u->comm, u->rank, 2, coords);
+	u->rv = coords[0];
+	u->rh = coords[1];
+	MPI_Cart_shift(u->comm, 0, 1, &u->neighbors[TOP],
+		&u->neighbors[BOTTOM]);
+	MPI_Cart_shift(u->comm, 1, 1, &u->neighbors[LEFT],
+		&u->neighbors[RIGHT]);
+
+	// the shared memory exchange needs all ranks on the same node, the
+	// node communicator is ordered like the Cartesian one
+	u->shm.comm = MPI_COMM_NULL;
+	u->shm.window = MPI_WIN_NULL;
+	if (u->sharedmem) {
+		MPI_Comm_split_type(u->comm, MPI_COMM_TYPE_SHARED, u->rank,
+			MPI_INFO_NULL, &u->shm.comm);
+		int	nodesize, size;
+		MPI_Comm_size(u->shm.comm, &nodesize);
+		MPI_Comm_size(u->comm, &size);
+		int	alllocal = (nodesize == size);
+		MPI_Allreduce(MPI_IN_PLACE, &alllocal, 1, MPI_INT, MPI_MIN,
+			u->comm);
+		if (!alllocal) {
+			if (u->rank == 0) {
+				fprintf(stderr, "ranks on several nodes, "
+					"using messages for the halo\n");
+			}
+			MPI_Comm_free(&u->shm.comm);
+			u->sharedmem = 0;
+		}
+	}
+	if (debug) {
+		fprintf(stderr, "%s:%d[%d]: rh = %d, rv = %d, neighbors "
+			"%d %d %d %d\n", __FILE__, __LINE__, u->rank, u->rh,
+			u->rv, u->neighbors[TOP], u->neighbors[BOTTOM],
+			u->neighbors[LEFT], u->neighbors[RIGHT]);
+	}
+}
+
 /**
  * \brief Partition the domain
  *
@@ -45,79 +138,39 @@ void	partitiondomain(udata_t *u, const image_t *image) {
 }
 
 /**
- * \brief Send image data to a rank != 0 process
+ * \brief Datatype for the part of the image that belongs to a rank
  *
- * This functions sends the data for a given rank found in the image to
- * that rank. The range of data to send is found in the udata structure
- * handed in as the first argument.
+ * The rectangle is not contiguous in the image, a subarray datatype
+ * describes it, so that it can be sent or received in a single message
+ * without copying.
  */
-void	sendimagerange(const udata_t *u, const image_t *image,
-	int rank, int tag) {
-	if (debug) {
-		fprintf(stderr, "%s:%d[%d]: sending image to %d\n",
-			__FILE__, __LINE__, u->rank, rank);
-	}
-	// allocate a temporary buffer to 
-	int	width = u->ranges[4 * rank + 1] - u->ranges[4 * rank + 0];
-	int	fromrow = u->ranges[4 * rank + 2];
-	int	torow = u->ranges[4 * rank + 3];
-	int	offset = u->ranges[4 * rank + 0];
-	// send all data from rectangle r to the process r
-	for (int row = fromrow; row < torow; row++) {
-		int	ierr;
-		if (debug) {
-			fprintf(stderr, "%s:%d[%d]: sending row %d to %d\n",
-				__FILE__, __LINE__, u->rank, row, rank);
-		}
-		ierr = MPI_Send(image->data + row * image->width + offset,
-			width, MPI_DOUBLE, rank, tag, MPI_COMM_WORLD);
-		if (ierr) {
-			fprintf(stderr, "%s:%d[%d]: send error: %d\n",
-				__FILE__, __LINE__, u->rank, ierr);
-		}
-	}
-	if (debug) {
-		fprintf(stderr, "%s:%d[%d]: sending image to %d complete\n",
-			__FILE__, __LINE__, u->rank, rank);
-	}
+static MPI_Datatype	imagetype(const udata_t *u, const image_t *image,
+	int rank) {
+	const int	*range = &u->ranges[4 * rank];
+	int	sizes[2] = { image->height, image->width };
+	int	subsizes[2] = { range[3] - range[2], range[1] - range[0] };
+	int	starts[2] = { range[2], range[0] };
+	MPI_Datatype	type;
+	MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C,
+		MPI_DOUBLE, &type);
+	MPI_Type_commit(&type);
+	return type;
 }
 
 /**
- * \brief Receive image data from a different rank
+ * \brief Datatype for the points of the patch in the u array
  *
- * This function is used by rank 0 to receive image data from a different rank
- * and integrate it into the image.
+ * The type is committed, the caller has to free it.
  */
-void	receiveimagerange(const udata_t *u, image_t *image, int rank,
-	int tag) {
-	if (debug) {
-		fprintf(stderr, "%s:%d[%d]: receiving image from %d\n",
-			__FILE__, __LINE__, u->rank, rank);
-	}
-	// dimensions and parameters of data we want to receive
-	int	width = u->ranges[4 * rank + 1] - u->ranges[4 * rank + 0];
-	int	fromrow = u->ranges[4 * rank + 2];
-	int	torow = u->ranges[4 * rank + 3];
-	int	offset = u->ranges[4 * rank + 0];
-	// send all data from rectangle r to the process r
-	for (int row = fromrow; row < torow; row++) {
-		int	ierr;
-		MPI_Status	status;
-		if (debug) {
-			fprintf(stderr, "%s:%d[%d]: receive row %d from %d\n",
-				__FILE__, __LINE__, u->rank, row, rank);
-		}
-		ierr = MPI_Recv(image->data + row * image->width + offset,
-			width, MPI_DOUBLE, rank, tag, MPI_COMM_WORLD, &status);
-		if (ierr) {
-			fprintf(stderr, "%s:%d[%d]: receive error: %d\n",
-				__FILE__, __LINE__, u->rank, ierr);
-		}
-	}
-	if (debug) {
-		fprintf(stderr, "%s:%d[%d]: image from %d received\n",
-			__FILE__, __LINE__, u->rank, rank);
-	}
+MPI_Datatype	patchtype(const udata_t *u) {
+	int	sizes[2] = { u->height + 2 * u->halo, u->stride };
+	int	subsizes[2] = { u->height, u->width };
+	int	starts[2] = { u->halo, u->halo };
+	MPI_Datatype	type;
+	MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C,
+		MPI_DOUBLE, &type);
+	MPI_Type_commit(&type);
+	return type;
 }
 
 /**
@@ -134,7 +187,8 @@ void	copytoimage(const udata_t *u, image_t *image) {
 	int	fromrow = u->ranges[2];
 	int	torow = u->ranges[3];
 	for (int row = fromrow; row < torow; row++) {
-		memcpy(image->data + row * image->width, u->u + row * width,
+		memcpy(image->data + row * image->width,
+			u->u + UINDEX(u, row - fromrow + 1, 1),
 			width * sizeof(double));
 	}
 }
@@ -152,69 +206,45 @@ void	copyfromimage(udata_t *u, const image_t *image){
 	int	fromrow = u->ranges[2];
 	int	torow = u->ranges[3];
 	for (int row = fromrow; row < torow; row++) {
-		memcpy(u->u + row * width, image->data + row * image->width,
+		memcpy(u->u + UINDEX(u, row - fromrow + 1, 1),
+			image->data + row * image->width,
 			width * sizeof(double));
 	}
 }
 
 /**
- * \brief Receive initial data from rank 0
- *
- * This function is used by ranks different from 0 to receive image data
- * and stores it in the u->u data array.
- */
-void	receiverange(udata_t *u, int tag) {
-	if (debug) {
-		fprintf(stderr, "%s:%d[%d]: receiving range %d\n",
-			__FILE__, __LINE__, u->rank, u->rank);
-	}
-	MPI_Status	status;
-	for (int row = 0; row < u->height; row++) {
-		if (debug) {
-			fprintf(stderr, "%s:%d[%d]: receive row %d\n",
-				__FILE__, __LINE__, u->rank, row);
-		}
-		int	ierr;
-		ierr = MPI_Recv(u->u + row * u->width, u->width,
-			MPI_DOUBLE, 0, tag, MPI_COMM_WORLD, &status);
-		if (ierr) {
-			fprintf(stderr, "%s:%d[%d]: receive error: %d\n",
-				__FILE__, __LINE__, u->rank, ierr);
-		}
-	}
-	if (debug) {
-		fprintf(stderr, "%s:%d[%d]: range %d received\n",
-			__FILE__, __LINE__, u->rank, u->rank);
-	}
-}
-
-/**
- * \brief Send data range to rank 0
+ * \brief Distribute the initial image to the patches
  *
- * This method is used by the ranks different from 0 to send computed
- * data back to rank 0, where it can be stored in the image array.
+ * Rank 0 sends a single message to every other rank, all sends are
+ * posted at the same time, so the transfers can proceed in parallel.
  */
-void	sendrange(const udata_t *u, int tag) {
+void	distribute_image(udata_t *u, const image_t *image, int tag) {
 	if (debug) {
-		fprintf(stderr, "%s:%d[%d]: send range\n",
+		fprintf(stderr, "%s:%d[%d]: distribute image\n",
 			__FILE__, __LINE__, u->rank);
 	}
-	for (int row = 0; row < u->height; row++) {
-		if (debug) {
-			fprintf(stderr, "%s:%d[%d]: receive row %d\n",
-				__FILE__, __LINE__, u->rank, row);
+	int	num_procs = u->nx * u->ny;
+	if (u->rank == 0) {
+		MPI_Request	*requests = (MPI_Request *)malloc(
+			num_procs * sizeof(MPI_Request));
+		MPI_Datatype	*types = (MPI_Datatype *)malloc(
+			num_procs * sizeof(MPI_Datatype));
+		for (int r = 1; r < num_procs; r++) {
+			types[r] = imagetype(u, image, r);
+			MPI_Isend(image->data, 1, types[r], r, tag, u->comm,
+				&requests[r]);
 		}
-		int	ierr;
-		ierr = MPI_Send(u->u + row * u->width, u->width,
-			MPI_DOUBLE, 0, tag, MPI_COMM_WORLD);
-		if (ierr) {
-			fprintf(stderr, "%s:%d[%d]: receive error: %d\n",
-				__FILE__, __LINE__, u->rank, ierr);
+		copyfromimage(u, image);
+		MPI_Waitall(num_procs - 1, requests + 1, MPI_STATUSES_IGNORE);
+		for (int r = 1; r < num_procs; r++) {
+			MPI_Type_free(&types[r]);
 		}
-	}
-	if (debug) {
-		fprintf(stderr, "%s:%d[%d]: range %d sent\n",
-			__FILE__, __LINE__, u->rank, u->rank);
+		free(types);
+		free(requests);
+	} else {
+		MPI_Datatype	type = patchtype(u);
+		MPI_Recv(u->u, 1, type, 0, tag, u->comm, MPI_STATUS_IGNORE);
+		MPI_Type_free(&type);
 	}
 }
 
@@ -222,19 +252,33 @@ void	sendrange(const udata_t *u, int tag) {
  * \brief Synchronize image data
  *
  * This function is called by all processes and ensures computed data is
- * sent to rank 0 and integrated into the image.
+ * sent to rank 0 and integrated into the image. Every rank sends one
+ * message, rank 0 receives them in whatever order they arrive, directly
+ * into the image.
  */
 void	synchronize_image(const udata_t *u, image_t *image, int tag) {
+	int	num_procs = u->nx * u->ny;
 	if (u->rank == 0) {
-		// copy data from all other ranks
-		int	num_procs = u->nx * u->ny;
+		MPI_Request	*requests = (MPI_Request *)malloc(
+			num_procs * sizeof(MPI_Request));
+		MPI_Datatype	*types = (MPI_Datatype *)malloc(
+			num_procs * sizeof(MPI_Datatype));
 		for (int r = 1; r < num_procs; r++) {
-			receiveimagerange(u, image, r, tag);
+			types[r] = imagetype(u, image, r);
+			MPI_Irecv(image->data, 1, types[r], r, tag, u->comm,
+				&requests[r]);
 		}
 		// copy our own rank 0 data to the image
 		copytoimage(u, image);
+		MPI_Waitall(num_procs - 1, requests + 1, MPI_STATUSES_IGNORE);
+		for (int r = 1; r < num_procs; r++) {
+			MPI_Type_free(&types[r]);
+		}
+		free(types);
+		free(requests);
 	} else {
-		sendrange(u, tag);
+		MPI_Datatype	type = patchtype(u);
+		MPI_Send(u->u, 1, type, 0, tag, u->comm);
+		MPI_Type_free(&type);
 	}
 }
-
@@ -9,15 +9,14 @@
 #include "domain.h"
 #include "image.h"
 
+extern int	choosedimensions(udata_t *u, int num_procs, int width,
+			int height);
+extern void	createtopology(udata_t *u);
 extern void	partitiondomain(udata_t *u, const image_t *image);
-extern void	sendimagerange(const udata_t *u, const image_t *image,
-			int rank, int tag);
-extern void	receiveimagerange(const udata_t *u, image_t *image, int rank,
-			int tag);
+extern MPI_Datatype	patchtype(const udata_t *u);
 extern void	copytoimage(const udata_t *u, image_t *image);
 extern void	copyfromimage(udata_t *u, const image_t *image);
-extern void	receiverange(udata_t *u, int tag);
-extern void	sendrange(const udata_t *u, int tag);
+extern void	distribute_image(udata_t *u, const image_t *image, int tag);
 extern void	synchronize_image(const udata_t *u, image_t *image, int tag);
 
 #endif /* _partition_h */
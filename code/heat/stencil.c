@@ -0,0 +1,64 @@
+/*
+ * stencil.c -- vectorized five point stencil
+ *
+ * The row sweep is written with AVX-512 or AVX2/FMA intrinsics if the
+ * compiler targets these instruction sets. All divisions are replaced by
+ * multiplications with coefficients computed once by the caller.
+ *
+ * (c) 2014 Prof Dr Andreas Mueller, Hochschule Rapperswil
+ */
+#include "stencil.h"
+#if defined(__AVX512F__) || (defined(__AVX2__) && defined(__FMA__))
+#include <immintrin.h>
+#endif
+
+const char	*stencil_isa() {
+#if defined(__AVX512F__)
+	return "avx512";
+#elif defined(__AVX2__) && defined(__FMA__)
+	return "avx2";
+#else
+	return "generic";
+#endif
+}
+
+void	stencil_row(int n, const double *u, int s, const double *b,
+	double *out, double cn, double c0, double cb) {
+	int	j = 0;
+#if defined(__AVX512F__)
+	__m512d	vcn = _mm512_set1_pd(cn);
+	__m512d	vc0 = _mm512_set1_pd(c0);
+	__m512d	vcb = _mm512_set1_pd(cb);
+	for (; j + 8 <= n; j += 8) {
+		__m512d	sum = _mm512_add_pd(
+			_mm512_add_pd(_mm512_loadu_pd(u + j - s),
+				_mm512_loadu_pd(u + j + s)),
+			_mm512_add_pd(_mm512_loadu_pd(u + j - 1),
+				_mm512_loadu_pd(u + j + 1)));
+		__m512d	r = _mm512_mul_pd(vcb, _mm512_loadu_pd(b + j));
+		r = _mm512_fmadd_pd(vc0, _mm512_loadu_pd(u + j), r);
+		r = _mm512_fmadd_pd(vcn, sum, r);
+		_mm512_storeu_pd(out + j, r);
+	}
+#elif defined(__AVX2__) && defined(__FMA__)
+	__m256d	vcn = _mm256_set1_pd(cn);
+	__m256d	vc0 = _mm256_set1_pd(c0);
+	__m256d	vcb = _mm256_set1_pd(cb);
+	for (; j + 4 <= n; j += 4) {
+		__m256d	sum = _mm256_add_pd(
+			_mm256_add_pd(_mm256_loadu_pd(u + j - s),
+				_mm256_loadu_pd(u + j + s)),
+			_mm256_add_pd(_mm256_loadu_pd(u + j - 1),
+				_mm256_loadu_pd(u + j + 1)));
+		__m256d	r = _mm256_mul_pd(vcb, _mm256_loadu_pd(b + j));
+		r = _mm256_fmadd_pd(vc0, _mm256_loadu_pd(u + j), r);
+		r = _mm256_fmadd_pd(vcn, sum, r);
+		_mm256_storeu_pd(out + j, r);
+	}
+#endif
+	// remaining points, or all points if there is no vector unit
+	for (; j < n; j++) {
+		double	sum = (u[j - s] + u[j + s]) + (u[j - 1] + u[j + 1]);
+		out[j] = cn * sum + c0 * u[j] + cb * b[j];
+	}
+}
@@ -0,0 +1,25 @@
+/*
+ * stencil.h -- vectorized five point stencil
+ *
+ * (c) 2014 Prof Dr Andreas Mueller, Hochschule Rapperswil
+ */
+#ifndef _stencil_h
+#define _stencil_h
+
+/*
+ * Compute one row of
+ *
+ *     out[j] = cn * (u[j-s] + u[j+s] + u[j-1] + u[j+1]) + c0 * u[j] + cb * b[j]
+ *
+ * for j = 0..n-1, where s is the length of a row of the array u. Both
+ * the computation of b and the iteration step are of this form. If the
+ * b term is not needed, pass cb = 0 and b = u, this costs no memory
+ * traffic because u[j] has to be read anyway.
+ */
+extern void	stencil_row(int n, const double *u, int s, const double *b,
+			double *out, double cn, double c0, double cb);
+
+/* instruction set the stencil was compiled for */
+extern const char	*stencil_isa();
+
+#endif /* _stencil_h */
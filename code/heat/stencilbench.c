@@ -0,0 +1,116 @@
+/*
+ * stencilbench.c -- measure the performance of the stencil kernel
+ *
+ * For each grid size given on the command line, this program performs
+ * a number of iteration sweeps with the same stencil as iterate_interior
+ * and reports the grid points per second and the memory bandwidth this
+ * corresponds to. As a reference for the bandwidth, the STREAM triad
+ * a[i] = b[i] + q c[i] is measured on arrays of comparable size.
+ *
+ * (c) 2014 Prof Dr Andreas Mueller, Hochschule Rapperswil
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+#include "common.h"
+#include "stencil.h"
+
+/*
+ * Each grid point reads u and b and writes unew, the neighbours of u
+ * come from the cache. Like STREAM, we do not count the write allocate.
+ */
+#define	BYTES_PER_POINT	24
+
+/**
+ * \brief STREAM triad bandwidth in GB/s for arrays of n doubles
+ */
+static double	triad(int n, int repeats) {
+	double	*a = (double *)malloc(n * sizeof(double));
+	double	*b = (double *)malloc(n * sizeof(double));
+	double	*c = (double *)malloc(n * sizeof(double));
+	for (int i = 0; i < n; i++) {
+		a[i] = 0; b[i] = 1; c[i] = 2;
+	}
+	double	best = -1;
+	for (int r = 0; r < repeats; r++) {
+		double	start = gettime();
+		for (int i = 0; i < n; i++) {
+			a[i] = b[i] + 3. * c[i];
+		}
+		double	t = gettime() - start;
+		if ((best < 0) || (t < best)) {
+			best = t;
+		}
+	}
+	// prevent the compiler from removing the loop
+	if (a[n / 2] != 7.) {
+		fprintf(stderr, "%s:%d: triad wrong\n", __FILE__, __LINE__);
+	}
+	free(a); free(b); free(c);
+	// STREAM counts 3 arrays, i.e. without the write allocate
+	return 3. * sizeof(double) * n / best / 1e9;
+}
+
+static void	usage(const char *progname) {
+	fprintf(stderr, "usage: %s [ -r repeats ] n ...\n", progname);
+	fprintf(stderr, "measure the performance of the five point stencil "
+		"on n x n grids\n");
+	fprintf(stderr, "options:\n");
+	fprintf(stderr, " -r repeats number of sweeps per size\n");
+}
+
+int	main(int argc, char *argv[]) {
+	int	repeats = 10;
+	int	c;
+	while (EOF != (c = getopt(argc, argv, "r:?")))
+		switch (c) {
+		case 'r':
+			repeats = atoi(optarg);
+			break;
+		case '?':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		}
+
+	init_gettime();
+	fprintf(stderr, "%s stencil kernel\n", stencil_isa());
+	printf("n,time,mpoints,gbytes,stream,percent\n");
+	for (; optind < argc; optind++) {
+		int	n = atoi(argv[optind]);
+		if (n <= 0) {
+			fprintf(stderr, "not a valid number: %s\n",
+				argv[optind]);
+			continue;
+		}
+
+		// grids with halo, like in heat_mpi
+		int	s = n + 2;
+		int	length = s * s;
+		double	*u = random_double_matrix(s, s);
+		double	*b = random_double_matrix(s, s);
+		double	*unew = random_double_matrix(s, s);
+		double	ht = 1. / 8, h2 = 2;
+		double	best = -1;
+		for (int r = 0; r < repeats; r++) {
+			double	start = gettime();
+			for (int i = 1; i <= n; i++) {
+				int	k = i * s + 1;
+				stencil_row(n, u + k, s, b + k, unew + k,
+					ht / h2, -4 * ht / h2, -ht);
+			}
+			double	t = gettime() - start;
+			if ((best < 0) || (t < best)) {
+				best = t;
+			}
+			double	*tmp = u; u = unew; unew = tmp;
+		}
+		double	points = (double)n * n / best;
+		double	gbytes = BYTES_PER_POINT * points / 1e9;
+		double	stream = triad(length, repeats);
+		printf("%d,%.6f,%.1f,%.2f,%.2f,%.1f\n", n, best, points / 1e6,
+			gbytes, stream, 100 * gbytes / stream);
+		fflush(stdout);
+		free(u); free(b); free(unew);
+	}
+	return EXIT_SUCCESS;
+}
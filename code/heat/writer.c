@@ -0,0 +1,185 @@
+/*
+ * writer.c -- write snapshots of the solution in a background thread
+ *
+ * Writing a snapshot to the NetCDF file or to a FITS image takes time
+ * during which the solver could already compute the next time steps.
+ * The snapshot is therefore copied into a ring of slots, and a thread
+ * writes the slots in order. If the thread cannot keep up, the queue
+ * fills, and the solver has to wait for a free slot. The statistics
+ * show whether this happens, i.e. whether a deeper queue or less
+ * frequent output is needed.
+ *
+ * (c) 2014 Prof Dr Andreas Mueller, Hochschule Rapperswil
+ */
+#include "writer.h"
+#include <common.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern int	debug;
+
+struct writer_s {
+	int	slots;		// number of snapshots the queue can hold
+	int	size;		// number of doubles per snapshot
+	double	*data;		// slots * size doubles
+	int	*t;		// time value of each slot
+	int	head;		// next slot to write
+	int	count;		// number of slots in use
+	int	done;		// no more snapshots will be added
+	writefunc_t	write;
+	void	*arg;
+	pthread_t	thread;
+	pthread_mutex_t	lock;
+	pthread_cond_t	notempty;
+	pthread_cond_t	notfull;
+	// statistics
+	int	snapshots;
+	int	maxdepth;	// largest number of queued snapshots
+	double	depthsum;	// sum of the queue depth after each add
+	int	stalls;		// number of adds that found the queue full
+	double	stalltime;	// time spent waiting for a free slot
+	double	writetime;	// time spent in the write function
+};
+
+/**
+ * \brief Writer thread: write the queued snapshots in order
+ *
+ * The slot stays in use while it is written, so that writer_add cannot
+ * overwrite it.
+ */
+static void	*writer_main(void *arg) {
+	writer_t	*w = (writer_t *)arg;
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while ((w->count == 0) && (!w->done)) {
+			pthread_cond_wait(&w->notempty, &w->lock);
+		}
+		if (w->count == 0) {
+			break;
+		}
+		int	slot = w->head;
+		pthread_mutex_unlock(&w->lock);
+
+		double	t0 = gettime();
+		w->write(w->arg, w->t[slot], w->data + slot * (size_t)w->size);
+		double	t1 = gettime();
+
+		pthread_mutex_lock(&w->lock);
+		w->writetime += t1 - t0;
+		w->head = (w->head + 1) % w->slots;
+		w->count--;
+		pthread_cond_signal(&w->notfull);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+/**
+ * \brief Create a writer, and start its thread if slots > 0
+ */
+writer_t	*writer_create(int slots, int size, writefunc_t write,
+	void *arg) {
+	writer_t	*w = (writer_t *)calloc(1, sizeof(writer_t));
+	if (NULL == w) {
+		fprintf(stderr, "cannot allocate writer\n");
+		return NULL;
+	}
+	w->slots = (slots > 0) ? slots : 0;
+	w->size = size;
+	w->write = write;
+	w->arg = arg;
+	if (w->slots == 0) {
+		return w;
+	}
+	w->data = (double *)malloc(w->slots * (size_t)size * sizeof(double));
+	w->t = (int *)malloc(w->slots * sizeof(int));
+	if ((NULL == w->data) || (NULL == w->t)) {
+		fprintf(stderr, "cannot allocate %d snapshot slots\n", slots);
+		free(w->data);
+		free(w->t);
+		free(w);
+		return NULL;
+	}
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->notempty, NULL);
+	pthread_cond_init(&w->notfull, NULL);
+	if (pthread_create(&w->thread, NULL, writer_main, w)) {
+		fprintf(stderr, "cannot start writer thread\n");
+		w->slots = 0;
+	}
+	if (debug) {
+		fprintf(stderr, "%s:%d: writer with %d slots of %d values\n",
+			__FILE__, __LINE__, w->slots, size);
+	}
+	return w;
+}
+
+/**
+ * \brief Queue a snapshot for writing
+ *
+ * The slot after the last queued one belongs to the caller until count
+ * is incremented, so the copy can be done without holding the lock.
+ */
+void	writer_add(writer_t *w, int t, const double *data) {
+	w->snapshots++;
+	if (w->slots == 0) {
+		double	t0 = gettime();
+		w->write(w->arg, t, data);
+		w->writetime += gettime() - t0;
+		return;
+	}
+	pthread_mutex_lock(&w->lock);
+	if (w->count == w->slots) {
+		double	t0 = gettime();
+		w->stalls++;
+		while (w->count == w->slots) {
+			pthread_cond_wait(&w->notfull, &w->lock);
+		}
+		w->stalltime += gettime() - t0;
+	}
+	int	slot = (w->head + w->count) % w->slots;
+	pthread_mutex_unlock(&w->lock);
+
+	memcpy(w->data + slot * (size_t)w->size, data,
+		w->size * sizeof(double));
+	w->t[slot] = t;
+
+	pthread_mutex_lock(&w->lock);
+	w->count++;
+	if (w->count > w->maxdepth) {
+		w->maxdepth = w->count;
+	}
+	w->depthsum += w->count;
+	pthread_cond_signal(&w->notempty);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/**
+ * \brief Drain the queue, stop the thread and free the writer
+ */
+void	writer_close(writer_t *w, int verbose) {
+	double	t0 = gettime();
+	if (w->slots > 0) {
+		pthread_mutex_lock(&w->lock);
+		w->done = 1;
+		pthread_cond_signal(&w->notempty);
+		pthread_mutex_unlock(&w->lock);
+		pthread_join(w->thread, NULL);
+		pthread_mutex_destroy(&w->lock);
+		pthread_cond_destroy(&w->notempty);
+		pthread_cond_destroy(&w->notfull);
+	}
+	double	drain = gettime() - t0;
+	if (verbose) {
+		fprintf(stderr, "writer: %d snapshots, %d slots, queue depth "
+			"max %d mean %.2f, %d stalls %.6fs, writing %.6fs, "
+			"drain %.6fs\n", w->snapshots, w->slots, w->maxdepth,
+			(w->snapshots) ? w->depthsum / w->snapshots : 0.,
+			w->stalls, w->stalltime, w->writetime, drain);
+	}
+	free(w->data);
+	free(w->t);
+	free(w);
+}
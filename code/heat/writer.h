@@ -0,0 +1,38 @@
+/*
+ * writer.h -- write snapshots of the solution in a background thread
+ *
+ * (c) 2014 Prof Dr Andreas Mueller, Hochschule Rapperswil
+ */
+#ifndef _writer_h
+#define _writer_h
+
+/*
+ * Function that writes the snapshot data for time value t. It runs in
+ * the writer thread, so it must never call MPI: MPI programs using a
+ * writer only need MPI_THREAD_FUNNELED, where only the main thread may
+ * make MPI calls.
+ */
+typedef void	(*writefunc_t)(void *arg, int t, const double *data);
+
+typedef struct writer_s	writer_t;
+
+/*
+ * Create a writer for snapshots of size doubles, with a queue of slots
+ * snapshots. With slots = 0, writer_add calls write directly.
+ */
+extern writer_t	*writer_create(int slots, int size, writefunc_t write,
+			void *arg);
+
+/*
+ * Copy the snapshot into the queue and return. If the queue is full,
+ * this waits until the writer thread has finished a snapshot.
+ */
+extern void	writer_add(writer_t *w, int t, const double *data);
+
+/*
+ * Wait until all snapshots are written, then stop the thread. With
+ * verbose set, the queue statistics are reported on stderr.
+ */
+extern void	writer_close(writer_t *w, int verbose);
+
+#endif /* _writer_h */
@@ -14,6 +14,7 @@
 #include <alloca.h>
 #include <getopt.h>
 #include <common.h>
+#include <clu.h>
 #include <fitsio.h>
 #include <complex.h>
 #include "point.h"
@@ -22,49 +23,6 @@
 
 int	debug = 0;
 
-/*
- * \brief Auxiliary function to read OpenCL code from a file
- *
- * This function reads the contents of a file and invokes the
- * clCreateProgramWithSource to create a program.
- */
-cl_program	cluCreateProgramWithFile(cl_context context,
-			const char *filename, cl_int *err) {
-	// first check that the file exists, but using stat will also give
-	// the file size which can later be used to size a buffer
-	struct stat	sb;
-	if (stat(filename, &sb) < 0) {
-		*err = -1;
-		return NULL;
-	}
-
-	// open the file for reading
-	int	fd = open(filename, O_RDONLY);
-	if (fd < 0) {
-		*err = -1;
-		return NULL;
-	}
-
-	// read the file data into a memory buffer, allocated on the stack
-	// from the file size info in the stat structure received previously
-	size_t	length[1];
-	length[0] = sb.st_size;
-	char	*source[1];
-	source[0] = alloca(sb.st_size);
-	if (sb.st_size != read(fd, source[0], sb.st_size)) {
-		*err = -1;
-		return NULL;
-	}
-	close(fd);
-
-	// use the clCreateProgramWithSource function to create the program
-	cl_program	program;
-	program = clCreateProgramWithSource(context, 1, (const char **)source,
-		length, err);
-
-	return program;
-}
-
 /**
  * \brief Compute an optimal work group dimensions
  *
@@ -356,21 +314,7 @@ int	main(int argc, char *argv[]) {
 			__FILE__, __LINE__);
 	}
 
-	// create a program from a source file. There is no OpenCL function
-	// to read a program from a file, so we supply a uitility function
-	// for this purpose.
-	cl_program	program = cluCreateProgramWithFile(context,
-				"julia1.cl", &err);
-	if (!program) {
-		fprintf(stderr, "%s:%d: cannot create program: %d\n",
-			__FILE__, __LINE__, err);
-		return EXIT_FAILURE;
-	}
-	if (debug) {
-		fprintf(stderr, "%s:%d: got program\n", __FILE__, __LINE__);
-	}
-
-	// compile a program. The compiler accepts flags, and we would like
+	// the compiler accepts flags, and we would like
 	// to use them to control some aspects of our implementation, in
 	// particular the use of vector primitives.
 	char	flags[200];
@@ -390,21 +334,13 @@ int	main(int argc, char *argv[]) {
 		strcat(flags, " -DDEBUG");
 	}
 
-	err = clBuildProgram(program, 1, &device_id, flags, NULL, NULL);
-	if (err) {
-		fprintf(stderr, "%s:%d: cannot compile program: %d\n",
-			__FILE__, __LINE__, err);
-		size_t	l = 32 * 1024;
-		char	*log = (char *)malloc(l);
-		err = clGetProgramBuildInfo(program, device_id,
-			CL_PROGRAM_BUILD_LOG,
-			l, log, &l);
-		if (err) {
-			fprintf(stderr, "%s:%d: cannot retrieve log: %d\n",
-				__FILE__, __LINE__, err);
-			return EXIT_FAILURE;
-		}
-		fprintf(stderr, "compile log:\n%*s\n", (int)l, log);
+	// create and compile the program. The compiled binary is cached,
+	// so only the first run with a given device, source and set of
+	// flags has to pay for the compilation.
+	clu_debug = debug;
+	cl_program	program = cluBuildProgramCached(context, device_id,
+		"julia1.cl", flags, &err);
+	if (!program) {
 		return EXIT_FAILURE;
 	}
 	if (debug) {